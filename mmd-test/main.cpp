@@ -28,36 +28,790 @@ THE SOFTWARE.
 #include "SPFilesystem.h"
 #include "SPLog.h"
 #include "MMDHtmlOutputProcessor.h"
+#include "MMDEngine.h"
+#include "MMDContent.h"
+#include "MMDCore.h"
 
 #include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <deque>
 
 NS_SP_EXT_BEGIN(app)
 
-void processFile(const String &path, bool print) {
-	auto text = filesystem::readTextFile(path);
-	if (!text.empty()) {
-		auto name = filepath::name(path);
-		auto target = filesystem::currentDir("output/" + name + ".html");
+void processFile(mmd::Engine &engine, const String &path, bool print) {
+	auto name = filepath::name(path);
+	auto target = filesystem::currentDir("output/" + name + ".html");
 
-		if (!print) {
-			std::ofstream fstream(target);
-			mmd::HtmlOutputProcessor::run(&fstream, text);
-			fstream.close();
+	if (!print) {
+		std::ofstream fstream(target);
+		auto success = mmd::HtmlOutputProcessor::runFile(&fstream, engine, path);
+		fstream.close();
+
+		if (!success) {
+			return;
+		}
+
+		StringStream cmd;
+		cmd << "diff -u \"" << filesystem::currentDir("html/" + name + ".html") << "\" \"" << target << "\"";
+
+		auto cmdStr = cmd.str();
+
+		std::cout << "==== Test: " << name << "\n";
+
+		system(cmdStr.data());
+		std::cout << "==== End of diff " << name << "\n";
+
+	} else {
+		mmd::HtmlOutputProcessor::runFile(&std::cout, engine, path);
+	}
+}
+
+// Pathological input: `first` is repeated in the first half of paragraph, `second` in the second half.
+// Closers should arrive, when many openers, that can not be paired with them, are on stack
+struct PathologicalCase {
+	const char *name;
+	const char *first;
+	const char *second;
+};
+
+static PathologicalCase s_pathologicalCases[] = {
+	// every `_` closer follows all unmatched `*` openers
+	PathologicalCase{"emphasis", "*a b_ ", "*a b_ "},
+	// every `]` closer follows all unmatched `(` openers
+	PathologicalCase{"brackets", "(a ] ", "(a ] "},
+	// brackets are paired, parens are never closed
+	PathologicalCase{"links", "[a ](", "[a ]("},
+	// code span closers of different length
+	PathologicalCase{"backticks", "`a ", "a`` "},
+	PathologicalCase{"mixed", "*[`a ", "a``)_ "},
+};
+
+// Time per byte for the largest input can not be larger than for the smallest one
+// more than this factor, otherwise scaling is considered superlinear
+static constexpr double PathologicalMaxScaling = 3.0;
+
+static String makePathological(const PathologicalCase &c, size_t size) {
+	String ret; ret.reserve(size + 128);
+
+	auto append = [&] (const char *str, size_t limit) {
+		size_t line = 0;
+		while (ret.size() < limit) {
+			ret.append(str);
+			line += strlen(str);
+			if (line > 72) {
+				ret.push_back('\n');
+				line = 0;
+			}
+		}
+	};
+
+	append(c.first, size / 2);
+	append(c.second, size);
+	ret.push_back('\n');
+	return ret;
+}
+
+bool runPathological(size_t maxSize) {
+	bool success = true;
+	std::cout << "case\tsize\ttime_ms\tns_per_byte\n";
+	for (auto &c : s_pathologicalCases) {
+		double firstRate = 0.0, lastRate = 0.0;
+		size_t size = 1024 * 1024;
+		while (true) {
+			auto text = makePathological(c, size);
+
+			auto start = std::chrono::steady_clock::now();
+			mmd::Engine e; e.init(text);
+			e.process([] (const mmd::Content &, const StringView &, const mmd::Token &) { });
+			auto time = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+			double rate = time * 1000000.0 / text.size();
+			if (firstRate == 0.0) {
+				firstRate = rate;
+			}
+			lastRate = rate;
+
+			std::cout << c.name << "\t" << text.size() << "\t" << time << "\t" << rate << "\n";
+
+			if (size >= maxSize) {
+				break;
+			}
+			size = std::min(size * 2, maxSize);
+		}
+
+		// for linear matching time per byte should not grow with input size
+		auto scaling = (firstRate > 0.0) ? lastRate / firstRate : 1.0;
+		std::cout << c.name << "\tscaling\t" << scaling << "\n";
+		if (scaling > PathologicalMaxScaling) {
+			std::cout << "FAIL\tpathological\t" << c.name << "\tsuperlinear scaling " << scaling << "\n";
+			success = false;
+		}
+	}
+	return success;
+}
+
+// Benchmark: every file from test directory and synthetic large inputs are parsed and exported
+// `repeats` times after warm-up, results are printed as tab-separated values, one line per input
+struct BenchResult {
+	size_t bytes = 0;
+	size_t runs = 0;
+	double minTime = 0.0; // ms, parse and export
+	double totalTime = 0.0;
+	mmd::Engine::Stats stats; // accumulated over runs
+};
+
+static bool runBenchOnce(mmd::Engine &engine, const String &path, const StringView &text, BenchResult &res) {
+	StringStream stream;
+
+	auto start = std::chrono::steady_clock::now();
+	if (!path.empty()) {
+		if (!engine.initFromFile(path)) {
+			return false;
+		}
+	} else if (!engine.init(text)) {
+		return false;
+	}
+
+	engine.setStatsEnabled(true);
+	engine.process([&] (const mmd::Content &c, const StringView &s, const mmd::Token &t) {
+		mmd::HtmlOutputProcessor p; p.init(&stream);
+		p.process(c, s, t);
+	});
+	auto time = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+	auto &stats = engine.getStats();
+	res.bytes = stats.sourceBytes;
+	res.minTime = (res.runs == 0) ? time : std::min(res.minTime, time);
+	res.totalTime += time;
+	++ res.runs;
+
+	res.stats.tokenizeTime += stats.tokenizeTime;
+	res.stats.parseTime += stats.parseTime;
+	res.stats.pairTime += stats.pairTime;
+	res.stats.contentTime += stats.contentTime;
+	res.stats.searchTime += stats.searchTime;
+	res.stats.exportTime += stats.exportTime;
+	res.stats.lexTokens = stats.lexTokens;
+	res.stats.treeTokens = stats.treeTokens;
+	res.stats.treeDepth = stats.treeDepth;
+	res.stats.recursionDepth = stats.recursionDepth;
+
+	engine.clear();
+	return true;
+}
+
+static void printBenchHeader() {
+	std::cout << "kind\tname\tbytes\truns\tmin_ms\tavg_ms\tmb_s\ttokenize_ms\tparse_ms\tpair_ms"
+			"\tcontent_ms\tsearch_ms\texport_ms\ttokens\ttree_depth\trecursion\n";
+}
+
+static void printBenchResult(const char *kind, const StringView &name, const BenchResult &res) {
+	if (res.runs == 0) {
+		std::cout << kind << "\t" << name << "\tfailed\n";
+		return;
+	}
+
+	auto avg = [&] (uint64_t ns) { return double(ns) / res.runs / 1000000.0; };
+	auto mbs = (res.minTime > 0.0) ? (res.bytes / (1024.0 * 1024.0)) / (res.minTime / 1000.0) : 0.0;
+
+	std::cout << kind << "\t" << name << "\t" << res.bytes << "\t" << res.runs
+			<< "\t" << res.minTime << "\t" << (res.totalTime / res.runs) << "\t" << mbs
+			<< "\t" << avg(res.stats.tokenizeTime) << "\t" << avg(res.stats.parseTime)
+			<< "\t" << avg(res.stats.pairTime) << "\t" << avg(res.stats.contentTime)
+			<< "\t" << avg(res.stats.searchTime) << "\t" << avg(res.stats.exportTime)
+			<< "\t" << res.stats.lexTokens << "\t" << res.stats.treeDepth << "\t" << res.stats.recursionDepth << "\n";
+}
+
+static BenchResult runBench(mmd::Engine &engine, const String &path, const StringView &text, size_t repeats, size_t warmup) {
+	BenchResult tmp, res;
+	for (size_t i = 0; i < warmup; ++ i) {
+		if (!runBenchOnce(engine, path, text, tmp)) {
+			return res;
+		}
+	}
+	for (size_t i = 0; i < repeats; ++ i) {
+		if (!runBenchOnce(engine, path, text, res)) {
+			break;
+		}
+	}
+	return res;
+}
+
+// Synthetic inputs, `scale` is a number of repeated elements for scale factor 1.0
+struct SyntheticCase {
+	const char *name;
+	size_t scale;
+	Function<void(StringStream &, size_t)> generate;
+};
+
+static SyntheticCase s_syntheticCases[] = {
+	SyntheticCase{"table", 100000, [] (StringStream &out, size_t n) {
+		out << "| Name | Value | Description |\n|:-----|------:|:-----------:|\n";
+		for (size_t i = 0; i < n; ++ i) {
+			out << "| row " << i << " | *" << i * 7 << "* | some `code` and [link](http://example.com) |\n";
+		}
+		out << "[Table caption]\n";
+	}},
+	SyntheticCase{"nested_lists", 10000, [] (StringStream &out, size_t n) {
+		// n is a number of items, nested lists are 64 levels deep, so size is linear in n
+		for (size_t i = 0; i < n; ++ i) {
+			out << String((i % 64) * 4, ' ') << "* item " << i << "\n";
+		}
+	}},
+	SyntheticCase{"nested_quotes", 10000, [] (StringStream &out, size_t n) {
+		// n is a nesting depth, a few lines of the same depth
+		for (size_t i = 0; i < 4; ++ i) {
+			for (size_t j = 0; j < n; ++ j) {
+				out << "> ";
+			}
+			out << "quote " << i << "\n";
+		}
+	}},
+	SyntheticCase{"emphasis", 1000000, [] (StringStream &out, size_t n) {
+		// n is a number of emphasis markers
+		for (size_t i = 0; i < n / 2; ++ i) {
+			out << ((i % 2 == 0) ? "*a* " : "_b_ ");
+			if (i % 16 == 15) {
+				out << "\n";
+			}
+		}
+		out << "\n";
+	}},
+	SyntheticCase{"footnotes", 5000, [] (StringStream &out, size_t n) {
+		for (size_t i = 0; i < n; ++ i) {
+			out << "Paragraph with note[^n" << i << "].\n\n";
+		}
+		for (size_t i = 0; i < n; ++ i) {
+			out << "[^n" << i << "]: Footnote text " << i << "\n\n";
+		}
+	}},
+	SyntheticCase{"glossary", 5000, [] (StringStream &out, size_t n) {
+		for (size_t i = 0; i < n; ++ i) {
+			out << "Term [?term" << i << "] and ABBR" << i << " abbreviation.\n\n";
+		}
+		for (size_t i = 0; i < n; ++ i) {
+			out << "[?term" << i << "]: Glossary definition " << i << "\n\n";
+			out << "[>ABBR" << i << "]: Abbreviation " << i << "\n\n";
+		}
+	}},
+};
 
-			StringStream cmd;
-			cmd << "diff -u \"" << filesystem::currentDir("html/" + name + ".html") << "\" \"" << target << "\"";
+void runBenchmark(const String &dir, size_t repeats, size_t warmup, bool synthetic, double scale) {
+	mmd::Engine engine;
+	engine.setReusable(true, 256 * 1024 * 1024);
 
-			auto cmdStr = cmd.str();
+	printBenchHeader();
 
-			std::cout << "==== Test: " << name << "\n";
+	filesystem::ftw(filesystem::currentDir(dir), [&] (const String &path, bool isFile) {
+		if (isFile) {
+			auto res = runBench(engine, path, StringView(), repeats, warmup);
+			printBenchResult("file", filepath::name(path), res);
+		}
+	});
+
+	if (synthetic) {
+		for (auto &it : s_syntheticCases) {
+			StringStream stream;
+			it.generate(stream, std::max(size_t(it.scale * scale), size_t(1)));
 
-			system(cmdStr.data());
-			std::cout << "==== End of diff " << name << "\n";
+			auto text = stream.str();
 
+			auto res = runBench(engine, String(), text, repeats, warmup);
+			printBenchResult("synthetic", it.name, res);
+		}
+	}
+}
+
+// Scan mode: metadata and outline of every file from test directory, scan time is compared with full parsing
+static double runScanOnce(mmd::Engine &engine, const String &path, mmd::Engine::ScanMode mode, StringStream *out) {
+	auto start = std::chrono::steady_clock::now();
+	if (!engine.initFromFile(path)) {
+		return 0.0;
+	}
+
+	engine.setScanMode(mode);
+	engine.process([&] (const mmd::Content &c, const StringView &, const mmd::Token &) {
+		if (!out) {
+			return;
+		}
+
+		for (auto &it : c.getMetaDict()) {
+			*out << "meta\t" << it.first << "\t" << it.second << "\n";
+		}
+
+		// header links are created in order of headers
+		auto link = c.getLinks().begin();
+		for (auto &it : c.getHeaders()) {
+			auto type = it.getToken()->type;
+			auto level = (type == BLOCK_SETEXT_1) ? 1 : (type == BLOCK_SETEXT_2) ? 2 : type - BLOCK_H1 + 1;
+
+			while (link != c.getLinks().end() && (*link)->origin != mmd::Content::Link::Header) {
+				++ link;
+			}
+
+			*out << "header\t" << level;
+			if (link != c.getLinks().end()) {
+				*out << "\t" << (*link)->url;
+				++ link;
+			}
+			*out << "\n";
+		}
+	});
+
+	auto time = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	engine.clear();
+	return time;
+}
+
+void runScan(const String &dir, mmd::Engine::ScanMode mode) {
+	mmd::Engine engine;
+	engine.setReusable(true, 16 * 1024 * 1024);
+
+	double scanTime = 0.0, fullTime = 0.0;
+	filesystem::ftw(filesystem::currentDir(dir), [&] (const String &path, bool isFile) {
+		if (isFile) {
+			StringStream out;
+			scanTime += runScanOnce(engine, path, mode, &out);
+			fullTime += runScanOnce(engine, path, mmd::Engine::ScanMode::Full, nullptr);
+
+			std::cout << "==== " << filepath::name(path) << "\n" << out.str();
+		}
+	});
+
+	std::cout << "Scan: " << scanTime << " ms, full parsing: " << fullTime << " ms\n";
+}
+
+// Batch conversion: files are distributed between worker queues, largest first; worker, that ran out
+// of its own files, steals from the back of other queues. Every worker owns reusable engine (with pools
+// from its thread-local pool holder) and output buffer, so workers share nothing but the queues (and
+// transclusion cache with --transclude, so every fragment is parsed once for the whole batch).
+struct BatchTask {
+	String source;
+	String target;
+	size_t size;
+};
+
+struct BatchQueue {
+	std::mutex mutex;
+	std::deque<BatchTask *> tasks;
+
+	BatchTask *pop() {
+		std::unique_lock<std::mutex> lock(mutex);
+		if (tasks.empty()) {
+			return nullptr;
+		}
+		auto ret = tasks.front();
+		tasks.pop_front();
+		return ret;
+	}
+
+	BatchTask *steal() {
+		std::unique_lock<std::mutex> lock(mutex);
+		if (tasks.empty()) {
+			return nullptr;
+		}
+		auto ret = tasks.back();
+		tasks.pop_back();
+		return ret;
+	}
+};
+
+struct BatchWorker {
+	size_t files = 0;
+	size_t failed = 0;
+	size_t stolen = 0;
+	size_t inputBytes = 0;
+	size_t outputBytes = 0;
+
+	void convert(mmd::Engine &engine, const BatchTask &task, const mmd::Extensions &ext) {
+		// output is buffered by processor, so file is written directly, without stream buffer
+		auto fd = ::open(task.target.data(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			++ failed;
+			return;
+		}
+
+		mmd::OutputFdSink sink(fd);
+		if (!mmd::HtmlOutputProcessor::runFile(&sink, engine, task.source, ext)) {
+			::close(fd);
+			++ failed;
+			return;
+		}
+
+		outputBytes += size_t(::lseek(fd, 0, SEEK_CUR));
+		inputBytes += task.size;
+		++ files;
+		::close(fd);
+	}
+};
+
+void runBatch(const String &source, const String &target, size_t jobs, bool transclude) {
+	auto srcDir = filesystem::currentDir(source);
+	auto dstDir = filesystem::currentDir(target);
+
+	std::vector<BatchTask> tasks;
+	filesystem::ftw(srcDir, [&] (const String &path, bool isFile) {
+		auto rel = StringView(path).sub(std::min(path.size(), srcDir.size() + 1));
+		if (isFile) {
+			auto dir = filepath::root(rel);
+			auto name = filepath::name(path) + ".html";
+			auto size = filesystem::size(path);
+			auto dst = dir.empty() ? filepath::merge(dstDir, name) : filepath::merge(filepath::merge(dstDir, dir.str()), name);
+			tasks.emplace_back(BatchTask{path, dst, size});
 		} else {
-			mmd::HtmlOutputProcessor::run(&std::cout, text);
+			filesystem::mkdir(rel.empty() ? dstDir : filepath::merge(dstDir, rel.str()));
+		}
+	});
+
+	if (jobs == 0) {
+		jobs = std::max(std::thread::hardware_concurrency(), 1U);
+	}
+	jobs = std::max(std::min(jobs, tasks.size()), size_t(1));
+
+	// largest files first, so smaller ones can fill gaps at the end of the run
+	std::sort(tasks.begin(), tasks.end(), [] (const BatchTask &l, const BatchTask &r) {
+		return l.size > r.size;
+	});
+
+	std::vector<BatchQueue> queues(jobs);
+	std::vector<BatchWorker> workers(jobs);
+	for (size_t i = 0; i < tasks.size(); ++ i) {
+		queues[i % jobs].tasks.emplace_back(&tasks[i]);
+	}
+
+	Rc<mmd::Transclusion> transclusion;
+	mmd::Extensions ext(mmd::DefaultExtensions);
+	if (transclude) {
+		transclusion = Rc<mmd::Transclusion>::create();
+		ext = mmd::Extensions(mmd::DefaultExtensions.flags | mmd::Extensions::Transclude);
+	}
+
+	auto start = std::chrono::steady_clock::now();
+
+	auto run = [&] (size_t idx) {
+		auto &worker = workers[idx];
+
+		do {
+			mmd::Engine engine;
+			engine.setReusable(true, 16 * 1024 * 1024);
+			engine.setTransclusion(transclusion);
+
+			while (true) {
+				auto task = queues[idx].pop();
+				for (size_t i = 1; !task && i < jobs; ++ i) {
+					if ((task = queues[(idx + i) % jobs].steal())) {
+						++ worker.stolen;
+					}
+				}
+
+				if (!task) {
+					// queues are only filled before start, so all work is taken
+					break;
+				}
+
+				worker.convert(engine, *task, ext);
+			}
+		} while (0);
+
+		// engine retains its pool from thread pool, so it should be destroyed before trimming
+		mmd::Engine::trimThreadPool();
+	};
+
+	std::vector<std::thread> threads;
+	threads.reserve(jobs - 1);
+	for (size_t i = 1; i < jobs; ++ i) {
+		threads.emplace_back(run, i);
+	}
+	run(0);
+	for (auto &it : threads) {
+		it.join();
+	}
+
+	auto time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	BatchWorker total;
+	for (auto &it : workers) {
+		total.files += it.files;
+		total.failed += it.failed;
+		total.stolen += it.stolen;
+		total.inputBytes += it.inputBytes;
+		total.outputBytes += it.outputBytes;
+	}
+
+	std::cout << "Files: " << total.files << ", failed: " << total.failed << ", workers: " << jobs
+			<< ", stolen: " << total.stolen << "\n"
+			<< "Input: " << total.inputBytes << " bytes, output: " << total.outputBytes << " bytes, time: " << time << " s\n"
+			<< "Throughput: " << (time > 0.0 ? total.files / time : 0.0) << " files/s, "
+			<< (time > 0.0 ? total.inputBytes / (1024.0 * 1024.0) / time : 0.0) << " MiB/s\n";
+
+	if (transclusion) {
+		auto stats = transclusion->getStats();
+		std::cout << "Fragments: " << transclusion->size() << ", loaded: " << stats.loads << ", reused: " << stats.hits
+				<< ", failed: " << stats.failures << "\n";
+	}
+}
+
+// Verification: alternative parsing paths should produce the same token tree and HTML, as plain parsing
+// of the same text. Every check prints its failures and returns number of failed documents.
+struct VerifyOutput {
+	String tree;
+	String html;
+};
+
+static VerifyOutput renderVerify(mmd::Engine &engine) {
+	VerifyOutput ret;
+	engine.process([&] (const mmd::Content &c, const StringView &s, const mmd::Token &t) {
+		// with lazy blocks, processor shifts blocks as it exports them, the rest is shifted for tree dump
+		StringStream html;
+		mmd::OutputStreamSink sink(&html);
+		mmd::HtmlOutputProcessor p; p.init(&sink);
+		p.process(c, s, t);
+		ret.html = html.str();
+
+		c.resolveShifts();
+
+		StringStream tree;
+		mmd::Token(t.getToken()).describeTree(tree, s);
+		ret.tree = tree.str();
+	});
+	return ret;
+}
+
+static bool compareVerify(const char *check, const StringView &name, const VerifyOutput &expected, const VerifyOutput &result) {
+	auto compare = [&] (const char *what, const String &l, const String &r) {
+		if (l == r) {
+			return true;
+		}
+
+		auto diff = std::mismatch(l.begin(), l.begin() + std::min(l.size(), r.size()), r.begin());
+		std::cout << "FAIL\t" << check << "\t" << name << "\t" << what << " differs at " << (diff.first - l.begin())
+				<< " (" << l.size() << " vs " << r.size() << " bytes)\n";
+		return false;
+	};
+
+	auto tree = compare("tree", expected.tree, result.tree);
+	auto html = compare("html", expected.html, result.html);
+	return tree && html;
+}
+
+// every file is transcluded twice into outer document from memory, so the second reference is served
+// from cache; result should match plain parsing of expanded source
+static size_t verifyTransclusion(const Map<String, String> &files) {
+	auto transclusion = Rc<mmd::Transclusion>::create([&] (const StringView &path) -> uint64_t {
+		auto it = files.find(path.str());
+		return (it != files.end()) ? it->second.size() + 1 : 0;
+	}, [&] (const StringView &path, Bytes &data) {
+		auto it = files.find(path.str());
+		if (it == files.end()) {
+			return false;
+		}
+		data.assign((const uint8_t *)it->second.data(), (const uint8_t *)it->second.data() + it->second.size());
+		return true;
+	});
+
+	mmd::Extensions ext(mmd::DefaultExtensions.flags | mmd::Extensions::Transclude);
+
+	size_t failed = 0, copied = 0;
+	for (auto &it : files) {
+		StringStream text;
+		text << "Transcluded document\n\n{{" << it.first << "}}\n\nParagraph between fragments.\n\n{{" << it.first << "}}\n";
+
+		mmd::Engine engine;
+		engine.setStatsEnabled(true);
+		engine.setTransclusion(transclusion);
+		engine.init(text.str(), ext);
+
+		auto result = renderVerify(engine);
+		copied += engine.getStats().transcludedBytes;
+
+		mmd::Engine plain;
+		plain.init(engine.getSource(), mmd::DefaultExtensions);
+
+		if (!compareVerify("transclusion", it.first, renderVerify(plain), result)) {
+			++ failed;
+		}
+	}
+
+	std::cout << "transclusion\t" << files.size() << " documents, " << failed << " failed, "
+			<< copied << " bytes copied from fragments\n";
+	return failed;
+}
+
+// edits are applied in batches with processing after every batch, so tree is updated incrementally
+// for combined range of batch; result should match plain parsing of edited text
+static size_t verifyUpdate(const Map<String, String> &files) {
+	static const StringView s_inserts[] = {
+		"word ", "*", "**", "[", "]", "`", "\n", "\n\n", "\n\n# Header\n\n", "> ", "[^note]: ", "\n\n[^note]: Note.\n\n"
+	};
+
+	size_t failed = 0, edits = 0;
+	for (auto &it : files) {
+		mmd::Engine engine;
+		engine.init(it.second);
+		engine.setLazyBlocks(true);
+		renderVerify(engine);
+
+		// positions are pseudo-random, but the same for every run
+		uint32_t seed = uint32_t(it.second.size()) + 1;
+		auto random = [&] (size_t max) {
+			seed = seed * 1664525 + 1013904223;
+			return (max > 0) ? size_t(seed >> 8) % max : size_t(0);
+		};
+
+		bool success = true;
+		size_t size = it.second.size();
+		for (size_t batch = 0; batch < 8 && success; ++ batch) {
+			auto count = 1 + random(4);
+			for (size_t i = 0; i < count; ++ i) {
+				auto offset = random(size + 1);
+				auto removed = (random(3) == 0) ? random(16) : 0;
+				auto &insert = s_inserts[random(sizeof(s_inserts) / sizeof(StringView))];
+
+				engine.update(offset, removed, insert);
+				size = size - std::min(removed, size - offset) + insert.size();
+				++ edits;
+			}
+
+			auto result = renderVerify(engine);
+
+			mmd::Engine plain;
+			plain.init(engine.getSource());
+			success = compareVerify("update", it.first, renderVerify(plain), result);
+		}
+
+		if (!success) {
+			++ failed;
+		}
+	}
+
+	std::cout << "update\t" << files.size() << " documents, " << failed << " failed, " << edits << " edits\n";
+	return failed;
+}
+
+// every line is passed with separate write: block should be emitted, when the first line of the next
+// block is written, and result should match plain parsing of the same text
+static size_t verifyStream(const Map<String, String> &files) {
+	size_t failed = 0, early = 0, total = 0;
+
+	// paragraphs are always split, so every paragraph is expected before the next one is finished
+	do {
+		size_t emitted = 0;
+		mmd::Engine engine;
+		engine.initStream(mmd::DefaultExtensions, [&] (const StringView &, const mmd::Token &) {
+			++ emitted;
+		});
+
+		for (size_t i = 0; i < 64; ++ i) {
+			StringStream line;
+			line << "Paragraph " << i << ".\n";
+			engine.write(line.str());
+			if (emitted < i) {
+				std::cout << "FAIL\tstream\tparagraphs\tparagraph " << i - 1 << " is not emitted after the next one is started\n";
+				++ failed;
+				break;
+			}
+			engine.write("\n");
+		}
+	} while (0);
+
+	for (auto &it : files) {
+		size_t emitted = 0;
+		mmd::Engine engine;
+		engine.initStream(mmd::DefaultExtensions, [&] (const StringView &, const mmd::Token &) {
+			++ emitted;
+		});
+
+		size_t pos = 0;
+		while (pos < it.second.size()) {
+			auto end = it.second.find('\n', pos);
+			end = (end == String::npos) ? it.second.size() : end + 1;
+			engine.write(StringView(it.second.data() + pos, end - pos));
+			pos = end;
+		}
+
+		early += emitted;
+		auto result = renderVerify(engine);
+		total += emitted;
+
+		mmd::Engine plain;
+		plain.init(it.second);
+
+		if (!compareVerify("stream", it.first, renderVerify(plain), result)) {
+			++ failed;
 		}
 	}
+
+	std::cout << "stream\t" << files.size() << " documents, " << failed << " failed, "
+			<< early << " of " << total << " blocks emitted before finalize\n";
+	return failed;
+}
+
+// every file is repeated to be split into several chunks, and parsed with one and with several threads;
+// whole corpus is parsed as one document too
+static size_t verifyParallel(const Map<String, String> &files) {
+	static constexpr size_t MinSize = 256 * 1024;
+	static constexpr uint32_t Threads = 4;
+
+	auto check = [&] (const StringView &name, const String &text) {
+		mmd::Engine serial;
+		serial.init(text);
+
+		// threads are set for document, so after init, before processing
+		mmd::Engine parallel;
+		parallel.init(text);
+		parallel.setParseThreads(Threads);
+
+		return compareVerify("parallel", name, renderVerify(serial), renderVerify(parallel));
+	};
+
+	size_t failed = 0;
+	String corpus;
+	for (auto &it : files) {
+		String text;
+		while (text.size() < MinSize && !it.second.empty()) {
+			text.append(it.second);
+			text.append("\n\n");
+		}
+
+		if (!check(it.first, text)) {
+			++ failed;
+		}
+
+		corpus.append(it.second);
+		corpus.append("\n\n");
+	}
+
+	if (!check("corpus", corpus)) {
+		++ failed;
+	}
+
+	std::cout << "parallel\t" << files.size() + 1 << " documents, " << failed << " failed\n";
+	return failed;
+}
+
+bool runVerify(const String &dir) {
+	auto srcDir = filesystem::currentDir(dir);
+
+	// files are named with paths relative to source dir, as in transclusion markers
+	Map<String, String> files;
+	filesystem::ftw(srcDir, [&] (const String &path, bool isFile) {
+		if (isFile) {
+			auto data = filesystem::readFile(path);
+			files.emplace(StringView(path).sub(std::min(path.size(), srcDir.size() + 1)).str(),
+					String((const char *)data.data(), data.size()));
+		}
+	});
+
+	size_t failed = 0;
+	failed += verifyTransclusion(files);
+	failed += verifyUpdate(files);
+	failed += verifyStream(files);
+	failed += verifyParallel(files);
+	return failed == 0;
 }
 
 NS_SP_EXT_END(app)
@@ -69,6 +823,16 @@ int parseOptionSwitch(data::Value &ret, char c, const char *str) {
 		ret.setBool(true, "help");
 	} else if (c == 'p') {
 		ret.setBool(true, "print");
+	} else if (c == 'P') {
+		ret.setBool(true, "pathological");
+	} else if (c == 'b') {
+		ret.setBool(true, "bench");
+	} else if (c == 'B') {
+		ret.setBool(true, "batch");
+	} else if (c == 's') {
+		ret.setString("outline", "scan");
+	} else if (c == 'V') {
+		ret.setBool(true, "verify");
 	}
 	return 1;
 }
@@ -78,6 +842,28 @@ int parseOptionString(data::Value &ret, const String &str, int argc, const char
 		ret.setBool(true, "print");
 	} else if (str == "verbose") {
 		ret.setBool(true, "verbose");
+	} else if (str == "pathological") {
+		ret.setBool(true, "pathological");
+	} else if (str == "bench") {
+		ret.setBool(true, "bench");
+	} else if (str == "batch") {
+		ret.setBool(true, "batch");
+	} else if (str == "verify") {
+		ret.setBool(true, "verify");
+	} else if (str.compare(0, 5, "scan=") == 0) {
+		ret.setString(str.substr(5), "scan");
+	} else if (str.compare(0, 5, "jobs=") == 0) {
+		ret.setInteger(std::max(atoi(str.data() + 5), 0), "jobs");
+	} else if (str == "transclude") {
+		ret.setBool(true, "transclude");
+	} else if (str == "no-synthetic") {
+		ret.setBool(true, "no-synthetic");
+	} else if (str.compare(0, 8, "repeats=") == 0) {
+		ret.setInteger(std::max(atoi(str.data() + 8), 1), "repeats");
+	} else if (str.compare(0, 6, "scale=") == 0) {
+		ret.setDouble(std::max(atof(str.data() + 6), 0.0), "scale");
+	} else if (str.compare(0, 7, "warmup=") == 0) {
+		ret.setInteger(std::max(atoi(str.data() + 7), 0), "warmup");
 	}
 	return 1;
 }
@@ -90,6 +876,64 @@ int _spMain(argc, argv) {
 
 	bool print = opts.getBool("print");
 
+	if (opts.getBool("pathological")) {
+		// max input size in MiB can be passed as argument
+		size_t maxSize = 100;
+		if (args.size() >= 2) {
+			maxSize = size_t(std::max(atoi(args.getString(1).data()), 1));
+		}
+		// exit code is nonzero if any case scales superlinearly
+		return app::runPathological(maxSize * 1024 * 1024) ? 0 : 1;
+	}
+
+	if (opts.getBool("bench")) {
+		// --bench [dir] [--repeats=N] [--warmup=N] [--no-synthetic] [--scale=F]
+		// synthetic inputs are scaled by F, 1.0 by default
+		String dir("mmd");
+		if (args.size() >= 2) {
+			dir = args.getString(1);
+		}
+
+		auto repeats = size_t(opts.getInteger("repeats", 5));
+		auto warmup = size_t(opts.getInteger("warmup", 1));
+		auto scale = opts.getDouble("scale", 1.0);
+		app::runBenchmark(dir, repeats, warmup, !opts.getBool("no-synthetic"), scale);
+		return 0;
+	}
+
+	if (opts.getBool("verify")) {
+		// --verify [dir], exit code is nonzero if any check failed
+		String dir("mmd");
+		if (args.size() >= 2) {
+			dir = args.getString(1);
+		}
+
+		return app::runVerify(dir) ? 0 : 1;
+	}
+
+	auto &mode = opts.getString("scan");
+	if (!mode.empty()) {
+		// --scan=meta|outline [dir]
+		String dir("mmd");
+		if (args.size() >= 2) {
+			dir = args.getString(1);
+		}
+
+		app::runScan(dir, (mode == "meta") ? mmd::Engine::ScanMode::Metadata : mmd::Engine::ScanMode::Outline);
+		return 0;
+	}
+
+	if (opts.getBool("batch")) {
+		// --batch <source dir> <output dir> [--jobs=N] [--transclude], all cores are used by default
+		if (args.size() < 3) {
+			std::cout << "Usage: mmd-test --batch <source dir> <output dir> [--jobs=N] [--transclude]\n";
+			return 1;
+		}
+
+		app::runBatch(args.getString(1), args.getString(2), size_t(opts.getInteger("jobs", 0)), opts.getBool("transclude"));
+		return 0;
+	}
+
 	if (!print) {
 		auto baseDir = filesystem::currentDir("output");
 		filesystem::remove(baseDir, true, true);
@@ -104,11 +948,22 @@ int _spMain(argc, argv) {
 
 	std::cout << filesystem::currentDir(dir) << "\n";
 
+	// one engine for all files, memory is reused between documents
+	mmd::Engine engine;
+	engine.setReusable(true, 16 * 1024 * 1024);
+
 	filesystem::ftw(filesystem::currentDir(dir), [&] (const String &path, bool isFile) {
 		if (isFile) {
-			app::processFile(path, print);
+			app::processFile(engine, path, print);
 		}
 	});
 
+	if (opts.getBool("verbose")) {
+		auto &stats = engine.getPoolStats();
+		std::cout << "Documents: " << stats.documents << ", pools recreated: " << stats.recreated
+				<< ", peak document memory: " << stats.peakDocumentBytes
+				<< ", peak render memory: " << stats.peakRenderBytes << "\n";
+	}
+
 	return 0;
 }
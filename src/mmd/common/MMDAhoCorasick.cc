@@ -43,10 +43,6 @@
 
 NS_MMD_BEGIN
 
-Trie::Node::Node() {
-	memset(this, 0, sizeof(Node));
-}
-
 Trie::Trie(size_t startingSize) {
 	if (startingSize <= 1) {
 		startingSize = kTrieStartingSize;
@@ -54,14 +50,28 @@ Trie::Trie(size_t startingSize) {
 
 	nodes.reserve(startingSize);
 	nodes.resize(1);
+	memset(root, 0, sizeof(root));
 }
 
-bool Trie::insert(const char *key, uint8_t match_type) {
-	if (key && (key[0] != '\0')) {
-		return insertNode(0, (const unsigned char *)key, match_type, 0);
+bool Trie::insert(const StringView &key, uint8_t match_type) {
+	if (key.empty() || key[0] == '\0') {
+		return false;
 	}
 
-	return false;
+	uint32_t s = 0;
+	uint16_t depth = 0;
+	auto k = (const unsigned char *)key.data();
+	auto end = k + key.size();
+	while (k != end && *k) {
+		auto next = findChild(s, *k);
+		s = next ? next : addChild(s, *k);
+		++ k;
+		++ depth;
+	}
+
+	nodes[s].match_type = match_type;
+	nodes[s].len = depth;
+	return true;
 }
 
 void Trie::toGraphviz() const {
@@ -73,17 +83,14 @@ void Trie::toGraphviz() const {
 			fprintf(stderr, "\"%zu\" [shape=doublecircle]\n", s);
 		}
 
-		for (int i = 0; i < 256; ++i) {
-			if (it.child[i]) {
-				switch (i) {
-					default:
-						fprintf(stderr, "\"%zu\" -> \"%zu\" [label=\"%c\"]\n", s, it.child[i], (char)i);
-				}
-			}
+		auto child = it.child;
+		while (child) {
+			fprintf(stderr, "\"%zu\" -> \"%u\" [label=\"%c\"]\n", s, child, (char)nodes[child].c);
+			child = nodes[child].sibling;
 		}
 
 		if (it.ac_fail) {
-			fprintf(stderr, "\"%zu\" -> \"%zu\" [label=\"fail\"]\n", s, it.ac_fail);
+			fprintf(stderr, "\"%zu\" -> \"%u\" [label=\"fail\"]\n", s, it.ac_fail);
 		}
 		++ s;
 	}
@@ -91,16 +98,58 @@ void Trie::toGraphviz() const {
 	fprintf(stderr, "}\n");
 }
 
-/// Prepare trie for Aho-Corasick search algorithm by mapping failure connections
+/// Pack transitions and prepare trie for Aho-Corasick search algorithm by mapping failure connections
 void Trie::prepare() {
+	edgeChars.clear();
+	edgeTargets.clear();
+	edgeChars.reserve(nodes.size());
+	edgeTargets.reserve(nodes.size());
+
 	for (auto &it : nodes) {
 		it.ac_fail = 0;
+		it.edges = uint32_t(edgeChars.size());
+		it.count = 0;
+
+		// sibling lists are sorted on insertion
+		auto child = it.child;
+		while (child) {
+			edgeChars.emplace_back(nodes[child].c);
+			edgeTargets.emplace_back(child);
+			++ it.count;
+			child = nodes[child].sibling;
+		}
+	}
+
+	// Failure links are assigned in breadth-first order, so links for all shorter
+	// prefixes are already known, when node is processed
+	Vector<uint32_t> queue;
+	queue.reserve(nodes.size());
+
+	auto child = nodes[0].child;
+	while (child) {
+		queue.emplace_back(child);
+		child = nodes[child].sibling;
 	}
 
-	// Create a buffer to use
-	char buffer[nodes.capacity()];
+	for (size_t i = 0; i < queue.size(); ++ i) {
+		auto s = queue[i];
+		child = nodes[s].child;
+		while (child) {
+			auto c = nodes[child].c;
+			auto f = nodes[s].ac_fail;
+			uint32_t next = 0;
+			while (f != 0 && (next = transition(f, c)) == 0) {
+				f = nodes[f].ac_fail;
+			}
+			if (f == 0) {
+				next = root[c];
+			}
 
-	prepareNode(0, buffer, 0, 0);
+			nodes[child].ac_fail = (next != child) ? next : 0;
+			queue.emplace_back(child);
+			child = nodes[child].sibling;
+		}
+	}
 }
 
 uint8_t Trie::searchMatchType(const char * query) {
@@ -112,101 +161,96 @@ uint8_t Trie::searchMatchType(const char * query) {
 	return nodes[s].match_type;
 }
 
-bool Trie::insertNode(size_t s, const unsigned char * key, uint8_t match_type, uint16_t depth) {
-	// Get node for state s
-	auto n = &nodes.at(s);
-
-	size_t i;
-
-	if (key[0] == '\0') {
-		// We've hit end of key
-		n->match_type = match_type;
-		n->len = depth;
-		return true;		// Success
+uint32_t Trie::findChild(uint32_t s, uint8_t c) const {
+	if (s == 0) {
+		return root[c];
 	}
 
-	if (n->child[key[0]] != 0) {
-		// First character already in trie, advance forward
-		return insertNode(n->child[key[0]], key + 1, match_type, ++depth);
-	} else {
-		i = nodes.size();
-		n->child[key[0]] = i;
-		nodes.emplace_back(Node());
-		nodes.back().c = key[0];
-
-		// Advance forward
-		return insertNode(i, key + 1, match_type, ++depth);
+	auto child = nodes[s].child;
+	while (child && nodes[child].c < c) {
+		child = nodes[child].sibling;
 	}
-}
-
-void Trie::prepareNode(size_t s, char * buffer, unsigned short depth, size_t last_match_state) {
-	buffer[depth] = '\0';
-	buffer[depth + 1] = '\0';
-
-	// Current node
-	Node * n = &(nodes[s]);
-
-	char * suffix = buffer;
 
-	// Longest match seen so far??
-	suffix += 1;
-
-	// Find valid suffixes for failure path
-	while ((suffix[0] != '\0') && (n->ac_fail == 0)) {
-		n->ac_fail = doSearch(suffix);
-
-		if (n->ac_fail == maxOf<size_t>()) {
-			n->ac_fail = 0;
-		}
+	return (child && nodes[child].c == c) ? child : 0;
+}
 
-		if (n->ac_fail == s) {
-			// Something went wrong
-			fprintf(stderr, "Recursive trie fallback detected at state %zu('%c') - suffix:'%s'!\n", s, n->c, suffix);
-			n->ac_fail = 0;
-		}
+uint32_t Trie::addChild(uint32_t s, uint8_t c) {
+	auto i = uint32_t(nodes.size());
+	nodes.emplace_back(Node());
+	nodes.back().c = c;
+
+	// keep sibling list sorted by character
+	uint32_t prev = 0;
+	auto child = nodes[s].child;
+	while (child && nodes[child].c < c) {
+		prev = child;
+		child = nodes[child].sibling;
+	}
 
-		suffix++;
+	nodes[i].sibling = child;
+	if (prev) {
+		nodes[prev].sibling = i;
+	} else {
+		nodes[s].child = i;
 	}
 
-	// Prepare children
-	for (int i = 0; i < 256; ++i) {
-		if ((n->child[i] != 0) &&
-				(n->child[i] != s)) {
-			buffer[depth] = i;
-			prepareNode(n->child[i], buffer, depth + 1, last_match_state);
-		}
+	if (s == 0) {
+		root[c] = i;
 	}
+
+	return i;
 }
 
-size_t Trie::doSearchNode(size_t s, const char * query) const {
-	if (query[0] == '\0') {
-		return s;
+uint32_t Trie::transition(uint32_t s, uint8_t c) const {
+	if (s == 0) {
+		return root[c];
 	}
 
-	if (nodes[s].child[(unsigned char)query[0]] == 0) {
-		return maxOf<size_t>();
+	auto &n = nodes[s];
+	auto chars = edgeChars.data() + n.edges;
+	if (n.count <= kTrieLinearScanLimit) {
+		for (uint16_t i = 0; i < n.count; ++ i) {
+			if (chars[i] == c) {
+				return edgeTargets[n.edges + i];
+			} else if (chars[i] > c) {
+				break;
+			}
+		}
+	} else {
+		auto it = std::lower_bound(chars, chars + n.count, c);
+		if (it != chars + n.count && *it == c) {
+			return edgeTargets[n.edges + (it - chars)];
+		}
 	}
 
-	// Partial match, keep going
-	return doSearchNode(nodes[s].child[(unsigned char)query[0]], query + 1);
+	return 0;
 }
 
 size_t Trie::doSearch(const char * query) const {
-	if (query) {
-		return doSearchNode(0, query);
+	if (!query) {
+		return 0;
 	}
 
-	return 0;
+	uint32_t s = 0;
+	auto q = (const unsigned char *)query;
+	while (*q) {
+		s = findChild(s, *q);
+		if (s == 0) {
+			return maxOf<size_t>();
+		}
+		++ q;
+	}
+
+	return s;
 }
 
 auto Trie::search(const char * source, size_t start, size_t len) const -> Result {
-	// Store results in a linked list
-	// match * result = match_new(0, 0, 0);
 	Result result;
 
 	// Keep track of our state
-	size_t state = 0;
-	size_t temp_state;
+	uint32_t state = 0;
+	uint32_t next = 0;
+	uint32_t temp_state;
 
 	// Character being compared
 	unsigned char test_value;
@@ -218,23 +262,24 @@ auto Trie::search(const char * source, size_t start, size_t len) const -> Result
 		test_value = (unsigned char)source[counter++];
 
 		// Check for path that allows us to match next character
-		while (state != 0 && nodes[state].child[test_value] == 0) {
+		while (state != 0 && (next = transition(state, test_value)) == 0) {
 			state = nodes[state].ac_fail;
 		}
 
 		// Advance state for the next character
-		state = nodes[state].child[test_value];
+		state = (state != 0) ? next : root[test_value];
 
 		// Check for partial matches
 		temp_state = state;
 
 		while (temp_state != 0) {
-			if (nodes[temp_state].match_type) {
-				result.emplace_back(Match{counter - nodes[temp_state].len, nodes[temp_state].len, nodes[temp_state].match_type});
+			auto &n = nodes[temp_state];
+			if (n.match_type) {
+				result.emplace_back(Match{counter - n.len, n.len, n.match_type});
 			}
 
 			// Iterate to find shorter matches
-			temp_state = nodes[temp_state].ac_fail;
+			temp_state = n.ac_fail;
 		}
 	}
 
@@ -285,7 +330,7 @@ inline bool isPrevRighter(Trie::Result & header, Trie::Result::iterator it) {
 	return false;
 }
 
-void match_set_filter_leftmost_longest(Trie::Result & header) {
+void Trie::filterLeftmostLongest(Result & header) {
 	// Filter results to include only leftmost/longest results
 	Trie::Result::iterator matchIt = header.begin();
 	Trie::Result::iterator nextIt;
@@ -324,9 +369,112 @@ void match_set_filter_leftmost_longest(Trie::Result & header) {
 auto Trie::searchLeftmostLongest(const char * source, size_t start, size_t len) const -> Result {
 	auto result = search(source, start, len);
 	if (!result.empty()) {
-		match_set_filter_leftmost_longest(result);
+		filterLeftmostLongest(result);
 	}
 	return result;
 }
 
+void Trie::write(std::ostream &stream) const {
+	auto write = [&] (const void *data, size_t size) {
+		stream.write((const char *)data, size);
+	};
+
+	const uint32_t nodesCount = uint32_t(nodes.size());
+	const uint32_t edgesCount = uint32_t(edgeChars.size());
+
+	write(&nodesCount, sizeof(uint32_t));
+	write(&edgesCount, sizeof(uint32_t));
+	write(root, sizeof(root));
+	write(nodes.data(), nodes.size() * sizeof(Node));
+	write(edgeTargets.data(), edgeTargets.size() * sizeof(uint32_t));
+	write(edgeChars.data(), edgeChars.size());
+}
+
+size_t Trie::read(const uint8_t *data, size_t size) {
+	uint32_t nodesCount = 0;
+	uint32_t edgesCount = 0;
+
+	if (size < sizeof(uint32_t) * 2 + sizeof(root)) {
+		return 0;
+	}
+
+	memcpy(&nodesCount, data, sizeof(uint32_t));
+	memcpy(&edgesCount, data + sizeof(uint32_t), sizeof(uint32_t));
+
+	const size_t nodesOffset = sizeof(uint32_t) * 2 + sizeof(root);
+	const size_t targetsOffset = nodesOffset + size_t(nodesCount) * sizeof(Node);
+	const size_t charsOffset = targetsOffset + size_t(edgesCount) * sizeof(uint32_t);
+	const size_t total = charsOffset + edgesCount;
+	if (nodesCount == 0 || total > size) {
+		return 0;
+	}
+
+	uint32_t tmpRoot[256];
+	memcpy(tmpRoot, data + sizeof(uint32_t) * 2, sizeof(root));
+
+	Vector<Node> tmpNodes; tmpNodes.resize(nodesCount);
+	Vector<uint32_t> tmpTargets; tmpTargets.resize(edgesCount);
+	Vector<uint8_t> tmpChars; tmpChars.resize(edgesCount);
+
+	memcpy(tmpNodes.data(), data + nodesOffset, size_t(nodesCount) * sizeof(Node));
+	memcpy(tmpTargets.data(), data + targetsOffset, size_t(edgesCount) * sizeof(uint32_t));
+	memcpy(tmpChars.data(), data + charsOffset, edgesCount);
+
+	// all links should be in bounds, search does not check them
+	for (auto &it : tmpRoot) {
+		if (it >= nodesCount) {
+			return 0;
+		}
+	}
+	for (auto &it : tmpTargets) {
+		if (it == 0 || it >= nodesCount) {
+			return 0;
+		}
+	}
+	for (auto &it : tmpNodes) {
+		if (it.child >= nodesCount || it.sibling >= nodesCount || it.ac_fail >= nodesCount
+				|| it.edges > edgesCount || it.count > edgesCount - it.edges) {
+			return 0;
+		}
+	}
+
+	// transitions should form a tree, and failure links should lead to shorter prefixes, otherwise
+	// failure loops in search would not terminate; depth is assigned in breadth-first order
+	Vector<uint32_t> depth; depth.resize(nodesCount, maxOf<uint32_t>());
+	Vector<uint32_t> queue; queue.reserve(nodesCount);
+	depth[0] = 0;
+	for (auto &it : tmpRoot) {
+		if (it != 0) {
+			if (depth[it] != maxOf<uint32_t>()) {
+				return 0;
+			}
+			depth[it] = 1;
+			queue.emplace_back(it);
+		}
+	}
+	for (size_t i = 0; i < queue.size(); ++ i) {
+		auto &n = tmpNodes[queue[i]];
+		for (uint32_t e = n.edges; e < n.edges + n.count; ++ e) {
+			auto target = tmpTargets[e];
+			if (depth[target] != maxOf<uint32_t>()) {
+				return 0;
+			}
+			depth[target] = depth[queue[i]] + 1;
+			queue.emplace_back(target);
+		}
+	}
+	for (auto &it : queue) {
+		auto &n = tmpNodes[it];
+		if (depth[n.ac_fail] >= depth[it] || (n.match_type && (n.len == 0 || n.len > depth[it]))) {
+			return 0;
+		}
+	}
+
+	memcpy(root, tmpRoot, sizeof(root));
+	nodes = move(tmpNodes);
+	edgeTargets = move(tmpTargets);
+	edgeChars = move(tmpChars);
+	return total;
+}
+
 NS_MMD_END
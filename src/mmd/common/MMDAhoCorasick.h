@@ -46,16 +46,20 @@
 
 NS_MMD_BEGIN
 
+// Trie is stored in compact form: root transitions use dense table, all other nodes
+// use sorted sparse transitions, packed into single edge array by `prepare`.
+// `prepare` should be called after all insertions and before search.
 class Trie : public memory::PoolInterface {
 public:
 	struct Node {
-		char c; // Character for this node
-		uint8_t match_type; // 0 = no match, otherwise what have we matched?
-		uint16_t len; // Length of string matched
-		size_t child[256]; // Where should we go next?
-		size_t ac_fail; // Where should we go if we fail?
-
-		Node();
+		uint32_t child = 0; // first child, sorted sibling list is used for insertion
+		uint32_t sibling = 0; // next child of the same parent
+		uint32_t ac_fail = 0; // Where should we go if we fail?
+		uint32_t edges = 0; // first packed transition
+		uint16_t count = 0; // number of packed transitions
+		uint16_t len = 0; // Length of string matched
+		uint8_t c = 0; // Character for this node
+		uint8_t match_type = 0; // 0 = no match, otherwise what have we matched?
 	};
 
 	struct Match {
@@ -68,12 +72,15 @@ public:
 
 	static constexpr size_t kTrieStartingSize = 256;
 
+	// nodes with less transitions use linear scan instead of binary search
+	static constexpr uint16_t kTrieLinearScanLimit = 8;
+
 	template <typename V>
 	using Vector = VectorType<V>;
 
 	Trie(size_t startingSize = kTrieStartingSize);
 
-	bool insert(const char *key, uint8_t match_type);
+	bool insert(const StringView &key, uint8_t match_type);
 	void toGraphviz() const;
 
 	void prepare();
@@ -83,16 +90,28 @@ public:
 	Result search(const char * source, size_t start, size_t len) const;
 	Result searchLeftmostLongest(const char * source, size_t start, size_t len) const;
 
+	// filter raw search results, ordered by match end, to leftmost-longest set
+	static void filterLeftmostLongest(Result &);
+
+	size_t size() const { return nodes.size(); }
+
+	// Prepared automaton in native byte order, `read` returns number of bytes consumed or 0 on error
+	void write(std::ostream &) const;
+	size_t read(const uint8_t *, size_t);
+
 protected:
-	bool insertNode(size_t s, const unsigned char * key, uint8_t match_type, uint16_t depth);
-	void prepareNode(size_t s, char * buffer, uint16_t depth, size_t last_match_state);
+	uint32_t findChild(uint32_t s, uint8_t c) const;
+	uint32_t addChild(uint32_t s, uint8_t c);
 
-	size_t doSearchNode(size_t s, const char * query) const;
-	size_t doSearch(const char * query) const;
+	// transition in packed automaton, 0 if there is no transition
+	uint32_t transition(uint32_t s, uint8_t c) const;
 
-	void matchLeftmostLongest(Result &);
+	size_t doSearch(const char * query) const;
 
 	Vector<Node> nodes;
+	Vector<uint8_t> edgeChars; // packed transitions, sorted by character within node
+	Vector<uint32_t> edgeTargets;
+	uint32_t root[256];
 };
 
 NS_MMD_END
@@ -0,0 +1,299 @@
+/**
+Copyright (c) 2017 Roman Katuntsev <sbkarr@stappler.org>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+**/
+
+#include "SPCommon.h"
+#include "MMDCache.h"
+#include "MMDCore.h"
+
+NS_MMD_BEGIN
+
+static constexpr char s_cacheMagic[8] = { 'M', 'M', 'D', 'C', 'A', 'C', 'H', 'E' };
+
+uint64_t Cache::hash(const StringView &str) {
+	// 64-bit multiply-rotate hash, processes 8 bytes per step
+	static constexpr uint64_t k1 = 0x9E3779B97F4A7C15ULL;
+	static constexpr uint64_t k2 = 0xBF58476D1CE4E5B9ULL;
+
+	auto p = (const uint8_t *)str.data();
+	auto n = str.size();
+	uint64_t h = 0xcbf29ce484222325ULL ^ (uint64_t(n) * k1);
+
+	while (n >= 8) {
+		uint64_t v; memcpy(&v, p, 8);
+		h ^= v * k1;
+		h = ((h << 29) | (h >> 35)) * k2;
+		p += 8; n -= 8;
+	}
+
+	while (n > 0) {
+		h = (h ^ *p) * 0x100000001b3ULL;
+		++ p; -- n;
+	}
+
+	h ^= h >> 31; h *= k2;
+	h ^= h >> 29;
+	return h;
+}
+
+CacheWriter::CacheWriter(const StringView &source) : _source(source) {
+	// space for header
+	_data.resize(sizeof(Cache::Header));
+}
+
+uint32_t CacheWriter::index(token *t) {
+	if (!t) {
+		return 0;
+	}
+
+	auto it = _indexes.find(t);
+	if (it != _indexes.end()) {
+		return it->second;
+	}
+
+	// assign indexes for the whole subtree, that starts from this token
+	VectorType<token *> stack; stack.emplace_back(t);
+	while (!stack.empty()) {
+		auto tok = stack.back(); stack.pop_back();
+		while (tok) {
+			if (!_indexes.emplace(tok, uint32_t(_tokens.size() + 1)).second) {
+				break;
+			}
+			_tokens.emplace_back(tok);
+			if (tok->child) {
+				stack.emplace_back(tok->child);
+			}
+			tok = tok->next;
+		}
+	}
+
+	return _indexes[t];
+}
+
+void CacheWriter::write(const void *data, size_t size) {
+	auto off = _data.size();
+	_data.resize(off + size);
+	memcpy(_data.data() + off, data, size);
+}
+
+void CacheWriter::write(uint8_t val) {
+	write(&val, sizeof(uint8_t));
+}
+
+void CacheWriter::write(uint32_t val) {
+	write(&val, sizeof(uint32_t));
+}
+
+void CacheWriter::write(const StringView &str) {
+	write(uint32_t(str.size()));
+	write(str.data(), str.size());
+}
+
+void CacheWriter::writeView(const StringView &str) {
+	if (str.data() >= _source.data() && str.data() + str.size() <= _source.data() + _source.size()) {
+		write(uint8_t(0));
+		write(uint32_t(str.data() - _source.data()));
+		write(uint32_t(str.size()));
+	} else {
+		write(uint8_t(1));
+		write(str);
+	}
+}
+
+const CacheWriter::BytesType &CacheWriter::finalize(token *root, uint32_t extensions, uint64_t targets) {
+	const uint32_t rootIndex = index(root);
+
+	// align token table
+	while (_data.size() % alignof(Cache::TokenData) != 0) {
+		write(uint8_t(0));
+	}
+
+	const uint64_t tokensOffset = _data.size();
+
+	Cache::TokenData data;
+	for (auto &it : _tokens) {
+		memset(&data, 0, sizeof(Cache::TokenData));
+		data.type = it->type;
+		data.flags = uint8_t((it->can_open ? Cache::CanOpen : 0) | (it->can_close ? Cache::CanClose : 0) | (it->unmatched ? Cache::Unmatched : 0));
+		data.start = it->start;
+		data.len = it->len;
+
+		// links outside of collected trees are dropped
+		auto link = [&] (const token *t) -> uint32_t {
+			if (!t) {
+				return 0;
+			}
+			auto l = _indexes.find(t);
+			return (l != _indexes.end()) ? l->second : 0;
+		};
+
+		data.next = link(it->next);
+		data.prev = link(it->prev);
+		data.child = link(it->child);
+		data.tail = link(it->tail);
+		data.mate = link(it->mate);
+		write(&data, sizeof(Cache::TokenData));
+	}
+
+	Cache::Header header;
+	memset(&header, 0, sizeof(Cache::Header));
+	memcpy(header.magic, s_cacheMagic, sizeof(s_cacheMagic));
+	header.version = Cache::Version;
+	header.byteOrder = Cache::ByteOrderMark;
+	header.extensions = extensions;
+	header.root = rootIndex;
+	header.sourceHash = Cache::hash(_source);
+	header.sourceSize = _source.size();
+	header.targets = targets;
+	header.tokensOffset = tokensOffset;
+	header.tokensCount = _tokens.size();
+
+	memcpy(_data.data(), &header, sizeof(Cache::Header));
+	return _data;
+}
+
+CacheReader::CacheReader(const StringView &source, const uint8_t *data, size_t size)
+: _source(source), _data(data), _size(size) { }
+
+token *CacheReader::load(uint32_t extensions, uint64_t targets) {
+	Cache::Header header;
+	if (!read(&header, sizeof(Cache::Header))) {
+		return nullptr;
+	}
+
+	if (memcmp(header.magic, s_cacheMagic, sizeof(s_cacheMagic)) != 0 || header.version != Cache::Version
+			|| header.byteOrder != Cache::ByteOrderMark || header.extensions != extensions || header.targets != targets
+			|| header.sourceSize != _source.size() || header.root == 0 || header.root > header.tokensCount
+			|| header.tokensOffset > _size || (_size - header.tokensOffset) / sizeof(Cache::TokenData) < header.tokensCount) {
+		_good = false;
+		return nullptr;
+	}
+
+	if (header.sourceHash != Cache::hash(_source)) {
+		_good = false;
+		return nullptr;
+	}
+
+	_tokensCount = header.tokensCount;
+	_tokens = (token *)memory::pool::palloc(memory::pool::acquire(), sizeof(token) * _tokensCount);
+
+	auto link = [&] (uint32_t idx) -> token * {
+		return (idx > 0 && idx <= _tokensCount) ? &_tokens[idx - 1] : nullptr;
+	};
+
+	Cache::TokenData data;
+	for (size_t i = 0; i < _tokensCount; ++ i) {
+		memcpy(&data, _data + header.tokensOffset + i * sizeof(Cache::TokenData), sizeof(Cache::TokenData));
+
+		if (data.start > _source.size() || data.len > _source.size() - data.start) {
+			_good = false;
+			return nullptr;
+		}
+
+		auto t = &_tokens[i];
+		t->type = data.type;
+		t->can_open = (data.flags & Cache::CanOpen) != 0;
+		t->can_close = (data.flags & Cache::CanClose) != 0;
+		t->unmatched = (data.flags & Cache::Unmatched) != 0;
+		t->start = data.start;
+		t->len = data.len;
+		t->next = link(data.next);
+		t->prev = link(data.prev);
+		t->child = link(data.child);
+		t->tail = link(data.tail);
+		t->mate = link(data.mate);
+	}
+
+	// content section follows header
+	_size = header.tokensOffset;
+	return link(header.root);
+}
+
+bool CacheReader::read(void *buf, size_t size) {
+	if (!_good || _size - _offset < size) {
+		_good = false;
+		return false;
+	}
+
+	memcpy(buf, _data + _offset, size);
+	_offset += size;
+	return true;
+}
+
+bool CacheReader::read(uint8_t &val) {
+	return read(&val, sizeof(uint8_t));
+}
+
+bool CacheReader::read(uint32_t &val) {
+	return read(&val, sizeof(uint32_t));
+}
+
+bool CacheReader::read(StringType &str) {
+	uint32_t size = 0;
+	if (!read(size) || _size - _offset < size) {
+		_good = false;
+		return false;
+	}
+
+	str.assign((const char *)_data + _offset, size);
+	_offset += size;
+	return true;
+}
+
+bool CacheReader::readView(StringView &str) {
+	uint8_t type = 0;
+	if (!read(type)) {
+		return false;
+	}
+
+	if (type == 0) {
+		uint32_t off = 0, size = 0;
+		if (!read(off) || !read(size) || off > _source.size() || size > _source.size() - off) {
+			_good = false;
+			return false;
+		}
+		str = StringView(_source.data() + off, size);
+		return true;
+	} else {
+		StringType tmp;
+		if (!read(tmp)) {
+			return false;
+		}
+		auto buf = (char *)memory::pool::palloc(memory::pool::acquire(), tmp.size() + 1);
+		memcpy(buf, tmp.data(), tmp.size());
+		buf[tmp.size()] = 0;
+		str = StringView(buf, tmp.size());
+		return true;
+	}
+}
+
+bool CacheReader::readToken(token *&t) {
+	uint32_t idx = 0;
+	if (!read(idx) || idx > _tokensCount) {
+		_good = false;
+		return false;
+	}
+
+	t = (idx > 0) ? &_tokens[idx - 1] : nullptr;
+	return true;
+}
+
+NS_MMD_END
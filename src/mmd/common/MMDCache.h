@@ -0,0 +1,133 @@
+/**
+Copyright (c) 2017 Roman Katuntsev <sbkarr@stappler.org>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+**/
+
+#ifndef MMD_COMMON_MMDCACHE_H_
+#define MMD_COMMON_MMDCACHE_H_
+
+#include "MMDCommon.h"
+
+#include <unordered_map>
+
+NS_MMD_BEGIN
+
+/// Binary cache for parsed document: token tree and processed content
+///
+/// Cache data is only valid for the same source text, extensions and search targets, it's
+/// checked with source hash and size and targets digest, stored in header. Data is stored in
+/// native byte order, caches from the machine with different byte order are rejected.
+struct Cache {
+	static constexpr uint32_t Version = 3;
+	static constexpr uint32_t ByteOrderMark = 0x01020304;
+
+	struct Header {
+		char magic[8]; // "MMDCACHE"
+		uint32_t version;
+		uint32_t byteOrder;
+		uint32_t extensions; // extensions, used for parsing
+		uint32_t root; // index of root token
+		uint64_t sourceHash;
+		uint64_t sourceSize;
+		uint64_t targets; // digest of search targets, matched in tree, 0 if none
+		uint64_t tokensOffset;
+		uint64_t tokensCount;
+	};
+
+	// Token links are stored as indexes + 1, 0 is nullptr
+	struct TokenData {
+		uint16_t type;
+		uint8_t flags;
+		uint8_t reserved;
+		uint32_t start;
+		uint32_t len;
+		uint32_t next;
+		uint32_t prev;
+		uint32_t child;
+		uint32_t tail;
+		uint32_t mate;
+	};
+
+	enum TokenFlags : uint8_t {
+		CanOpen = 1 << 0,
+		CanClose = 1 << 1,
+		Unmatched = 1 << 2,
+	};
+
+	static uint64_t hash(const StringView &);
+};
+
+class CacheWriter : public memory::PoolInterface {
+public:
+	CacheWriter(const StringView &source);
+
+	// assign index for token and its subtree
+	uint32_t index(token *);
+
+	void write(const void *, size_t);
+	void write(uint8_t);
+	void write(uint32_t);
+	void write(const StringView &);
+
+	// views into source are stored as offsets
+	void writeView(const StringView &);
+
+	void writeToken(token *t) { write(index(t)); }
+
+	// write header and token table, return complete cache data
+	const BytesType &finalize(token *root, uint32_t extensions, uint64_t targets);
+
+protected:
+	StringView _source;
+	BytesType _data;
+	VectorType<token *> _tokens;
+	std::unordered_map<const token *, uint32_t> _indexes;
+};
+
+class CacheReader : public memory::PoolInterface {
+public:
+	CacheReader(const StringView &source, const uint8_t *, size_t);
+
+	// check header and load token table, returns root token or nullptr on error
+	token *load(uint32_t extensions, uint64_t targets);
+
+	bool read(void *, size_t);
+	bool read(uint8_t &);
+	bool read(uint32_t &);
+	bool read(StringType &);
+	bool readView(StringView &);
+	bool readToken(token *&);
+
+	bool good() const { return _good; }
+
+protected:
+	StringView _source;
+	const uint8_t *_data = nullptr;
+	size_t _size = 0;
+	size_t _offset = 0;
+	bool _good = true;
+
+	token *_tokens = nullptr;
+	size_t _tokensCount = 0;
+};
+
+NS_MMD_END
+
+#endif /* MMD_COMMON_MMDCACHE_H_ */
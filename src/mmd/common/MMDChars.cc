@@ -42,6 +42,12 @@
 #include "SPCommon.h"
 #include "MMDChars.h"
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 NS_MMD_BEGIN
 
 namespace chars {
@@ -70,6 +76,205 @@ bool isType(char c, Type t) {
 	return smart_char_type[(unsigned char) c] & toInt(t);
 }
 
+/// Bytes, that scanner always skips as single characters (same set as in lexer rules)
+static uint8_t plain_char_table[256] = {
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 1, 1, 0, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0,
+	0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+static inline bool is_continuation_in(uint8_t c, uint8_t min, uint8_t max) {
+	return c >= min && c <= max;
+}
+
+/// Length of valid UTF-8 sequence, skipped by scanner, or 0
+/// U+0080-U+00BF (0xC2 lead) can be non-breaking space and is processed by scanner
+static size_t plain_utf8_len(const uint8_t *p, const uint8_t *stop) {
+	const uint8_t c = *p;
+	if (c >= 0xC3 && c <= 0xDF) {
+		return (stop - p >= 2 && is_continuation_in(p[1], 0x80, 0xBF)) ? 2 : 0;
+	} else if (c >= 0xE0 && c <= 0xEF) {
+		if (stop - p < 3) { return 0; }
+		return (is_continuation_in(p[1], (c == 0xE0) ? 0xA0 : 0x80, 0xBF) && is_continuation_in(p[2], 0x80, 0xBF)) ? 3 : 0;
+	} else if (c >= 0xF0 && c <= 0xF4) {
+		if (stop - p < 4) { return 0; }
+		return (is_continuation_in(p[1], (c == 0xF0) ? 0x90 : 0x80, (c == 0xF4) ? 0x8F : 0xBF)
+				&& is_continuation_in(p[2], 0x80, 0xBF) && is_continuation_in(p[3], 0x80, 0xBF)) ? 4 : 0;
+	}
+	return 0;
+}
+
+/// Number of bytes, that scanner will skip at this position, 0 if token can be started here
+static inline size_t plain_char_len(const uint8_t *p, const uint8_t *stop) {
+	const uint8_t c = *p;
+	if (plain_char_table[c]) {
+		return 1;
+	} else if (c == ' ') {
+		// space can start indent or line break, if followed by whitespace or line end
+		if (stop - p < 2) {
+			return 0;
+		}
+		switch (p[1]) {
+		case '\t': case '\n': case '\r': case ' ': case 0xC2: return 0; break;
+		default: return 1; break;
+		}
+	} else if (c >= 0xC3) {
+		return plain_utf8_len(p, stop);
+	}
+	return 0;
+}
+
+#if defined(__AVX2__)
+
+// bitmask of ASCII letters and of spaces in block
+static inline void plain_vector_masks(const uint8_t *p, uint32_t &letters, uint32_t &letterAfter, uint32_t &spaces) {
+	auto v = _mm256_loadu_si256((const __m256i *)p);
+	auto n = _mm256_loadu_si256((const __m256i *)(p + 1));
+
+	auto isLetter = [] (__m256i x) {
+		auto l = _mm256_add_epi8(_mm256_or_si256(x, _mm256_set1_epi8(0x20)), _mm256_set1_epi8(char(128 - 'a')));
+		return _mm256_cmpgt_epi8(_mm256_set1_epi8(char(-128 + 26)), l);
+	};
+
+	letters = uint32_t(_mm256_movemask_epi8(isLetter(v)));
+	letterAfter = uint32_t(_mm256_movemask_epi8(isLetter(n)));
+	spaces = uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' '))));
+}
+
+static constexpr size_t PlainVectorSize = 32;
+using PlainVectorMask = uint32_t;
+
+#elif defined(__SSE2__)
+
+static inline void plain_vector_masks(const uint8_t *p, uint32_t &letters, uint32_t &letterAfter, uint32_t &spaces) {
+	auto v = _mm_loadu_si128((const __m128i *)p);
+	auto n = _mm_loadu_si128((const __m128i *)(p + 1));
+
+	auto isLetter = [] (__m128i x) {
+		auto l = _mm_add_epi8(_mm_or_si128(x, _mm_set1_epi8(0x20)), _mm_set1_epi8(char(128 - 'a')));
+		return _mm_cmplt_epi8(l, _mm_set1_epi8(char(-128 + 26)));
+	};
+
+	letters = uint32_t(_mm_movemask_epi8(isLetter(v)));
+	letterAfter = uint32_t(_mm_movemask_epi8(isLetter(n)));
+	spaces = uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(' '))));
+}
+
+static constexpr size_t PlainVectorSize = 16;
+using PlainVectorMask = uint16_t;
+
+#endif
+
+const char *skipPlainText(const char *str, const char *stop, const char **marker) {
+	auto p = (const uint8_t *)str;
+	auto end = (const uint8_t *)stop;
+	const uint8_t *lastSpace = nullptr;
+
+	while (p < end) {
+#if defined(__AVX2__) || defined(__SSE2__)
+		// Fast path for ASCII prose: letters and single spaces between words;
+		// one extra byte is loaded to check what follows a space
+		while (size_t(end - p) > PlainVectorSize) {
+			uint32_t letters, letterAfter, spaces;
+			plain_vector_masks(p, letters, letterAfter, spaces);
+
+			const PlainVectorMask plain = PlainVectorMask(letters | (spaces & letterAfter));
+			const PlainVectorMask inBlockSpaces = PlainVectorMask(spaces & letterAfter);
+
+			if (plain == PlainVectorMask(~PlainVectorMask(0))) {
+				if (inBlockSpaces) {
+					lastSpace = p + (31 - __builtin_clz(uint32_t(inBlockSpaces)));
+				}
+				p += PlainVectorSize;
+			} else {
+				// skip plain prefix of block, then check byte with scalar path
+				const uint32_t n = __builtin_ctz(uint32_t(PlainVectorMask(~plain)));
+				const uint32_t prefixSpaces = inBlockSpaces & ((1u << n) - 1);
+				if (prefixSpaces) {
+					lastSpace = p + (31 - __builtin_clz(prefixSpaces));
+				}
+				p += n;
+				break;
+			}
+		}
+
+		if (p >= end) {
+			break;
+		}
+#endif
+
+		auto len = plain_char_len(p, end);
+		if (!len) {
+			break;
+		}
+
+		if (*p == ' ') {
+			lastSpace = p;
+		}
+		p += len;
+	}
+
+	if (lastSpace && marker) {
+		*marker = (const char *)(lastSpace + 1);
+	}
+
+	return (const char *)p;
+}
+
+const char *findHtmlEscape(const char *str, const char *stop) {
+	auto p = (const uint8_t *)str;
+	auto end = (const uint8_t *)stop;
+
+#if defined(__AVX2__)
+	while (size_t(end - p) >= 32) {
+		auto v = _mm256_loadu_si256((const __m256i *)p);
+		auto m = _mm256_or_si256(
+				_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('&'))),
+				_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('<')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('>'))));
+		auto mask = uint32_t(_mm256_movemask_epi8(m));
+		if (mask) {
+			return (const char *)(p + __builtin_ctz(mask));
+		}
+		p += 32;
+	}
+#elif defined(__SSE2__)
+	while (size_t(end - p) >= 16) {
+		auto v = _mm_loadu_si128((const __m128i *)p);
+		auto m = _mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')), _mm_cmpeq_epi8(v, _mm_set1_epi8('&'))),
+				_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('<')), _mm_cmpeq_epi8(v, _mm_set1_epi8('>'))));
+		auto mask = uint32_t(_mm_movemask_epi8(m));
+		if (mask) {
+			return (const char *)(p + __builtin_ctz(mask));
+		}
+		p += 16;
+	}
+#endif
+
+	while (p < end) {
+		switch (*p) {
+		case '"': case '&': case '<': case '>': return (const char *)p; break;
+		default: break;
+		}
+		++ p;
+	}
+
+	return stop;
+}
+
 }
 
 NS_MMD_END
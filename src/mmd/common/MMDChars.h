@@ -77,6 +77,15 @@ inline bool isWhitespaceOrLineEndingOrPunctuation(char c) { return isType(c, Typ
 inline bool isContinuationByte(char x) { return (x & 0xC0) == 0x80; }
 inline bool isLeadMultibyte(char x) { return (x & 0xC0) == 0xC0; }
 
+// Skip bytes, that can not start any token for tokenizer scanner
+// (letters, space before letter, valid UTF-8 sequences, etc.), returns first position to scan.
+// When scanner skips the space, it sets its backtracking marker, so `marker` receives
+// position after the last skipped space (or left unchanged, if there were no spaces)
+const char *skipPlainText(const char *str, const char *stop, const char **marker);
+
+// First byte, that should be escaped in HTML text or attribute value (one of `"&<>`), or `stop`
+const char *findHtmlEscape(const char *str, const char *stop);
+
 }
 
 NS_MMD_END
@@ -59,6 +59,9 @@ using token = _sp_mmd_token;
 class Engine;
 class Token;
 class Content;
+class Trie;
+class SearchTargets;
+class Transclusion;
 
 class Processor;
 class HtmlProcessor;
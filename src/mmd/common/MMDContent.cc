@@ -44,6 +44,7 @@
 #include "MMDChars.h"
 #include "MMDToken.h"
 #include "MMDCore.h"
+#include "MMDSearchTargets.h"
 #include "SPString.h"
 
 NS_MMD_BEGIN
@@ -51,12 +52,25 @@ NS_MMD_BEGIN
 Extensions DefaultExtensions = Extensions::Critic | Extensions::Notes | Extensions::Smart;
 Extensions StapplerExtensions = Extensions::Critic | Extensions::Notes | Extensions::Smart | Extensions::StapplerLayout;
 
-static auto clean_inside_pair(const StringView & source, token * t, bool lowercase) -> Content::String {
+// normalized string, that is not a source view: interned in table or allocated from current pool
+static StringView content_store(Content::StringTable *table, const StringView &str) {
+	if (table) {
+		return table->intern(str);
+	}
+
+	auto buf = (char *)memory::pool::palloc(memory::pool::acquire(), str.size() + 1);
+	memcpy(buf, str.data(), str.size());
+	buf[str.size()] = 0;
+	return StringView(buf, str.size());
+}
+
+static auto clean_inside_pair(const StringView & source, token * t, bool lowercase, Content::StringTable *table) -> StringView {
 	auto pairText = text_inside_pair(source, t);
-	return Content::cleanString(pairText, lowercase);
+	return Content::cleanView(pairText, lowercase, table);
 }
 
-static auto clean_inside_pair(const StringView & source, token * t, bool lowercase, Content::Footnote::Type type) -> Content::String {
+static auto clean_inside_pair(const StringView & source, token * t, bool lowercase, Content::Footnote::Type type,
+		Content::StringTable *table) -> StringView {
 	auto pairText = text_inside_pair(source, t);
 	pairText.skipChars<StringView::CharGroup<CharGroupId::WhiteSpace>>();
 	switch (type) {
@@ -69,7 +83,7 @@ static auto clean_inside_pair(const StringView & source, token * t, bool lowerca
 		break;
 	}
 
-	return Content::cleanString(pairText, lowercase);
+	return Content::cleanView(pairText, lowercase, table);
 }
 
 /*static auto clean_string_from_token(const StringView & s, token * t, bool lowercase) -> Content::String {
@@ -113,16 +127,16 @@ static bool validate_url(const StringView & url) {
 	return (len && len == url.size()) ? true : false;
 }
 
-static auto destination_accept(const StringView & s, token ** remainder, bool validate) -> Content::String {
+static auto destination_accept(const StringView & s, token ** remainder, bool validate) -> StringView {
 	const char *source = s.data();
 	StringView url;
-	Content::String clean;
+	StringView clean;
 	token * t = NULL;
 	size_t start;
 	size_t scan_len;
 
 	if (*remainder == NULL) {
-		return url.str<memory::PoolInterface>();
+		return url;
 	}
 
 	switch ((*remainder)->type) {
@@ -171,11 +185,11 @@ static auto destination_accept(const StringView & s, token ** remainder, bool va
 			break;
 	}
 
-	// Is this a valid URL?
-	clean = Content::cleanString(url, false);
+	// Is this a valid URL? (scanner requires null-terminated string, views are not)
+	clean = Content::cleanView(url, false);
 
-	if (validate && !validate_url(clean)) {
-		return Content::String();
+	if (validate && !validate_url(clean.str<memory::PoolInterface>())) {
+		return StringView();
 	}
 
 	return clean;
@@ -199,8 +213,16 @@ StringView text_inside_pair(const StringView & s, token * pair) {
 }
 
 auto url_accept(const char * source, size_t start, size_t max_len, size_t * end_pos, bool validate) -> Content::String {
+	Content::String clean = url_accept_view(source, start, max_len, end_pos).str<memory::PoolInterface>();
+	if (validate && !validate_url(clean)) {
+		return Content::String();
+	}
+	return clean;
+}
+
+auto url_accept_view(const char * source, size_t start, size_t max_len, size_t * end_pos) -> StringView {
 	StringView url;
-	Content::String clean;
+	StringView clean;
 	size_t scan_len;
 
 	scan_len = scan_destination(&source[start]);
@@ -224,11 +246,7 @@ auto url_accept(const char * source, size_t start, size_t max_len, size_t * end_
 
 		url = StringView(&source[start], scan_len);
 
-		clean = Content::cleanString(url, false);
-
-		if (validate && !validate_url(clean)) {
-			return Content::String();
-		}
+		clean = Content::cleanView(url, false);
 	}
 
 	return clean;
@@ -339,34 +357,40 @@ bool table_has_caption(token * t) {
 }
 
 
-Content::Link::Link(const StringView &source, Token && l, String && u, const StringView & t, const StringView & attr, bool clearUrl)
+Content::Link::Link(const StringView &source, Token && l, const StringView & u, const StringView & t, const StringView & attr,
+		bool clearUrl, StringTable *table)
 : label(move(l)) {
 	if (label) {
-		clean_text = clean_inside_pair(source, label, true);
-		label_text = label_from_token(source, label);
+		clean_text = clean_inside_pair(source, label, true, table);
+		label_text = Content::labelView(StringView(&source[label.getToken()->start], label.getToken()->len), table);
 	}
 
-	url = clearUrl ? Content::cleanString(StringView(u), false) : move(u);
+	url = clearUrl ? Content::cleanView(u, false, table) : u;
 
-	StringView r(t);
-	StringStream stream;
-	while (!r.empty()) {
-		stream << r.readUntil<StringView::Chars<'"'>>();
-		if (r.is('"')) {
-			stream << "&quot;";
-			++ r;
+	if (t.empty() || !memchr(t.data(), '"', t.size())) {
+		title = t;
+	} else {
+		StringView r(t);
+		StringStream stream;
+		while (!r.empty()) {
+			stream << r.readUntil<StringView::Chars<'"'>>();
+			if (r.is('"')) {
+				stream << "&quot;";
+				++ r;
+			}
 		}
+
+		title = content_store(table, stream.str());
 	}
 
-	title = stream.str();
 	parseAttributes(attributes, attr);
 }
 
-Content::Link::Link(const StringView &source, Token && l)
-: label(move(l)) {
-	clean_text = source.str<memory::PoolInterface>();
-	label_text = source.str<memory::PoolInterface>();
-	url = String("#") + source.str<memory::PoolInterface>();
+Content::Link::Link(const StringView &source, Token && l, StringTable *table)
+: origin(HtmlId), label(move(l)) {
+	clean_text = source;
+	label_text = source;
+	url = content_store(table, String("#") + source.str<memory::PoolInterface>());
 }
 
 void Content::Link::parseAttributes(AttrVec &attr, const StringView &str) {
@@ -394,11 +418,11 @@ void Content::Link::parseAttributes(AttrVec &attr, const StringView &str) {
 	}
 }
 
-Content::Footnote::Footnote(const StringView &source, Token && l, Token && c, bool lowercase, Type type)
+Content::Footnote::Footnote(const StringView &source, Token && l, Token && c, bool lowercase, Type type, StringTable *table)
 : label(move(l)) {
 	if (label) {
-		clean_text = clean_inside_pair(source, label, lowercase, type);
-		label_text = label_from_token(source, label);
+		clean_text = clean_inside_pair(source, label, lowercase, type, table);
+		label_text = Content::labelView(StringView(&source[label.getToken()->start], label.getToken()->len), table);
 	}
 
 	if (c) {
@@ -466,6 +490,88 @@ auto Content::cleanString(const StringView &str, bool lowercase) -> String {
 	return ret;
 }
 
+// fast paths accept only ASCII, unicode case conversion is left to string::tolower
+static bool content_is_label(const StringView &str) {
+	for (size_t i = 0; i < str.size(); ++ i) {
+		const char c = str[i];
+		if (!((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '.' || c == '_' || c == ':' || c == '-')) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool content_is_clean(const StringView &str, bool lowercase) {
+	if (str.empty() || str[0] == ' ' || str[str.size() - 1] == ' ') {
+		return false;
+	}
+
+	char prev = 0;
+	for (size_t i = 0; i < str.size(); ++ i) {
+		const char c = str[i];
+		switch (c) {
+		case '\t': case '\n': case '\r': return false;
+		case ' ': if (prev == ' ') { return false; } break;
+		default:
+			if (lowercase && ((c >= 'A' && c <= 'Z') || (c & 0x80))) {
+				return false;
+			}
+			break;
+		}
+		prev = c;
+	}
+	return true;
+}
+
+StringView Content::labelView(const StringView &str, StringTable *table) {
+	if (content_is_label(str)) {
+		return str;
+	}
+
+	auto ret = labelFromString(str);
+	return ret.empty() ? StringView() : content_store(table, ret);
+}
+
+StringView Content::cleanView(const StringView &str, bool lowercase, StringTable *table) {
+	if (str.empty()) {
+		return StringView();
+	}
+
+	if (content_is_clean(str, lowercase)) {
+		return str;
+	}
+
+	auto ret = cleanString(str, lowercase);
+	return ret.empty() ? StringView() : content_store(table, ret);
+}
+
+StringView Content::StringTable::intern(const StringView &str) {
+	Key key(str);
+	auto ret = strings.get(key);
+	if (!ret.empty() || str.empty()) {
+		return ret;
+	}
+
+	auto buf = (char *)memory::pool::palloc(memory::pool::acquire(), str.size() + 1);
+	memcpy(buf, str.data(), str.size());
+	buf[str.size()] = 0;
+
+	key.str = StringView(buf, str.size());
+	strings.try_emplace(key, key.str);
+	return key.str;
+}
+
+void Content::StringTable::merge(StringTable &&other) {
+	other.strings.foreach([&] (const Key &key, const StringView &value) {
+		strings.try_emplace(key, value);
+	});
+	other.clear();
+}
+
+void Content::StringTable::clear() {
+	strings.clear();
+}
+
 auto Content::explicitLink(const StringView &s, const Extensions &ext, token * bracket, token * paren) -> Link * {
 	const char *source = s.data();
 	const char *end = &source[paren->start + paren->len];
@@ -474,7 +580,7 @@ auto Content::explicitLink(const StringView &s, const Extensions &ext, token * b
 
 	size_t attr_len;
 
-	String url;
+	StringView url;
 	StringView title;
 	StringView attributes;
 
@@ -484,7 +590,7 @@ auto Content::explicitLink(const StringView &s, const Extensions &ext, token * b
 	}
 
 	// Grab URL
-	url = url_accept(source, pos, paren->start + paren->len - 1 - pos, &pos, false);
+	url = url_accept_view(source, pos, paren->start + paren->len - 1 - pos, &pos);
 
 	// Skip whitespace
 	while (chars::isWhitespace(source[pos])) {
@@ -532,10 +638,14 @@ auto Content::explicitLink(const StringView &s, const Extensions &ext, token * b
 	Link *l = nullptr;
 	if (!attributes.empty()) {
 		if (!ext.hasFlag(Extensions::Compatibility)) {
-			l = new Link(source, Token(), move(url), title, attributes, false);
+			l = new Link(source, Token(), url, title, attributes, false);
 		}
 	} else {
-		l = new Link(source, Token(), move(url), title, attributes, false);
+		l = new Link(source, Token(), url, title, attributes, false);
+	}
+
+	if (l) {
+		l->origin = Link::Inline;
 	}
 
 	return l;
@@ -575,11 +685,19 @@ void Content::reset() {
 
 	meta.clear(); meta.reserve(8);
 
+	strings.clear();
+
 	linksView.clear();
 	citationView.clear();
 	footnotesView.clear();
 	abbreviationView.clear();
 	glossaryView.clear();
+	viewsErased = false;
+
+	sharedAbbreviationView.clear();
+	sharedGlossaryView.clear();
+
+	deferredShifts.clear();
 }
 
 auto Content::getHeaders() const -> const Vector<Token> & {
@@ -620,17 +738,21 @@ auto Content::getMetaDict() const -> const Dict<String> & {
 
 template <typename T>
 static auto getFromDictView(const Content::DictView<T *> &dict, const StringView &target) -> T * {
-	auto key = Content::cleanString(target, false);
+	if (dict.size() == 0) {
+		return nullptr;
+	}
 
-	auto it = dict.find(key);
-	if (it != dict.end()) {
-		return it->second;
+	// In most cases target is already normalized, so it's hashed as is, without copying
+	Content::Key clean(Content::cleanView(target, false));
+	if (auto ret = dict.get(clean)) {
+		return ret;
 	}
 
-	key = Content::labelFromString(target);
-	it = dict.find(key);
-	if (it != dict.end()) {
-		return it->second;
+	Content::Key label(Content::labelView(target));
+	if (!(label == clean)) {
+		if (auto ret = dict.get(label)) {
+			return ret;
+		}
 	}
 
 	// None found
@@ -642,7 +764,10 @@ Content::Link *Content::getLink(const StringView &key) const {
 }
 
 Content::Footnote *Content::getAbbreviation(const StringView &target) const {
-	return getFromDictView(abbreviationView, target);
+	if (auto ret = getFromDictView(abbreviationView, target)) {
+		return ret;
+	}
+	return searchTargets ? getShared(sharedAbbreviationView, searchTargets->getAbbreviation(target)) : nullptr;
 }
 
 Content::Footnote *Content::getCitation(const StringView &target) const {
@@ -654,7 +779,10 @@ Content::Footnote *Content::getFootnote(const StringView &target) const {
 }
 
 Content::Footnote *Content::getGlossary(const StringView &target) const {
-	return getFromDictView(glossaryView, target);
+	if (auto ret = getFromDictView(glossaryView, target)) {
+		return ret;
+	}
+	return searchTargets ? getShared(sharedGlossaryView, searchTargets->getGlossary(target)) : nullptr;
 }
 
 StringView Content::getMeta(const StringView &target) const {
@@ -670,38 +798,643 @@ void Content::process(const StringView &str) {
 	processDefinitions(str);
 	processHeaders(str);
 	processTables(str);
+	processViews();
+}
 
-	linksView.reserve(links.size());
+void Content::processViews() {
+	linksView.reserve(links.size() * 2);
 	for (auto &it : links) {
 		linksView.try_emplace(it->clean_text, it);
 		linksView.try_emplace(it->label_text, it);
 	}
 
-	citationView.reserve(citation.size());
+	citationView.reserve(citation.size() * 2);
 	for (auto &it : citation) {
 		citationView.try_emplace(it->clean_text, it);
 		citationView.try_emplace(it->label_text, it);
 	}
 
-	footnotesView.reserve(footnotes.size());
+	footnotesView.reserve(footnotes.size() * 2);
 	for (auto &it : footnotes) {
 		footnotesView.try_emplace(it->clean_text, it);
 		footnotesView.try_emplace(it->label_text, it);
 	}
 
-	glossaryView.reserve(glossary.size());
+	glossaryView.reserve(glossary.size() * 2);
 	for (auto &it : glossary) {
 		glossaryView.try_emplace(it->clean_text, it);
 		glossaryView.try_emplace(it->label_text, it);
 	}
 
-	abbreviationView.reserve(abbreviation.size());
+	abbreviationView.reserve(abbreviation.size() * 2);
 	for (auto &it : abbreviation) {
 		abbreviationView.try_emplace(it->clean_text, it);
 		abbreviationView.try_emplace(it->label_text, it);
 	}
 }
 
+// keys are inserted only if they are missing, so only keys of erased items are resolved,
+// first remaining item with the same key takes it
+template <typename T>
+static void content_resolve_view(Content::DictView<T *> &view, const Content::Vector<T *> &items) {
+	for (auto &it : items) {
+		view.try_emplace(it->clean_text, it);
+		view.try_emplace(it->label_text, it);
+	}
+}
+
+void Content::resolveViews() {
+	if (!viewsErased) {
+		return;
+	}
+
+	content_resolve_view(linksView, links);
+	content_resolve_view(citationView, citation);
+	content_resolve_view(footnotesView, footnotes);
+	content_resolve_view(glossaryView, glossary);
+	content_resolve_view(abbreviationView, abbreviation);
+
+	viewsErased = false;
+}
+
+void Content::resetUsage() {
+	for (auto &vec : { &abbreviation, &citation, &glossary, &footnotes }) {
+		for (auto &it : *vec) {
+			it->count = maxOf<size_t>();
+		}
+	}
+
+	// local copies of shared definitions are allocated from previous processing pool
+	sharedAbbreviationView.clear();
+	sharedGlossaryView.clear();
+}
+
+void Content::setSearchTargets(const SearchTargets *targets) {
+	searchTargets = targets;
+	sharedAbbreviationView.clear();
+	sharedGlossaryView.clear();
+}
+
+const SearchTargets *Content::getSearchTargets() const {
+	return searchTargets;
+}
+
+bool Content::addSearchTargets(Trie &ac) const {
+	for (auto &it : abbreviation) {
+		ac.insert(it->label_text, PAIR_BRACKET_ABBREVIATION);
+	}
+
+	for (auto &it : glossary) {
+		ac.insert(it->clean_text, PAIR_BRACKET_GLOSSARY);
+	}
+
+	return !abbreviation.empty() || !glossary.empty();
+}
+
+// copy token chain (or single token, if chain is false) with subtrees, mates are linked inside of the copy
+static token *content_copy_tree(token *t, std::unordered_map<const token *, token *> &copies, bool chain = true) {
+	token *head = nullptr;
+	token *prev = nullptr;
+	while (t) {
+		auto c = sp_mmd_token_copy(t);
+		copies.emplace(t, c);
+
+		c->prev = prev;
+		c->next = nullptr;
+		c->child = content_copy_tree(t->child, copies);
+		if (prev) {
+			prev->next = c;
+		} else {
+			head = c;
+		}
+		prev = c;
+		t = chain ? t->next : nullptr;
+	}
+
+	if (head) {
+		head->tail = prev;
+	}
+	return head;
+}
+
+static void content_copy_mates(token *t, const std::unordered_map<const token *, token *> &copies) {
+	while (t) {
+		if (t->mate) {
+			auto it = copies.find(t->mate);
+			t->mate = (it != copies.end()) ? it->second : nullptr;
+		}
+		if (t->tail && t->tail != t) {
+			auto it = copies.find(t->tail);
+			if (it != copies.end()) {
+				t->tail = it->second;
+			}
+		}
+		content_copy_mates(t->child, copies);
+		t = t->next;
+	}
+}
+
+auto Content::getShared(DictView<Footnote *> &view, const Footnote *shared) const -> Footnote * {
+	if (!shared) {
+		return nullptr;
+	}
+
+	Key key(shared->label_text);
+	if (auto ret = view.get(key)) {
+		return ret;
+	}
+
+	// Local copy holds usage counter for this document, tokens are copied too,
+	// because processors can modify them
+	std::unordered_map<const token *, token *> copies;
+	auto f = new Footnote();
+	if (shared->label) {
+		f->label = Token(content_copy_tree(shared->label.getToken(), copies, false));
+	}
+	if (shared->content) {
+		f->content = Token(content_copy_tree(shared->content.getToken(), copies));
+	}
+	content_copy_mates(f->label.getToken(), copies);
+	content_copy_mates(f->content.getToken(), copies);
+
+	f->label_text = shared->label_text;
+	f->clean_text = shared->clean_text;
+	f->free_para = shared->free_para;
+	f->reference = shared->reference;
+	f->source = shared->source.empty() ? searchTargets->getSource() : shared->source;
+
+	view.try_emplace(key, f);
+	return f;
+}
+
+static uint32_t content_position(const Token &label, const Token &content) {
+	if (label) {
+		return label.getToken()->start;
+	} else if (content) {
+		return content.getToken()->start;
+	}
+	return 0;
+}
+
+static bool content_in_range(const Token &label, const Token &content, uint32_t start, uint32_t end) {
+	auto pos = content_position(label, content);
+	return pos >= start && pos < end;
+}
+
+template <typename T, typename Callback>
+static void content_erase_if(Content::Vector<T> &vec, const Callback &cb) {
+	vec.erase(std::remove_if(vec.begin(), vec.end(), cb), vec.end());
+}
+
+static uint32_t content_token_position(const Token &t) {
+	return t.getToken()->start;
+}
+
+static uint32_t content_footnote_position(const Content::Footnote *f) {
+	return content_position(f->label, f->content);
+}
+
+// headers, definitions, tables and footnotes are stored in document order
+template <typename T, typename Position>
+static auto content_lower_bound(const Content::Vector<T> &vec, uint32_t pos, const Position &position) {
+	return std::lower_bound(vec.begin(), vec.end(), pos, [&] (const T &it, uint32_t p) {
+		return position(it) < p;
+	});
+}
+
+// erase items in [start, end), returns number of erased items
+template <typename T, typename Position>
+static size_t content_erase_range(Content::Vector<T> &vec, uint32_t start, uint32_t end, const Position &position) {
+	auto first = content_lower_bound(vec, start, position);
+	auto last = content_lower_bound(vec, end, position);
+	auto ret = size_t(last - first);
+	if (ret) {
+		vec.erase(first, last);
+	}
+	return ret;
+}
+
+// iterative, subtrees can be as deep as parser allows
+static void content_shift_tree(token *t, int64_t diff) {
+	Content::Vector<token *> stack;
+	while (t) {
+		t->start = uint32_t(int64_t(t->start) + diff);
+		if (t->child) {
+			if (t->next) {
+				stack.emplace_back(t->next);
+			}
+			t = t->child;
+		} else if (t->next) {
+			t = t->next;
+		} else if (!stack.empty()) {
+			t = stack.back();
+			stack.pop_back();
+		} else {
+			t = nullptr;
+		}
+	}
+}
+
+// new item takes the key, if it precedes current one in content storage, as if views were built from scratch
+template <typename T, typename Less>
+static void content_merge_view(Content::DictView<T *> &view, const Content::Vector<T *> &items, const Less &less) {
+	for (auto &it : items) {
+		for (auto &str : { it->clean_text, it->label_text }) {
+			Content::Key key(str);
+			auto current = view.get(key);
+			if (!current || less(it, current)) {
+				view.assign(key, it);
+			}
+		}
+	}
+}
+
+template <typename T, typename Less>
+static void content_merge_sorted(Content::Vector<T> &target, Content::Vector<T> &source, const Less &less) {
+	for (auto &it : source) {
+		target.insert(std::upper_bound(target.begin(), target.end(), it, less), move(it));
+	}
+	source.clear();
+}
+
+bool Content::hasSearchTargets(uint32_t start, uint32_t end) const {
+	for (auto &vec : { &abbreviation, &glossary }) {
+		for (auto &it : *vec) {
+			if (content_in_range(it->label, it->content, start, end)) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+void Content::erase(uint32_t start, uint32_t end) {
+	content_erase_range(headers, start, end, content_token_position);
+	content_erase_range(definitions, start, end, content_token_position);
+	content_erase_range(tables, start, end, content_token_position);
+
+	auto footnoteInRange = [&] (Footnote *f) {
+		return content_in_range(f->label, f->content, start, end);
+	};
+
+	auto linkInRange = [&] (Link *l) {
+		return content_in_range(l->label, Token(), start, end);
+	};
+
+	// views are scanned only when they refer to erased items, predicates only read token positions
+	size_t erased = 0;
+	if (std::any_of(links.begin(), links.end(), linkInRange)) {
+		erased += linksView.erase_if(linkInRange);
+		content_erase_if(links, linkInRange);
+	}
+
+	auto eraseFootnotes = [&] (Vector<Footnote *> &vec, DictView<Footnote *> &view) {
+		auto first = content_lower_bound(vec, start, content_footnote_position);
+		if (first != vec.end() && content_footnote_position(*first) < end) {
+			erased += view.erase_if(footnoteInRange);
+			content_erase_range(vec, start, end, content_footnote_position);
+		}
+	};
+
+	eraseFootnotes(abbreviation, abbreviationView);
+	eraseFootnotes(citation, citationView);
+	eraseFootnotes(glossary, glossaryView);
+	eraseFootnotes(footnotes, footnotesView);
+
+	viewsErased = viewsErased || erased > 0;
+}
+
+void Content::shift(uint32_t pos, int64_t diff, const StringView &prev, const char *next) {
+	// Blocks with items are already shifted, only detached paragraphs for inline definitions remains
+	for (auto &vec : { &abbreviation, &citation, &glossary, &footnotes }) {
+		for (auto &it : *vec) {
+			if (it->free_para && it->content && it->content.getToken()->start >= pos) {
+				it->content.getToken()->start = uint32_t(int64_t(it->content.getToken()->start) + diff);
+			}
+		}
+	}
+
+	// Attributes and unnormalized strings refers to source string directly,
+	// interned strings are stored outside of it
+	auto rebase = [&] (StringView &v) {
+		if (v.data() < prev.data() || v.data() + v.size() > prev.data() + prev.size()) {
+			return;
+		}
+		int64_t off = v.data() - prev.data();
+		if (off >= int64_t(pos)) {
+			off += diff;
+		}
+		v = StringView(next + off, v.size());
+	};
+
+	auto rebaseLink = [&] (Link *it) {
+		rebase(it->label_text);
+		rebase(it->clean_text);
+		rebase(it->url);
+		rebase(it->title);
+		for (auto &attr : it->attributes) {
+			rebase(attr.first);
+			rebase(attr.second);
+		}
+	};
+
+	if (prev.data() != next) {
+		// source was moved, every view is updated
+		for (auto &vec : { &abbreviation, &citation, &glossary, &footnotes }) {
+			for (auto &it : *vec) {
+				rebase(it->label_text);
+				rebase(it->clean_text);
+			}
+		}
+
+		for (auto &it : links) {
+			rebaseLink(it);
+		}
+
+		// stored keys are views too, hashes are not changed with rebasing
+		linksView.rebase(rebase);
+		for (auto view : { &citationView, &footnotesView, &abbreviationView, &glossaryView }) {
+			view->rebase(rebase);
+		}
+		return;
+	}
+
+	if (diff == 0) {
+		return;
+	}
+
+	// Text after pos is moved in place: items before updated range are not changed, items after it
+	// are already shifted with their blocks, so only their views and keys are updated
+	const uint32_t from = uint32_t(std::min(int64_t(pos), int64_t(pos) + diff));
+
+	auto rebaseKeys = [&] (auto &view, auto item) {
+		Key label(item->label_text);
+		Key clean(item->clean_text);
+		view.rebase(label, item, rebase);
+		if (!(clean == label)) {
+			view.rebase(clean, item, rebase);
+		}
+	};
+
+	auto rebaseFootnotes = [&] (Vector<Footnote *> &vec, DictView<Footnote *> &view) {
+		for (auto it = content_lower_bound(vec, from, content_footnote_position); it != vec.end(); ++ it) {
+			rebase((*it)->label_text);
+			rebase((*it)->clean_text);
+			rebaseKeys(view, *it);
+		}
+	};
+
+	rebaseFootnotes(abbreviation, abbreviationView);
+	rebaseFootnotes(citation, citationView);
+	rebaseFootnotes(glossary, glossaryView);
+	rebaseFootnotes(footnotes, footnotesView);
+
+	// links are ordered by origin first; every view should be rebased exactly once
+	for (auto &it : links) {
+		if (!it->label || it->label.getToken()->start >= from) {
+			rebaseLink(it);
+			rebaseKeys(linksView, it);
+		}
+	}
+}
+
+void Content::getPositions(uint32_t pos, Vector<uint32_t> &ret) const {
+	for (auto vec : { &headers, &definitions, &tables }) {
+		for (auto it = content_lower_bound(*vec, pos, content_token_position); it != vec->end(); ++ it) {
+			ret.emplace_back(it->getToken()->start);
+		}
+	}
+
+	for (auto vec : { &abbreviation, &citation, &glossary, &footnotes }) {
+		for (auto it = content_lower_bound(*vec, pos, content_footnote_position); it != vec->end(); ++ it) {
+			if ((*it)->label) {
+				ret.emplace_back((*it)->label.getToken()->start);
+			}
+			if ((*it)->content && !(*it)->free_para) {
+				ret.emplace_back((*it)->content.getToken()->start);
+			}
+		}
+	}
+
+	for (auto &it : links) {
+		if (it->label && it->label.getToken()->start >= pos) {
+			ret.emplace_back(it->label.getToken()->start);
+		}
+	}
+
+	std::sort(ret.begin(), ret.end());
+}
+
+void Content::deferShift(token *block, int64_t diff) {
+	auto it = deferredShifts.find(block);
+	if (it == deferredShifts.end()) {
+		deferredShifts.emplace(block, diff);
+	} else {
+		it->second += diff;
+	}
+}
+
+void Content::dropShift(token *block) {
+	deferredShifts.erase(block);
+}
+
+bool Content::resolveShift(token *block) const {
+	if (deferredShifts.empty()) {
+		return false;
+	}
+
+	auto it = deferredShifts.find(block);
+	if (it == deferredShifts.end()) {
+		return false;
+	}
+
+	if (it->second != 0) {
+		content_shift_tree(block->child, it->second);
+	}
+	deferredShifts.erase(it);
+	return true;
+}
+
+void Content::resolveShifts() const {
+	for (auto &it : deferredShifts) {
+		if (it.second != 0) {
+			content_shift_tree(it.first->child, it.second);
+		}
+	}
+	deferredShifts.clear();
+}
+
+void Content::merge(Content &&other) {
+	auto tokenLess = [] (const Token &l, const Token &r) {
+		return l.getToken()->start < r.getToken()->start;
+	};
+
+	content_merge_sorted(headers, other.headers, tokenLess);
+	content_merge_sorted(definitions, other.definitions, tokenLess);
+	content_merge_sorted(tables, other.tables, tokenLess);
+
+	auto footnoteLess = [] (Footnote *l, Footnote *r) {
+		return content_position(l->label, l->content) < content_position(r->label, r->content);
+	};
+
+	auto linkLess = [] (Link *l, Link *r) {
+		if (l->origin != r->origin) {
+			return l->origin < r->origin;
+		}
+		return content_position(l->label, Token()) < content_position(r->label, Token());
+	};
+
+	resolveViews();
+
+	content_merge_view(abbreviationView, other.abbreviation, footnoteLess);
+	content_merge_view(citationView, other.citation, footnoteLess);
+	content_merge_view(glossaryView, other.glossary, footnoteLess);
+	content_merge_view(footnotesView, other.footnotes, footnoteLess);
+	content_merge_view(linksView, other.links, linkLess);
+
+	content_merge_sorted(abbreviation, other.abbreviation, footnoteLess);
+	content_merge_sorted(citation, other.citation, footnoteLess);
+	content_merge_sorted(glossary, other.glossary, footnoteLess);
+	content_merge_sorted(footnotes, other.footnotes, footnoteLess);
+
+	for (auto &it : other.meta) {
+		meta.emplace(it.first, move(it.second));
+	}
+
+	strings.merge(move(other.strings));
+
+	content_merge_sorted(links, other.links, linkLess);
+}
+
+void Content::writeCache(CacheWriter &w) const {
+	w.write(uint32_t(toInt(extensions.flags)));
+
+	for (auto &vec : { &headers, &definitions, &tables }) {
+		w.write(uint32_t(vec->size()));
+		for (auto &it : *vec) {
+			w.writeToken(it.getToken());
+		}
+	}
+
+	for (auto &vec : { &abbreviation, &citation, &glossary, &footnotes }) {
+		w.write(uint32_t(vec->size()));
+		for (auto &it : *vec) {
+			w.writeToken(it->label.getToken());
+			w.writeToken(it->content.getToken());
+			w.writeView(it->label_text);
+			w.writeView(it->clean_text);
+			w.write(uint8_t((it->free_para ? 1 : 0) | (it->reference ? 2 : 0)));
+		}
+	}
+
+	w.write(uint32_t(links.size()));
+	for (auto &it : links) {
+		w.write(uint8_t(it->origin));
+		w.writeToken(it->label.getToken());
+		w.writeView(it->label_text);
+		w.writeView(it->clean_text);
+		w.writeView(it->url);
+		w.writeView(it->title);
+		w.write(uint32_t(it->attributes.size()));
+		for (auto &attr : it->attributes) {
+			w.writeView(attr.first);
+			w.writeView(attr.second);
+		}
+	}
+
+	w.write(uint32_t(meta.size()));
+	for (auto &it : meta) {
+		w.write(StringView(it.first));
+		w.write(StringView(it.second));
+	}
+}
+
+bool Content::readCache(CacheReader &r) {
+	reset();
+
+	uint32_t flags = 0, count = 0;
+	if (!r.read(flags)) {
+		return false;
+	}
+	extensions.flags = Extensions::Value(flags);
+
+	token *t = nullptr;
+	for (auto vec : { &headers, &definitions, &tables }) {
+		if (!r.read(count)) {
+			return false;
+		}
+		vec->reserve(count);
+		for (uint32_t i = 0; i < count; ++ i) {
+			if (!r.readToken(t)) {
+				return false;
+			}
+			vec->emplace_back(t);
+		}
+	}
+
+	for (auto vec : { &abbreviation, &citation, &glossary, &footnotes }) {
+		if (!r.read(count)) {
+			return false;
+		}
+		vec->reserve(count);
+		for (uint32_t i = 0; i < count; ++ i) {
+			auto f = new Footnote();
+			uint8_t fl = 0;
+			if (!r.readToken(t)) { return false; }
+			f->label = Token(t);
+			if (!r.readToken(t)) { return false; }
+			f->content = Token(t);
+			if (!r.readView(f->label_text) || !r.readView(f->clean_text) || !r.read(fl)) {
+				return false;
+			}
+			f->free_para = (fl & 1) != 0;
+			f->reference = (fl & 2) != 0;
+			vec->emplace_back(f);
+		}
+	}
+
+	if (!r.read(count)) {
+		return false;
+	}
+	links.reserve(count);
+	for (uint32_t i = 0; i < count; ++ i) {
+		auto l = new Link();
+		uint8_t origin = 0;
+		uint32_t attrs = 0;
+		if (!r.read(origin) || !r.readToken(t)) {
+			return false;
+		}
+		l->origin = Link::Origin(origin);
+		l->label = Token(t);
+		if (!r.readView(l->label_text) || !r.readView(l->clean_text) || !r.readView(l->url) || !r.readView(l->title) || !r.read(attrs)) {
+			return false;
+		}
+		l->attributes.reserve(attrs);
+		for (uint32_t j = 0; j < attrs; ++ j) {
+			StringView key, value;
+			if (!r.readView(key) || !r.readView(value)) {
+				return false;
+			}
+			l->attributes.emplace_back(key, value);
+		}
+		links.emplace_back(l);
+	}
+
+	if (!r.read(count)) {
+		return false;
+	}
+	for (uint32_t i = 0; i < count; ++ i) {
+		String key, value;
+		if (!r.read(key) || !r.read(value)) {
+			return false;
+		}
+		meta.emplace(move(key), move(value));
+	}
+
+	processViews();
+	return r.good();
+}
+
 void Content::emplaceMeta(String && key, String && value) {
 	string::trim(key);
 	string::trim(value);
@@ -709,7 +1442,7 @@ void Content::emplaceMeta(String && key, String && value) {
 }
 
 void Content::emplaceHtmlId(Token && token, const StringView &v) {
-	Link * l = new Link(v, move(token));
+	Link * l = new Link(v, move(token), &strings);
 	links.emplace_back(l);
 }
 
@@ -737,7 +1470,7 @@ void Content::processDefinition(const StringView &str, const Token &t) {
 		case BLOCK_DEF_GLOSSARY:
 			switch (block->type) {
 				case BLOCK_DEF_ABBREVIATION:
-					f = new Footnote(str, label, block->child, false, Footnote::Abbreviation);
+					f = new Footnote(str, label, block->child, false, Footnote::Abbreviation, &strings);
 
 					// Adjust the properties
 					f->label_text = f->clean_text;
@@ -745,28 +1478,28 @@ void Content::processDefinition(const StringView &str, const Token &t) {
 					if (f->content.getToken()->child &&
 					        f->content.getToken()->child->next &&
 					        f->content.getToken()->child->next->next) {
-						f->clean_text = clean_string_from_range(str, f->content.getToken()->child->next->next->start,
-								block->start + block->len - f->content.getToken()->child->next->next->start, false);
+						auto start = f->content.getToken()->child->next->next->start;
+						f->clean_text = cleanView(StringView(&str[start], block->start + block->len - start), false, &strings);
 					} else {
-						f->clean_text.clear();
+						f->clean_text = StringView();
 					}
 
 					abbreviation.push_back(f);
 					break;
 
 				case BLOCK_DEF_CITATION:
-					f = new Footnote(str, label, block->child, true, Footnote::Citation);
+					f = new Footnote(str, label, block->child, true, Footnote::Citation, &strings);
 					citation.push_back(f);
 					break;
 
 				case BLOCK_DEF_FOOTNOTE:
-					f = new Footnote(str, label, block->child, true, Footnote::Note);
+					f = new Footnote(str, label, block->child, true, Footnote::Note, &strings);
 					footnotes.push_back(f);
 					break;
 
 				case BLOCK_DEF_GLOSSARY:
 					// Strip leading '?' from term
-					f = new Footnote(str, label, block->child, false, Footnote::Glossary);
+					f = new Footnote(str, label, block->child, false, Footnote::Glossary, &strings);
 					glossary.push_back(f);
 					break;
 			}
@@ -795,7 +1528,7 @@ bool Content::extractDefinition(const StringView &str, token ** remainder) {
 	const char * source = str.data();
 	token * label = nullptr;
 	token * title = nullptr;
-	String url_char;
+	StringView url_char;
 	StringView title_char;
 	StringView attr_char;
 	token * temp = NULL;
@@ -827,17 +1560,17 @@ bool Content::extractDefinition(const StringView &str, token ** remainder) {
 				// Store for later use
 				switch (label->type) {
 					case PAIR_BRACKET_CITATION:
-						f = new Footnote(str, label, title, true, Footnote::Note);
+						f = new Footnote(str, label, title, true, Footnote::Note, &strings);
 						citation.push_back(f);
 						break;
 
 					case PAIR_BRACKET_FOOTNOTE:
-						f = new Footnote(str, label, title, true, Footnote::Note);
+						f = new Footnote(str, label, title, true, Footnote::Note, &strings);
 						footnotes.push_back(f);
 						break;
 
 					case PAIR_BRACKET_GLOSSARY:
-						f = new Footnote(str, label, title, false, Footnote::Note);
+						f = new Footnote(str, label, title, false, Footnote::Note, &strings);
 						glossary.push_back(f);
 						break;
 				}
@@ -893,12 +1626,12 @@ bool Content::extractDefinition(const StringView &str, token ** remainder) {
 						}
 					}
 
-					l = new Link(str, label, move(url_char), title_char, attr_char, false);
+					l = new Link(str, label, url_char, title_char, attr_char, false, &strings);
 				} else {
 					// Not valid match
 				}
 			} else {
-				l = new Link(str, label, move(url_char), title_char, attr_char, false);
+				l = new Link(str, label, url_char, title_char, attr_char, false, &strings);
 			}
 
 			// Store link for later use
@@ -953,7 +1686,8 @@ void Content::processHeader(const StringView &str, const Token &t) {
 		url.append(label_from_token(str, h));
 	}
 
-	Link * l = new Link(str, h, move(url), StringView(), StringView(), true);
+	Link * l = new Link(str, h, strings.intern(url), StringView(), StringView(), false, &strings);
+	l->origin = Link::Header;
 	links.emplace_back(l);
 }
 
@@ -977,7 +1711,8 @@ void Content::processTable(const StringView &str, const Token &tok) {
 		String url("#");
 		url.append(label_from_token(str, temp_token));
 
-		Link * l = new Link(str, temp_token, move(url), StringView(), StringView(), true);
+		Link * l = new Link(str, temp_token, strings.intern(url), StringView(), StringView(), false, &strings);
+		l->origin = Link::Table;
 		links.emplace_back(l);
 	}
 }
@@ -990,4 +1725,21 @@ void sp_mmd_stack_push( _sp_mmd_stack * s,	void * element ) {
 	((stappler::mmd::Content::Vector<stappler::mmd::Token> *)s)->emplace_back(stappler::mmd::Token((stappler::mmd::token *)element));
 }
 
+size_t sp_mmd_stack_size( _sp_mmd_stack * s ) {
+	return s ? ((stappler::mmd::Content::Vector<stappler::mmd::Token> *)s)->size() : 0;
+}
+
+void sp_mmd_stack_sort( _sp_mmd_stack * s, size_t from ) {
+	if (!s) {
+		return;
+	}
+
+	auto vec = (stappler::mmd::Content::Vector<stappler::mmd::Token> *)s;
+	if (vec->size() > from + 1) {
+		std::stable_sort(vec->begin() + from, vec->end(), [] (const stappler::mmd::Token &l, const stappler::mmd::Token &r) {
+			return l.getToken()->start < r.getToken()->start;
+		});
+	}
+}
+
 }
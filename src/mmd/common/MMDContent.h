@@ -43,6 +43,7 @@
 #define MMD_COMMON_MMDCONTENT_H_
 
 #include "MMDToken.h"
+#include "MMDCache.h"
 
 NS_MMD_BEGIN
 
@@ -60,21 +61,98 @@ public:
 	template <typename V>
 	using Dict =  DictionaryType<V>;
 
+	// Normalized lookup key, hash is calculated once on construction
+	struct Key {
+		StringView str;
+		uint32_t hash = 0;
+
+		Key() { }
+		Key(const StringView &s) : str(s), hash(hash::hash32(s.data(), uint32_t(s.size()))) { }
+
+		bool operator==(const Key &other) const { return hash == other.hash && str == other.str; }
+	};
+
+	// Open addressing hash table over normalized keys, stored keys are views (into source or string table)
 	template <typename V>
-	using DictView = memory::dict<StringView, V>;
+	class DictView {
+	public:
+		V get(const Key &) const;
+		bool try_emplace(const Key &, const V &);
+		void assign(const Key &, const V &); // insert or replace value and stored key
+
+		// remove slots with values, that matches predicate, returns number of removed slots
+		template <typename Callback>
+		size_t erase_if(const Callback &);
+
+		// update stored key views in place, when referenced string was moved
+		template <typename Callback>
+		void rebase(const Callback &);
+
+		// update only stored key of slot with value, key should be built from moved string
+		template <typename Callback>
+		void rebase(const Key &, const V &, const Callback &);
+
+		void reserve(size_t);
+		void clear();
+
+		template <typename Callback>
+		void foreach(const Callback &) const;
+
+		size_t size() const { return count; }
+
+	protected:
+		struct Slot {
+			Key key;
+			V value = V();
+			bool used = false;
+		};
+
+		void rehash(size_t);
+
+		Vector<Slot> slots;
+		size_t count = 0;
+	};
+
+	// Storage for normalized strings, that can not be represented as source views;
+	// every distinct string is allocated once from the current pool
+	class StringTable {
+	public:
+		StringView intern(const StringView &);
+		void merge(StringTable &&);
+		void clear();
+
+		size_t size() const { return strings.size(); }
+
+	protected:
+		DictView<StringView> strings;
+	};
 
 	struct Link : AllocPool {
 		using AttrVec = Vector<Pair<StringView, StringView>>;
 
+		// order of links in content storage, links with the same label resolved by first origin
+		enum Origin : uint8_t {
+			HtmlId,
+			Definition,
+			Header,
+			Table,
+			Inline,
+		};
+
+		Origin origin = Definition;
 		Token label;
-		String label_text;
-		String clean_text;
-		String url;
-		String title;
+		StringView label_text;
+		StringView clean_text;
+		StringView url;
+		StringView title;
 		AttrVec attributes;
 
-		Link(const StringView &source, Token && label, String && url, const StringView & title, const StringView & attributes, bool clearUrl);
-		Link(const StringView &source, Token && label);
+		// Strings are source views, when no normalization required, normalized copies are
+		// interned in table (or allocated from current pool, if there is no table)
+		Link(const StringView &source, Token && label, const StringView & url, const StringView & title, const StringView & attributes,
+				bool clearUrl, StringTable * = nullptr);
+		Link(const StringView &source, Token && label, StringTable * = nullptr);
+		Link() { } // for cache loading
 
 		static void parseAttributes(AttrVec &, const StringView &);
 	};
@@ -89,18 +167,24 @@ public:
 
 		Token label;
 		Token content;
-		String label_text;
-		String clean_text;
+		StringView label_text;
+		StringView clean_text;
 		size_t count = maxOf<size_t>();
 		bool free_para = false;
 		bool reference = true;
+		StringView source; // source of label and content, if it's not document's (shared search targets)
 
-		Footnote(const StringView &source, Token && label, Token && content, bool lowercase, Type);
+		Footnote(const StringView &source, Token && label, Token && content, bool lowercase, Type, StringTable * = nullptr);
+		Footnote() { } // for cache loading
 	};
 
 	static String labelFromString(const StringView &);
 	static String cleanString(const StringView &, bool lowercase);
 
+	// Same normalization, but source view is returned as is, if it's already normalized
+	static StringView labelView(const StringView &, StringTable * = nullptr);
+	static StringView cleanView(const StringView &, bool lowercase, StringTable * = nullptr);
+
 	static Link *explicitLink(const StringView &, const Extensions &, token * bracket, token * paren);
 
 	void reset();
@@ -115,6 +199,43 @@ public:
 
 	void process(const StringView &);
 
+	// reset footnotes numeration, created by previous processing
+	void resetUsage();
+
+	// Shared abbreviations and glossary, used when there is no local definition
+	// Local copies of shared definitions are created on lookup and dropped with `resetUsage`
+	void setSearchTargets(const SearchTargets *);
+	const SearchTargets *getSearchTargets() const;
+
+	// add local abbreviations and glossary into automaton, returns false if there is none
+	bool addSearchTargets(Trie &) const;
+
+	// Incremental update: remove items, defined in source range [start, end), shift positions of items
+	// after the range by diff, then merge items of re-parsed range from fragment. Lookup views are updated
+	// in place: keys of erased items are resolved again on merge, keys of merged items are replaced
+	// only when new item precedes current one.
+	bool hasSearchTargets(uint32_t start, uint32_t end) const;
+	void erase(uint32_t start, uint32_t end);
+	void shift(uint32_t pos, int64_t diff, const StringView &prev, const char *next);
+	void merge(Content &&);
+
+	// Positions of tokens, referenced by items, at or after pos, sorted. Blocks with such tokens are
+	// always shifted on update, since item positions are compared on every update.
+	void getPositions(uint32_t pos, Vector<uint32_t> &) const;
+
+	// Deferred shifts: after update, positions in subtree of top-level block are shifted on first access,
+	// only top-level block itself is shifted immediately. Call resolveShift for top-level block before
+	// reading positions in it, or resolveShifts for the whole tree.
+	void deferShift(token *block, int64_t diff);
+	void dropShift(token *block); // block was removed from tree
+	bool resolveShift(token *block) const; // true if block was shifted
+	void resolveShifts() const;
+	bool hasDeferredShifts() const { return !deferredShifts.empty(); }
+
+	// Binary cache for processed content, token links are stored as indexes in cache token table
+	void writeCache(CacheWriter &) const;
+	bool readCache(CacheReader &);
+
 	void emplaceMeta(String &&, String &&);
 	void emplaceHtmlId(Token &&, const StringView &);
 
@@ -148,6 +269,11 @@ protected:
 	void processTables(const StringView &);
 	void processTable(const StringView &, const Token &);
 
+	void processViews();
+	void resolveViews();
+
+	Footnote *getShared(DictView<Footnote *> &, const Footnote *) const;
+
 	Extensions extensions = Extensions::None;
 	QuotesLanguage quotes = QuotesLanguage::English;
 
@@ -163,15 +289,172 @@ protected:
 
 	Dict<String> meta;
 
+	StringTable strings;
+
 	DictView<Content::Link *> linksView;
 	DictView<Content::Footnote *> citationView;
 	DictView<Content::Footnote *> footnotesView;
 	DictView<Content::Footnote *> abbreviationView;
 	DictView<Content::Footnote *> glossaryView;
+	bool viewsErased = false; // some keys was removed with erased items, see resolveViews
+
+	const SearchTargets *searchTargets = nullptr;
+	mutable Map<token *, int64_t> deferredShifts;
+	mutable DictView<Content::Footnote *> sharedAbbreviationView;
+	mutable DictView<Content::Footnote *> sharedGlossaryView;
 };
 
+template <typename V>
+auto Content::DictView<V>::get(const Key &key) const -> V {
+	if (count == 0) {
+		return V();
+	}
+
+	const size_t mask = slots.size() - 1;
+	size_t idx = key.hash & mask;
+	while (slots[idx].used) {
+		if (slots[idx].key == key) {
+			return slots[idx].value;
+		}
+		idx = (idx + 1) & mask;
+	}
+	return V();
+}
+
+template <typename V>
+bool Content::DictView<V>::try_emplace(const Key &key, const V &value) {
+	if ((count + 1) * 4 > slots.size() * 3) {
+		rehash(std::max(size_t(16), slots.size() * 2));
+	}
+
+	const size_t mask = slots.size() - 1;
+	size_t idx = key.hash & mask;
+	while (slots[idx].used) {
+		if (slots[idx].key == key) {
+			return false;
+		}
+		idx = (idx + 1) & mask;
+	}
+
+	slots[idx].key = key;
+	slots[idx].value = value;
+	slots[idx].used = true;
+	++ count;
+	return true;
+}
+
+template <typename V>
+void Content::DictView<V>::assign(const Key &key, const V &value) {
+	if (try_emplace(key, value)) {
+		return;
+	}
+
+	const size_t mask = slots.size() - 1;
+	size_t idx = key.hash & mask;
+	while (!(slots[idx].key == key)) {
+		idx = (idx + 1) & mask;
+	}
+
+	// stored key should be valid as long as value is
+	slots[idx].key = key;
+	slots[idx].value = value;
+}
+
+template <typename V>
+template <typename Callback>
+size_t Content::DictView<V>::erase_if(const Callback &cb) {
+	size_t erased = 0;
+	for (auto &it : slots) {
+		if (it.used && cb(it.value)) {
+			it.used = false;
+			++ erased;
+		}
+	}
+
+	if (erased) {
+		// probe sequences are rebuilt for remaining slots, stored hashes are used, keys are not read
+		count -= erased;
+		rehash(slots.size());
+	}
+	return erased;
+}
+
+template <typename V>
+template <typename Callback>
+void Content::DictView<V>::rebase(const Callback &cb) {
+	for (auto &it : slots) {
+		if (it.used) {
+			cb(it.key.str);
+		}
+	}
+}
+
+template <typename V>
+template <typename Callback>
+void Content::DictView<V>::rebase(const Key &key, const V &value, const Callback &cb) {
+	if (count == 0) {
+		return;
+	}
+
+	// stored keys are not compared, they refer to moved string
+	const size_t mask = slots.size() - 1;
+	size_t idx = key.hash & mask;
+	while (slots[idx].used) {
+		if (slots[idx].key.hash == key.hash && slots[idx].key.str.size() == key.str.size() && slots[idx].value == value) {
+			cb(slots[idx].key.str);
+			return;
+		}
+		idx = (idx + 1) & mask;
+	}
+}
+
+template <typename V>
+void Content::DictView<V>::reserve(size_t size) {
+	size_t target = 16;
+	while (target * 3 < size * 4) {
+		target *= 2;
+	}
+	if (target > slots.size()) {
+		rehash(target);
+	}
+}
+
+template <typename V>
+void Content::DictView<V>::clear() {
+	slots.clear();
+	count = 0;
+}
+
+template <typename V>
+template <typename Callback>
+void Content::DictView<V>::foreach(const Callback &cb) const {
+	for (auto &it : slots) {
+		if (it.used) {
+			cb(it.key, it.value);
+		}
+	}
+}
+
+template <typename V>
+void Content::DictView<V>::rehash(size_t size) {
+	Vector<Slot> tmp; tmp.resize(size);
+	slots.swap(tmp);
+
+	const size_t mask = slots.size() - 1;
+	for (auto &it : tmp) {
+		if (it.used) {
+			size_t idx = it.key.hash & mask;
+			while (slots[idx].used) {
+				idx = (idx + 1) & mask;
+			}
+			slots[idx] = it;
+		}
+	}
+}
+
 StringView text_inside_pair(const StringView & s, token * pair);
 auto url_accept(const char * source, size_t start, size_t max_len, size_t * end_pos, bool validate) -> Content::String;
+auto url_accept_view(const char * source, size_t start, size_t max_len, size_t * end_pos) -> StringView;
 auto label_from_token(const StringView & s, token * t) -> Content::String;
 auto clean_string_from_range(const StringView & s, size_t start, size_t len, bool lowercase) -> Content::String;
 token * manual_label_from_header(token * h, const char * source);
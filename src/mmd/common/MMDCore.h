@@ -104,12 +104,18 @@ typedef void _sp_mmd_stack;
 /// Add a new pointer to the stack
 void sp_mmd_stack_push( _sp_mmd_stack * s, void * element );
 
+size_t sp_mmd_stack_size( _sp_mmd_stack * s );
+
+/// Restore document order for tokens, pushed after position `from`
+void sp_mmd_stack_sort( _sp_mmd_stack * s, size_t from );
+
 
 typedef struct {
 	const char *str;
 	uint32_t len;
 	uint32_t extensions;
-	uint16_t recurse_depth;
+	uint32_t recurse_depth; // nesting depth of the chain being parsed
+	uint32_t max_recurse_depth;
 	bool allow_meta;
 
 	_sp_mmd_token * root;
@@ -126,6 +132,7 @@ typedef struct {
 	_sp_mmd_stack * table_stack;
 
 	void * content;
+	void * parse_state; // reusable block parser, created on first parse
 } _sp_mmd_engine;
 
 void sp_mmd_recursive_parse_indent(_sp_mmd_engine * e, _sp_mmd_token * block);
@@ -133,7 +140,7 @@ void sp_mmd_recursive_parse_list_item(_sp_mmd_engine * e, _sp_mmd_token * block)
 void sp_mmd_recursive_parse_blockquote(_sp_mmd_engine * e, _sp_mmd_token * block);
 void sp_mmd_strip_line_tokens_from_block(_sp_mmd_engine * e, _sp_mmd_token * block);
 void sp_mmd_is_para_html(_sp_mmd_engine * e, _sp_mmd_token * block);
-void sp_mmd_is_list_loose(_sp_mmd_token * list);
+void sp_mmd_is_list_loose(_sp_mmd_engine * e, _sp_mmd_token * list);
 
 void sp_mmd_parse_token_chain(_sp_mmd_engine * e, _sp_mmd_token * chain);
 void sp_mmd_assign_ambidextrous_tokens_in_block(_sp_mmd_engine * e, _sp_mmd_token * block, size_t start_offset);
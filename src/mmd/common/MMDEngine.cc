@@ -42,11 +42,30 @@
 #include "SPCommon.h"
 #include "MMDEngine.h"
 #include "MMDCore.h"
+#include "MMDToken.h"
+#include "MMDChars.h"
 #include "MMDContent.h"
 #include "MMDTokenPair.h"
 #include "MMDAhoCorasick.h"
+#include "MMDCache.h"
+#include "MMDSearchTargets.h"
+#include "MMDTransclusion.h"
 
 #include "SPLog.h"
+#include "SPFilesystem.h"
+
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fstream>
+#include <chrono>
+#include <unordered_map>
 
 NS_MMD_BEGIN
 
@@ -63,12 +82,93 @@ public:
 		return pool;
 	}
 
+	memory::pool_t * createChild() {
+		++ children;
+		return memory::pool::create(getPool());
+	}
+
+	void destroyChild(memory::pool_t *p) {
+		memory::pool::destroy(p);
+		-- children;
+	}
+
+	// release all memory, when there is no child pools in use
+	bool trim() {
+		if (children == 0) {
+			if (pool) {
+				memory::pool::destroy(pool);
+				pool = nullptr;
+			}
+			return true;
+		}
+		return false;
+	}
+
 private:
 	memory::pool_t *pool = nullptr;
+	size_t children = 0;
 };
 
 thread_local MemPoolHolder tl_pool;
 
+static memory::pool_t * engine_pool_create(memory::pool_t *parent, bool threadLocal) {
+	return threadLocal ? tl_pool.createChild() : memory::pool::create(parent);
+}
+
+static void engine_pool_destroy(memory::pool_t *pool, bool threadLocal) {
+	if (threadLocal) {
+		tl_pool.destroyChild(pool);
+	} else {
+		memory::pool::destroy(pool);
+	}
+}
+
+/// Phase timer for engine stats, does nothing when stats are disabled
+struct StatsTimer {
+	using Clock = std::chrono::steady_clock;
+
+	StatsTimer(Engine::Stats *s) : stats(s) {
+		if (stats) {
+			time = Clock::now();
+		}
+	}
+
+	// add time since previous lap to stats field
+	void lap(uint64_t Engine::Stats::* field) {
+		if (stats) {
+			auto now = Clock::now();
+			stats->*field += uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(now - time).count());
+			time = now;
+		}
+	}
+
+	Engine::Stats *stats;
+	Clock::time_point time;
+};
+
+struct BlockBoundary {
+	BlockBoundary() { }
+	BlockBoundary(const StringView &str, size_t pos) : source(str), line(pos) { }
+
+	// advance to next line, returns false at the end of source
+	bool next();
+
+	// current line can be used as a parsing start point
+	bool isSafe() const {
+		return empty && !fence && !comment && !html && !table && isSafeLine(source, line);
+	}
+
+	static bool isSafeLine(const StringView &, size_t pos);
+
+	StringView source;
+	size_t line = 0;
+	bool empty = true; // previous line was empty
+	uint8_t fence = 0; // length class of opened code fence
+	bool comment = false;
+	bool html = false; // html block was opened and not closed yet
+	bool table = false; // last non-empty line can be a table row, that takes caption from the next block
+};
+
 struct Engine::Internal : memory::PoolInterface {
 	using mmd_engine = _sp_mmd_engine;
 	using token = _sp_mmd_token;
@@ -76,25 +176,153 @@ struct Engine::Internal : memory::PoolInterface {
 	Internal(memory::pool_t *p, const StringView &v, const Extensions &ext);
 	~Internal();
 
+	// minimal chunk size for parallel parsing
+	static constexpr size_t ParallelChunkSize = 32_KiB;
+
+	// initial buffer size and read block size for streaming input
+	static constexpr size_t StreamBufferSize = 64_KiB;
+	static constexpr size_t StreamReadSize = 16_KiB;
+
+	// minimal gap in own copy of edited source
+	static constexpr size_t EditGapSize = 4_KiB;
+
 	token * parse(const StringView &);
+	token * parseChain(size_t start, size_t len);
+	token * parseParallel(const StringView &);
+	token * parseScan(const StringView &);
+	token * parseTranscluded(const StringView &);
 	bool prepare();
+	bool prepareFragment();
 	void reset();
 
-	void process(const ProcessCallback &);
+	bool update(size_t offset, size_t removed, const StringView &);
+	bool updateBlocks(size_t offset, size_t removed, size_t inserted, const StringView &);
+	void shiftBlocks(token *, int64_t diff);
+	void moveGap(size_t);
+	void growBuffer(size_t);
+	void flushEdits();
+	void freeBuffer(char *, size_t capacity);
+	void setContent(Content *);
+
+	bool initFile(const StringView &);
+	void setSource(const StringView &);
+	void transclude();
+
+	bool writeCache(std::ostream &);
+	bool loadCache(const uint8_t *, size_t);
+
+	// parsed tree contains matches of shared search targets, so cache is valid only for the same targets
+	uint64_t getTargetsDigest() const { return searchTargets ? searchTargets->getDigest() : 0; }
+
+	bool write(const StringView &);
+	void parseStream(size_t end);
+	bool finalize();
+
+	void process(const ProcessCallback &, memory::pool_t *renderPool = nullptr);
+
+	Stats *statsTarget() { return statsEnabled ? &stats : nullptr; }
+	void updateStats();
 
 	StringView source;
+	char *buffer = nullptr; // own copy of source, created on first update or for streaming input
+	size_t bufferSize = 0;
+	size_t bufferCapacity = 0;
+
+	// Pending edits: text in buffer has a gap at gapStart (of bufferCapacity - bufferSize bytes), parsed
+	// tree and source are still for the text before edits; edits are combined into single replaced range
+	struct Edit {
+		size_t offset = 0;
+		size_t removed = 0; // length of replaced range in parsed source
+		size_t inserted = 0; // length of replaced range in edited text
+	};
+
+	bool edited = false;
+	Edit edit;
+	size_t gapStart = 0;
+	char *retired = nullptr; // buffer with parsed source, replaced by larger one on editing
+	size_t retiredCapacity = 0;
+	void *mapping = nullptr; // read-only file mapping, used as source by initFromFile
+	size_t mappingSize = 0;
 	Content content;
 	mmd_engine engine;
 	memory::pool_t *pool = nullptr;
-
-	TokenPairEngine * pairs = nullptr;
+	TokenArena arena;
+
+	const TokenPairEngine * pairs = nullptr;
+
+	uint32_t threads = 1;
+	ScanMode scanMode = ScanMode::Full;
+	Rc<SearchTargets> searchTargets;
+	bool lazyBlocks = false;
+
+	bool statsEnabled = false;
+	Stats stats;
+
+	// Parsed blocks of transclusion fragment in preorder, copied into including documents
+	struct FragmentBlocks {
+		struct Node {
+			token * tok;
+			int32_t next;
+			int32_t prev;
+			int32_t child;
+			int32_t tail;
+			int32_t mate;
+		};
+
+		struct HtmlId {
+			int32_t node; // -1, if label token is not in tree
+			uint16_t type;
+			uint32_t start;
+			uint32_t len;
+			uint32_t text; // offset of id value in source
+			uint32_t textLen;
+		};
+
+		using Index = std::unordered_map<const token *, int32_t>;
+
+		void flatten(token * root, const Content &, const StringView &source);
+		void add(token *, Index &);
+
+		// copy blocks with offsets, shifted on diff, stacks and html ids are added to engine's content
+		token * copy(int64_t diff, Internal &) const;
+
+		size_t start = 0; // first and last safe boundaries of fragment, only blocks between them are parsed
+		size_t end = 0;
+		VectorType<Node> nodes;
+		VectorType<int32_t> definitions;
+		VectorType<int32_t> headers;
+		VectorType<int32_t> tables;
+		VectorType<HtmlId> ids;
+	};
+
+	struct Transcluded {
+		uint32_t start; // position of fragment text in source
+		Rc<Transclusion::Fragment> fragment;
+	};
+
+	// transclusion state
+	Rc<Transclusion> transclusion;
+	Transclusion::Fragment *fragment = nullptr; // fragment, that is built by this engine
+	StringType sourceDir; // base for relative paths
+	VectorType<Transcluded> transcluded;
+	bool transcludeDone = false;
+	FragmentBlocks blocks;
+
+	VectorType<memory::pool_t *> workerPools; // pools for trees, parsed on worker threads, kept for next parse
+	bool parallelParsed = false; // current tree and content were parsed with workers
+
+	// streaming input state
+	bool streaming = false;
+	size_t streamParsed = 0; // end of source part, that was already parsed into blocks
+	BlockBoundary streamBoundary;
+	BlockCallback streamCallback;
 
 	bool isDebug = false;
 	StringStreamType debug;
 };
 
 Engine::Internal::Internal(memory::pool_t *p, const StringView &v, const Extensions & ext)
-: content(ext) {
+: content(ext), arena(p) {
 
 #ifdef DEBUG
 	//isDebug = true;
@@ -105,21 +333,27 @@ Engine::Internal::Internal(memory::pool_t *p, const StringView &v, const Extensi
 	engine.len = v.size();
 	engine.extensions = toInt(ext.flags);
 	engine.recurse_depth = 0;
+	engine.max_recurse_depth = 0;
 	engine.allow_meta = false;
+	engine.parse_state = nullptr;
 
 	engine.root = nullptr;
 
-	engine.definition_stack = (void *)&content.getDefinitions();
-	engine.header_stack = (void *)&content.getHeaders();
-	engine.table_stack = (void *)&content.getTables();
-
 	pool = p;
-	engine.content = &content;
+	setContent(&content);
 
 	pairs = TokenPairEngine::engineForExtensions(ext.flags);
 }
 
 Engine::Internal::~Internal() {
+	if (mapping) {
+		munmap(mapping, mappingSize);
+	}
+
+	for (auto &it : workerPools) {
+		memory::pool::destroy(it);
+	}
+
 	if (!debug.empty()) {
 		memory::pool::push(pool);
 		std::cout << StringView(debug.weak());
@@ -198,11 +432,9 @@ static void mmd_pair_tokens_in_block(token * block, const TokenPair & e, TokenVe
 }
 
 /// Strong/emph parsing is done using single `*` and `_` characters, which are
-/// then combined in a separate routine here to determine when
-/// consecutive characters should be interpreted as STRONG instead of EMPH
-/// \todo: Perhaps combining this with the routine when they are paired
-/// would improve performance?
-static void pair_emphasis_tokens(const StringView &source, token * t) {
+/// then combined here to determine when consecutive characters should be
+/// interpreted as STRONG instead of EMPH
+static void pair_emphasis_tokens(token * t) {
 	token * closer;
 
 	while (t != NULL) {
@@ -249,7 +481,7 @@ static void pair_emphasis_tokens(const StringView &source, token * t) {
 					break;
 
 				default:
-					pair_emphasis_tokens(source, t->child);
+					pair_emphasis_tokens(t->child);
 					break;
 			}
 		}
@@ -258,9 +490,78 @@ static void pair_emphasis_tokens(const StringView &source, token * t) {
 	}
 }
 
-static void automatic_search_text(const StringView &str, token * t, const Trie & ac) {
-	Trie::Result res = ac.searchLeftmostLongest(str.data(), t->start, t->len);
-	Trie::Result::iterator walker;
+/// Pair tokens in top-level blocks of document
+///
+/// Pair tables and strong/emph resolution are applied in pass order to one top-level
+/// block before moving to the next one. Pairing never crosses top-level block boundaries,
+/// so result is the same as with separate document-wide passes.
+///
+/// Every pass is still a separate walk of the block: later passes should see pairs, pruned
+/// by earlier ones (e.g. code spans before quotes and emphasis), and strong/emph resolution
+/// needs all STAR/UL pairs of the chain, so passes can not be merged into one walk without
+/// changing output. Only empty pair tables are skipped.
+static void mmd_pair_tokens_in_document(token * doc, const TokenPairEngine * pairs, TokenVec & s) {
+	const TokenPair * tables[] = { &pairs->pairings1, &pairs->pairings2, &pairs->pairings3, &pairs->pairings4 };
+
+	for (token * block = doc->child; block != nullptr; block = block->next) {
+		for (auto &it : tables) {
+			if (!it->empty()) {
+				mmd_pair_tokens_in_block(block, *it, s);
+			}
+		}
+
+		if (block->child) {
+			pair_emphasis_tokens(block->child);
+		}
+	}
+}
+
+/// Merge raw results of local and shared automata in the order of single automaton for both dictionaries:
+/// by match end, longer matches first. Local definitions override shared ones for the same text.
+static Trie::Result automatic_search_merge(Trie::Result && local, Trie::Result && shared) {
+	if (local.empty()) {
+		return move(shared);
+	} else if (shared.empty()) {
+		return move(local);
+	}
+
+	Trie::Result res; res.reserve(local.size() + shared.size());
+
+	auto l = local.begin();
+	auto s = shared.begin();
+	while (l != local.end() || s != shared.end()) {
+		if (s == shared.end()) {
+			res.emplace_back(*l ++);
+		} else if (l == local.end()) {
+			res.emplace_back(*s ++);
+		} else {
+			auto lEnd = l->start + l->len;
+			auto sEnd = s->start + s->len;
+			if (lEnd < sEnd || (lEnd == sEnd && l->len > s->len)) {
+				res.emplace_back(*l ++);
+			} else if (lEnd == sEnd && l->len == s->len) {
+				res.emplace_back(*l ++);
+				++ s;
+			} else {
+				res.emplace_back(*s ++);
+			}
+		}
+	}
+
+	return res;
+}
+
+static void automatic_search_text(const StringView &str, token * t, const Trie * ac, const Trie * shared) {
+	Trie::Result res;
+	if (ac && shared) {
+		res = automatic_search_merge(ac->search(str.data(), t->start, t->len), shared->search(str.data(), t->start, t->len));
+		if (!res.empty()) {
+			Trie::filterLeftmostLongest(res);
+		}
+	} else if (ac || shared) {
+		res = (ac ? ac : shared)->searchLeftmostLongest(str.data(), t->start, t->len);
+	}
+
 	token * tok = t;
 
 	for (auto &it : res) {
@@ -274,11 +575,11 @@ static void automatic_search_text(const StringView &str, token * t, const Trie &
 }
 
 /// Determine which nodes to descend into to search for abbreviations
-static void automatic_search(const StringView &str, token * t, const Trie & ac) {
+static void automatic_search(const StringView &str, token * t, const Trie * ac, const Trie * shared) {
 	while (t) {
 		switch (t->type) {
 			case TEXT_PLAIN:
-				automatic_search_text(str, t, ac);
+				automatic_search_text(str, t, ac, shared);
 				break;
 
 			case DOC_START_TOKEN:
@@ -308,7 +609,7 @@ static void automatic_search(const StringView &str, token * t, const Trie & ac)
 			case PAIR_UL:
 			case TABLE_CELL:
 			case TABLE_ROW:
-				automatic_search(str, t->child, ac);
+				automatic_search(str, t->child, ac, shared);
 				break;
 
 //			case PAIR_PAREN:
@@ -320,153 +621,1994 @@ static void automatic_search(const StringView &str, token * t, const Trie & ac)
 	}
 }
 
+/// Top-level block boundary scanner
+///
+/// Boundary is a non-indented line after an empty line, outside of fenced code, html comments and html
+/// blocks, that can not continue any block before it (list items, definitions, table sections, closing
+/// tags). Text after boundary can be parsed independently from text before it. Scanner works on raw text,
+/// without tokenization.
+
+static size_t block_boundary_line_end(const StringView &str, size_t pos) {
+	auto end = (const char *)memchr(str.data() + pos, '\n', str.size() - pos);
+	return end ? end - str.data() : str.size();
+}
+
+static bool block_boundary_is_blank(const char *p, const char *end) {
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) { ++ p; }
+	return p == end;
+}
+
+static const char *block_boundary_skip_indent(const char *p, const char *end) {
+	uint8_t n = 0;
+	while (p < end && *p == ' ' && n < 3) { ++ p; ++ n; }
+	return p;
+}
+
+// Line starts with opening tag of html block element, that is not closed on the same line
+static bool block_boundary_is_html_open(const char *p, const char *end) {
+	static constexpr const char *tags[] = {
+		"address", "article", "aside", "blockquote", "center", "details", "dialog", "div", "dl", "fieldset",
+		"figure", "footer", "form", "header", "iframe", "math", "nav", "noscript", "ol", "pre",
+		"script", "section", "style", "table", "ul", "video"
+	};
+
+	if (end - p < 3 || p[0] != '<' || !chars::isAlpha(p[1])) {
+		return false;
+	}
+
+	auto name = p + 1;
+	auto nameEnd = name;
+	while (nameEnd < end && chars::isAlphanumeric(*nameEnd)) { ++ nameEnd; }
+	if (nameEnd < end && *nameEnd != '>' && *nameEnd != ' ' && *nameEnd != '\t' && *nameEnd != '\r') {
+		return false;
+	}
+
+	for (auto &it : tags) {
+		auto len = strlen(it);
+		if (len == size_t(nameEnd - name) && strncasecmp(name, it, len) == 0) {
+			return memmem(nameEnd, end - nameEnd, "</", 2) == nullptr;
+		}
+	}
+	return false;
+}
+
+bool BlockBoundary::next() {
+	if (line >= source.size()) {
+		return false;
+	}
+
+	auto lineEnd = block_boundary_line_end(source, line);
+	auto p = block_boundary_skip_indent(source.data() + line, source.data() + lineEnd);
+	auto end = source.data() + lineEnd;
+
+	if (!comment && end - p >= 3 && memcmp(p, "```", 3) == 0) {
+		auto f = p;
+		while (f < end && *f == '`') { ++ f; }
+		uint8_t cl = uint8_t(std::min(f - p, ptrdiff_t(5)));
+		if (!fence) {
+			fence = cl;
+		} else if (cl >= fence && block_boundary_is_blank(f, end)) {
+			fence = 0;
+		}
+	} else if (!fence) {
+		if (!comment && end - p >= 4 && memcmp(p, "<!--", 4) == 0 && block_boundary_is_blank(p + 4, end)) {
+			comment = true;
+		} else if (comment && end - p >= 3 && memcmp(p, "-->", 3) == 0 && block_boundary_is_blank(p + 3, end)) {
+			comment = false;
+		} else if (!comment) {
+			// text between tags is kept with its html block, even if it contains empty lines
+			if (html && end - p >= 2 && p[0] == '<' && p[1] == '/') {
+				html = false;
+			} else if (!html && block_boundary_is_html_open(p, end)) {
+				html = true;
+			}
+		}
+	}
+
+	empty = block_boundary_is_blank(source.data() + line, end);
+	if (!empty) {
+		table = memchr(source.data() + line, '|', lineEnd - line) != nullptr;
+	}
+	line = (lineEnd < source.size()) ? lineEnd + 1 : source.size();
+	return line < source.size();
+}
+
+bool BlockBoundary::isSafeLine(const StringView &source, size_t pos) {
+	if (pos >= source.size()) {
+		return false;
+	}
+
+	auto lineEnd = block_boundary_line_end(source, pos);
+	auto p = source.data() + pos;
+	auto end = source.data() + lineEnd;
+
+	switch (*p) {
+	case ' ': case '\t': case '\r': case '\n': // indented or empty lines continues lists and code blocks
+	case ':': // definitions
+		return false;
+	case '<':
+		if (p + 1 < end && p[1] == '/') {
+			return false; // closing tag of html block
+		}
+		break;
+	case '*': case '-': case '+':
+		if (p + 1 < end && (p[1] == ' ' || p[1] == '\t')) {
+			return false; // bullet list item
+		}
+		break;
+	default:
+		if (chars::isDigit(*p)) {
+			auto d = p;
+			while (d < end && chars::isDigit(*d)) { ++ d; }
+			if (d + 1 < end && *d == '.' && (d[1] == ' ' || d[1] == '\t')) {
+				return false; // enumerated list item
+			}
+		}
+		break;
+	}
+
+	// table sections can be separated with empty line
+	return memchr(p, '|', end - p) == nullptr;
+}
+
+static void search_automatic_targets(const Content &content, const StringView &source, token * t) {
+	if (!content.getExtensions().hasFlag(Extensions::Compatibility)) {
+		// Shared targets are already compiled, automaton is only built for local definitions
+		auto shared = content.getSearchTargets() ? content.getSearchTargets()->getTrie() : nullptr;
+
+		// Only search if we have a target
+		auto count = content.getAbbreviations().size() + content.getGlossary().size();
+		if (count > 0) {
+			Trie ac;
+			content.addSearchTargets(ac);
+			ac.prepare();
+			automatic_search(source.data(), t, &ac, shared);
+		} else if (shared) {
+			automatic_search(source.data(), t, nullptr, shared);
+		}
+	}
+}
+
 auto Engine::Internal::parse(const StringView &str) -> token * {
 	reset();
 
+	if (scanMode != ScanMode::Full) {
+		return parseScan(str);
+	}
+
+	if (!transcluded.empty()) {
+		return parseTranscluded(str);
+	}
+
+	if (threads > 1 && str.size() >= ParallelChunkSize * 2) {
+		return parseParallel(str);
+	}
+
+	return parseChain(str.data() - source.data(), str.size());
+}
+
+static token * mmd_parse_chain(_sp_mmd_engine * e, const TokenPairEngine * pairs, size_t start, size_t len,
+		Engine::Stats * stats) {
+	StatsTimer timer(stats);
+	auto arena = stats ? TokenArena::get() : nullptr;
+	auto allocated = arena ? arena->getAllocated() : 0;
+
 	// Tokenize the string
-	token * doc = sp_mmd_mmd_tokenize_string(&engine, str.data() - source.data(), str.size(), false);
+	token * doc = sp_mmd_mmd_tokenize_string(e, start, len, false);
+
+	timer.lap(&Engine::Stats::tokenizeTime);
+	if (arena && arena->getAllocated() > allocated) {
+		stats->lexTokens += arena->getAllocated() - allocated;
+	}
 
 	// Parse tokens into blocks
-	sp_mmd_parse_token_chain(&engine, doc);
+	sp_mmd_parse_token_chain(e, doc);
+
+	timer.lap(&Engine::Stats::parseTime);
 
 	if (doc) {
 		// Parse blocks for pairs
-		sp_mmd_assign_ambidextrous_tokens_in_block(&engine, doc, 0);
+		sp_mmd_assign_ambidextrous_tokens_in_block(e, doc, 0);
 
 		// Prepare stack to be used for token pairing
 		// This avoids allocating/freeing one for each iteration.
 		TokenVec pair_stack; pair_stack.reserve(64);
 
-		mmd_pair_tokens_in_block(doc, pairs->pairings1, pair_stack);
-		mmd_pair_tokens_in_block(doc, pairs->pairings2, pair_stack);
-		mmd_pair_tokens_in_block(doc, pairs->pairings3, pair_stack);
-		mmd_pair_tokens_in_block(doc, pairs->pairings4, pair_stack);
+		mmd_pair_tokens_in_document(doc, pairs, pair_stack);
+	}
 
-		pair_emphasis_tokens(source, doc);
+	timer.lap(&Engine::Stats::pairTime);
+	if (stats) {
+		stats->recursionDepth = std::max(stats->recursionDepth, e->max_recurse_depth);
+	}
 
-		if (isDebug) {
-			Token(doc).describeTree(debug, source);
+	return doc;
+}
+
+// Append top-level blocks of the next parsed part to the document
+static token * mmd_doc_append(token * doc, token * next) {
+	if (!doc) {
+		return next;
+	}
+
+	if (next && next->child) {
+		if (doc->child) {
+			sp_mmd_token_chain_append(doc->child, next->child);
+		} else {
+			doc->child = next->child;
 		}
 	}
 
 	return doc;
 }
 
-bool Engine::Internal::prepare() {
-	if (!engine.root) {
-		memory::pool::push(pool);
+static void mmd_stats_tree(Engine::Stats &stats, token * t, size_t depth) {
+	while (t) {
+		++ stats.treeTokens;
+		stats.treeDepth = std::max(stats.treeDepth, depth);
+		if (t->child) {
+			mmd_stats_tree(stats, t->child, depth + 1);
+		}
+		t = t->next;
+	}
+}
 
-		engine.root = parse(source);
-		content.process(source);
+auto Engine::Internal::parseChain(size_t start, size_t len) -> token * {
+	token * doc = mmd_parse_chain(&engine, pairs, start, len, statsTarget());
 
-		// Process abbreviations, glossary, etc.
-		if (!content.getExtensions().hasFlag(Extensions::Compatibility)) {
-			// Only search if we have a target
-			auto count = content.getAbbreviations().size() + content.getGlossary().size();
-			if (count > 0) {
-				Trie ac;
-				for (auto &it : content.getAbbreviations()) {
-					ac.insert(it->label_text.data(), PAIR_BRACKET_ABBREVIATION);
-				}
+	if (doc && isDebug) {
+		Token(doc).describeTree(debug, source);
+	}
 
-				for (auto &it : content.getGlossary()) {
-					ac.insert(it->clean_text.data(), PAIR_BRACKET_GLOSSARY);
-				}
+	return doc;
+}
+
+/// Persistent threads for parallel parsing, shared by all engines
+///
+/// Task is split into slots, slot 0 is run on calling thread, other slots are taken by workers.
+/// Calling thread also takes slots, that was not taken by busy workers, so task is never blocked
+/// by other engines. Workers are started on first use and kept until exit.
+class ParseWorkers {
+public:
+	using Callback = Function<void(size_t slot)>;
+
+	static ParseWorkers *getInstance() {
+		static ParseWorkers s_instance;
+		return &s_instance;
+	}
+
+	~ParseWorkers() {
+		do {
+			std::unique_lock<std::mutex> lock(_mutex);
+			_stop = true;
+			_available.notify_all();
+		} while (0);
 
-				ac.prepare();
-				automatic_search(source.data(), engine.root, ac);
+		for (auto &it : _workers) {
+			it.join();
+		}
+	}
+
+	void run(size_t slots, const Callback &cb) {
+		if (slots <= 1) {
+			cb(0);
+			return;
+		}
+
+		Job job{&cb, slots, 1, 0};
+
+		std::unique_lock<std::mutex> lock(_mutex);
+		while (_workers.size() < slots - 1) {
+			_workers.emplace_back(&ParseWorkers::runWorker, this);
+		}
+
+		_jobs.emplace_back(&job);
+		_available.notify_all();
+
+		lock.unlock();
+		cb(0);
+		lock.lock();
+
+		while (runJob(job, lock)) { }
+		_done.wait(lock, [&] { return job.done == slots - 1; });
+	}
+
+protected:
+	struct Job {
+		const Callback *callback;
+		size_t slots;
+		size_t next; // next slot to run
+		size_t done; // finished slots, except slot 0
+	};
+
+	void runWorker() {
+		std::unique_lock<std::mutex> lock(_mutex);
+		while (!_stop) {
+			if (_jobs.empty()) {
+				_available.wait(lock);
+			} else {
+				runJob(*_jobs.front(), lock);
 			}
 		}
+	}
 
-		memory::pool::pop();
+	// run next slot of job, returns false if all slots are taken
+	bool runJob(Job &job, std::unique_lock<std::mutex> &lock) {
+		if (job.next >= job.slots) {
+			return false;
+		}
 
-		if (isDebug) {
-			debug << "Allocated on parsing: " << memory::pool::get_allocated_bytes(pool) << "\n";
+		const size_t slot = job.next ++;
+		if (job.next == job.slots) {
+			_jobs.erase(std::find(_jobs.begin(), _jobs.end(), &job));
 		}
-		return engine.root != nullptr;
+
+		lock.unlock();
+		(*job.callback)(slot);
+		lock.lock();
+
+		if (++ job.done == job.slots - 1) {
+			_done.notify_all();
+		}
+		return true;
 	}
 
-	return true;
-}
+	std::mutex _mutex;
+	std::condition_variable _available;
+	std::condition_variable _done;
+	std::deque<Job *> _jobs;
+	std::vector<std::thread> _workers;
+	bool _stop = false;
+};
 
-void Engine::Internal::reset() {
-	if (engine.root) {
-		engine.root = nullptr;
+auto Engine::Internal::parseParallel(const StringView &str) -> token * {
+	struct Chunk {
+		size_t start;
+		size_t len;
+		token * doc;
+		Content * content;
+		Stats stats;
+	};
+
+	// Split source into chunks on top-level block boundaries, metadata is always in the first one
+	const size_t offset = str.data() - source.data();
+	const size_t chunkSize = std::max(str.size() / (threads * 4), ParallelChunkSize);
+
+	VectorType<Chunk> chunks;
+	BlockBoundary boundary(str, 0);
+	size_t chunkStart = 0;
+	while (boundary.next()) {
+		if (boundary.line - chunkStart >= chunkSize && boundary.isSafe()) {
+			chunks.emplace_back(Chunk{offset + chunkStart, boundary.line - chunkStart, nullptr, nullptr, Stats()});
+			chunkStart = boundary.line;
+		}
 	}
+	chunks.emplace_back(Chunk{offset + chunkStart, str.size() - chunkStart, nullptr, nullptr, Stats()});
 
-	content.reset();
-}
+	if (chunks.size() == 1) {
+		return parseChain(offset, str.size());
+	}
 
-void Engine::Internal::process(const ProcessCallback &cb) {
-	if (!prepare()) {
-		log::text("MMD", "Fail to parse multimarkdown text");
-		return;
+	// Chunks are taken in order by calling thread and shared parse workers,
+	// every thread uses its own document pool and token arena
+	const size_t nworkers = std::min(size_t(threads), chunks.size());
+	while (workerPools.size() < nworkers) {
+		workerPools.emplace_back(memory::pool::create(nullptr));
 	}
+	parallelParsed = true;
+
+	std::atomic<size_t> nextChunk(0);
+	ParseWorkers::getInstance()->run(nworkers, [&] (size_t slot) {
+		auto p = workerPools[slot];
+		memory::pool::push(p);
+
+		TokenArena workerArena(p);
+		workerArena.push();
+
+		_sp_mmd_engine e = engine;
+		size_t idx = 0;
+		while ((idx = nextChunk.fetch_add(1)) < chunks.size()) {
+			auto &chunk = chunks[idx];
+			chunk.content = new (p) Content(content.getExtensions());
+			chunk.content->setQuotesLanguage(content.getQuotesLanguage());
+
+			e.definition_stack = (void *)&chunk.content->getDefinitions();
+			e.header_stack = (void *)&chunk.content->getHeaders();
+			e.table_stack = (void *)&chunk.content->getTables();
+			e.content = chunk.content;
+			e.recurse_depth = 0;
+			e.max_recurse_depth = 0;
+			e.parse_state = nullptr; // worker's own parser, allocated from worker pool
+
+			auto chunkStats = statsEnabled ? &chunk.stats : nullptr;
+			chunk.doc = mmd_parse_chain(&e, pairs, chunk.start, chunk.len, chunkStats);
+
+			StatsTimer timer(chunkStats);
+			chunk.content->process(source);
+			timer.lap(&Stats::contentTime);
+		}
 
-	auto p = memory::pool::create(pool);
-	memory::pool::push(p);
+		workerArena.pop();
+		memory::pool::pop();
+	});
 
-	cb(content, source, engine.root);
+	// Stitch chunk trees into single document in order
+	token * doc = nullptr;
+	for (auto &it : chunks) {
+		if (!it.doc) {
+			continue;
+		}
 
-	memory::pool::pop();
+		doc = mmd_doc_append(doc, it.doc);
 
-	if (isDebug) {
-		debug << "Allocated on processing: " << memory::pool::get_allocated_bytes(p) << "\n";
+		// only items of chunk are added to views, so stitching is linear in size of content
+		content.merge(move(*it.content));
+
+		if (statsEnabled) {
+			stats.tokenizeTime += it.stats.tokenizeTime;
+			stats.parseTime += it.stats.parseTime;
+			stats.pairTime += it.stats.pairTime;
+			stats.contentTime += it.stats.contentTime;
+			stats.lexTokens += it.stats.lexTokens;
+			stats.recursionDepth = std::max(stats.recursionDepth, it.stats.recursionDepth);
+		}
 	}
-	memory::pool::destroy(p);
-}
 
-Engine::~Engine() {
-	clear();
-}
+	if (doc && doc->child) {
+		doc->len = doc->child->tail->start + doc->child->tail->len - doc->start;
+	}
 
-bool Engine::init(memory::pool_t *p, const StringView &source, const Extensions & ext) {
-	clear();
+	if (doc && isDebug) {
+		Token(doc).describeTree(debug, source);
+	}
 
-	auto pool = memory::pool::create(p);
-	memory::pool::push(pool);
-	_internal = new (pool) Internal(pool, source, ext);
-	memory::pool::pop();
-	return true;
+	return doc;
 }
 
-bool Engine::init(const StringView &source, const Extensions & ext) {
-	clear();
+// Header can be started with ATX marker (in blockquote or list item too) or it's a setext underline
+static bool mmd_scan_is_header(const StringView &str, size_t pos) {
+	if (pos >= str.size()) {
+		return false;
+	}
 
-	auto pool = memory::pool::create(tl_pool.getPool());
-	memory::pool::push(pool);
-	_internal = new (pool) Internal(pool, source, ext);
-	memory::pool::pop();
-	return true;
-}
+	auto p = str.data() + pos;
+	auto end = str.data() + block_boundary_line_end(str, pos);
 
-void Engine::clear() {
-	if (_internal) {
-		auto pool = _internal->pool;
-		_internal->~Internal();
-		_internal = nullptr;
-		memory::pool::destroy(pool);
+	auto underline = block_boundary_skip_indent(p, end);
+	if (underline < end && (*underline == '=' || *underline == '-')) {
+		auto c = *underline;
+		while (underline < end && *underline == c) { ++ underline; }
+		if (block_boundary_is_blank(underline, end)) {
+			return true;
+		}
 	}
-}
 
-void Engine::prepare() {
-	if (_internal) {
-		_internal->prepare();
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '>')) { ++ p; }
+	if (p + 1 < end && (*p == '*' || *p == '-' || *p == '+') && (p[1] == ' ' || p[1] == '\t')) {
+		p += 2;
+	} else if (p < end && chars::isDigit(*p)) {
+		while (p < end && chars::isDigit(*p)) { ++ p; }
+		if (p + 1 < end && *p == '.' && (p[1] == ' ' || p[1] == '\t')) {
+			p += 2;
+		}
 	}
+	while (p < end && (*p == ' ' || *p == '\t')) { ++ p; }
+
+	return p < end && *p == '#';
 }
 
-void Engine::setQuotesLanguage(QuotesLanguage l) {
-	if (_internal) {
-		_internal->content.setQuotesLanguage(l);
+// Source is split on the same boundaries as for parallel parsing, so every scanned block is parsed
+// exactly as in full document. Blocks without requested data are not tokenized at all.
+auto Engine::Internal::parseScan(const StringView &str) -> token * {
+	const size_t offset = str.data() - source.data();
+
+	// same conditions as for LINE_META and LINE_YAML in tokenizer
+	bool scan = offset == 0 && !(engine.extensions & toInt(Extensions::Compatibility))
+			&& (str.is("---") || scan_meta_line(str.data()));
+
+	token * doc = nullptr;
+	BlockBoundary boundary(str, 0);
+	size_t blockStart = 0;
+	bool hasNext = !str.empty();
+	while (hasNext) {
+		if (!scan && scanMode == ScanMode::Outline && !boundary.fence && !boundary.comment) {
+			scan = mmd_scan_is_header(str, boundary.line);
+		}
+
+		hasNext = boundary.next();
+		if (!hasNext || boundary.isSafe()) {
+			const size_t blockEnd = hasNext ? boundary.line : str.size();
+			if (scan) {
+				doc = mmd_doc_append(doc, mmd_parse_chain(&engine, pairs, offset + blockStart, blockEnd - blockStart, statsTarget()));
+			}
+
+			if (scanMode == ScanMode::Metadata) {
+				break;
+			}
+
+			blockStart = blockEnd;
+			scan = false;
+		}
+	}
+
+	if (!doc) {
+		doc = sp_mmd_token_new(DOC_START_TOKEN, uint32_t(offset), 0);
+	} else if (doc->child) {
+		doc->len = doc->child->tail->start + doc->child->tail->len - doc->start;
 	}
+
+	if (isDebug) {
+		Token(doc).describeTree(debug, source);
+	}
+
+	return doc;
 }
-QuotesLanguage Engine::getQuotesLanguage() const {
-	return (_internal)?_internal->content.getQuotesLanguage():QuotesLanguage::English;
+
+void Engine::Internal::FragmentBlocks::add(token * t, Index &index) {
+	while (t) {
+		index.emplace(t, int32_t(nodes.size()));
+		nodes.emplace_back(Node{t, -1, -1, -1, -1, -1});
+		if (t->child) {
+			add(t->child, index);
+		}
+		t = t->next;
+	}
 }
 
-void Engine::process(const ProcessCallback &cb) {
-	if (_internal) {
-		_internal->process(cb);
+void Engine::Internal::FragmentBlocks::flatten(token * root, const Content &content, const StringView &source) {
+	if (!root || !root->child) {
+		return;
+	}
+
+	Index index;
+	add(root->child, index);
+
+	auto get = [&] (const token * t) -> int32_t {
+		if (t) {
+			auto it = index.find(t);
+			if (it != index.end()) {
+				return it->second;
+			}
+		}
+		return -1;
+	};
+
+	for (size_t i = 0; i < nodes.size(); ++ i) {
+		auto &it = nodes[i];
+		it.next = get(it.tok->next);
+		it.prev = get(it.tok->prev);
+		it.child = get(it.tok->child);
+		it.mate = get(it.tok->mate);
+
+		// tail is only valid in chain heads, other tokens can refer to released ones
+		it.tail = get(it.tok->tail);
+		if (it.tail < 0) {
+			it.tail = int32_t(i);
+		}
+	}
+
+	auto stack = [&] (VectorType<int32_t> &target, const Content::Vector<Token> &tokens) {
+		for (auto &it : tokens) {
+			auto idx = get(it.getToken());
+			if (idx >= 0) {
+				target.emplace_back(idx);
+			}
+		}
+	};
+
+	stack(definitions, content.getDefinitions());
+	stack(headers, content.getHeaders());
+	stack(tables, content.getTables());
+
+	// ids are collected by tokenizer, without content processing there is no other links
+	for (auto &it : content.getLinks()) {
+		auto t = it->label.getToken();
+		if (it->origin != Content::Link::HtmlId || !t || it->label_text.data() < source.data()
+				|| it->label_text.data() + it->label_text.size() > source.data() + source.size()) {
+			continue;
+		}
+
+		ids.emplace_back(HtmlId{get(t), t->type, t->start, t->len,
+			uint32_t(it->label_text.data() - source.data()), uint32_t(it->label_text.size())});
+	}
+}
+
+auto Engine::Internal::FragmentBlocks::copy(int64_t diff, Internal &target) const -> token * {
+	if (nodes.empty()) {
+		return nullptr;
+	}
+
+	VectorType<token *> tokens; tokens.reserve(nodes.size());
+	for (auto &it : nodes) {
+		auto t = sp_mmd_token_copy(it.tok);
+		t->start = uint32_t(int64_t(t->start) + diff);
+		tokens.emplace_back(t);
+	}
+
+	auto get = [&] (int32_t idx) -> token * {
+		return (idx >= 0) ? tokens[idx] : nullptr;
+	};
+
+	for (size_t i = 0; i < nodes.size(); ++ i) {
+		auto &it = nodes[i];
+		auto t = tokens[i];
+		t->next = get(it.next);
+		t->prev = get(it.prev);
+		t->child = get(it.child);
+		t->tail = get(it.tail);
+		t->mate = get(it.mate);
+	}
+
+	// stacks are in document order already
+	for (auto &it : definitions) {
+		sp_mmd_stack_push(target.engine.definition_stack, tokens[it]);
+	}
+	for (auto &it : headers) {
+		sp_mmd_stack_push(target.engine.header_stack, tokens[it]);
+	}
+	for (auto &it : tables) {
+		sp_mmd_stack_push(target.engine.table_stack, tokens[it]);
+	}
+
+	auto content = (Content *)target.engine.content;
+	for (auto &it : ids) {
+		auto t = (it.node >= 0) ? tokens[it.node] : sp_mmd_token_new(it.type, uint32_t(int64_t(it.start) + diff), it.len);
+		content->emplaceHtmlId(Token(t), StringView(target.source.data() + int64_t(it.text) + diff, it.textLen));
+	}
+
+	return tokens.front();
+}
+
+// Blocks of transcluded fragments are copied from fragment's tree, when fragment's first and last safe
+// boundaries are safe boundaries in document too, so blocks are parsed in document exactly as in fragment.
+// Other parts (and fragments, that were merged with surrounding text) are parsed as usual.
+auto Engine::Internal::parseTranscluded(const StringView &str) -> token * {
+	const size_t offset = str.data() - source.data();
+
+	token * doc = nullptr;
+	BlockBoundary boundary(str, 0);
+	size_t pos = 0;
+	for (auto &it : transcluded) {
+		auto &b = it.fragment->getEngine()->_internal->blocks;
+		if (b.start >= b.end || b.nodes.empty()) {
+			continue;
+		}
+
+		// fragment source starts with extra empty line, first block is never reused to keep metadata intact
+		const size_t blockStart = it.start + b.start - 1;
+		const size_t blockEnd = it.start + b.end - 1;
+		if (blockStart == 0 || blockStart < offset + pos || blockEnd > offset + str.size()) {
+			continue;
+		}
+
+		while (boundary.line < blockStart - offset && boundary.next()) { }
+		if (boundary.line != blockStart - offset || !boundary.isSafe()) {
+			continue;
+		}
+
+		BlockBoundary endBoundary(boundary);
+		while (endBoundary.line < blockEnd - offset && endBoundary.next()) { }
+		if (endBoundary.line != blockEnd - offset || !endBoundary.isSafe()) {
+			continue;
+		}
+
+		if (blockStart > offset + pos) {
+			doc = mmd_doc_append(doc, mmd_parse_chain(&engine, pairs, offset + pos, blockStart - offset - pos, statsTarget()));
+		}
+
+		auto part = sp_mmd_token_new(DOC_START_TOKEN, uint32_t(blockStart), uint32_t(blockEnd - blockStart));
+		part->child = b.copy(int64_t(it.start) - 1, *this);
+		doc = mmd_doc_append(doc, part);
+
+		if (statsEnabled) {
+			stats.transcludedBytes += blockEnd - blockStart;
+		}
+
+		pos = blockEnd - offset;
+		boundary = endBoundary;
+	}
+
+	if (pos < str.size()) {
+		doc = mmd_doc_append(doc, mmd_parse_chain(&engine, pairs, offset + pos, str.size() - pos, statsTarget()));
+	}
+
+	if (!doc) {
+		doc = sp_mmd_token_new(DOC_START_TOKEN, uint32_t(offset), 0);
+	} else if (doc->child) {
+		doc->len = doc->child->tail->start + doc->child->tail->len - doc->start;
+	}
+
+	if (isDebug) {
+		Token(doc).describeTree(debug, source);
+	}
+
+	return doc;
+}
+
+// Directory of file, used for relative transclusion paths
+static StringView transclude_dir(const StringView &path) {
+	size_t len = path.size();
+	while (len > 0 && path[len - 1] != '/') { -- len; }
+	return StringView(path.data(), (len > 1) ? len - 1 : len);
+}
+
+// Replace `{{path}}` markers with text of fragments, fragment's own source starts with empty line and
+// does not include metadata
+void Engine::Internal::transclude() {
+	if (transcludeDone || streaming || (!fragment && !content.getExtensions().hasFlag(Extensions::Transclude))) {
+		return;
+	}
+
+	transcludeDone = true;
+
+	if (!transclusion) {
+		transclusion = Rc<Transclusion>::create();
+	}
+
+	memory::pool::push(pool);
+
+	// metadata block ends with empty line, YAML block can also be closed with `---` or `...`
+	size_t bodyStart = 0;
+	StringView metaBase;
+	if (!content.getExtensions().hasFlag(Extensions::Compatibility) && (source.is("---") || scan_meta_line(source.data()))) {
+		const bool yaml = source.is("---");
+		while (bodyStart < source.size()) {
+			auto lineEnd = block_boundary_line_end(source, bodyStart);
+			auto p = source.data() + bodyStart;
+			auto end = source.data() + lineEnd;
+			if (block_boundary_is_blank(p, end)) {
+				break;
+			}
+
+			bodyStart = (lineEnd < source.size()) ? lineEnd + 1 : source.size();
+
+			if (yaml && p != source.data() && (StringView(p, end - p).is("---") || StringView(p, end - p).is("..."))) {
+				break;
+			}
+
+			if (!fragment && scan_meta_line(p)) {
+				auto len = scan_meta_key(p);
+				if (Content::labelFromString(StringView(p, len)) == "transcludebase") {
+					metaBase = StringView(p + len + 1, end - p - len - 1);
+					metaBase.trimChars<StringView::CharGroup<CharGroupId::WhiteSpace>>();
+				}
+			}
+		}
+	}
+
+	StringType base(sourceDir);
+	if (!metaBase.empty()) {
+		if (metaBase.is('/') || sourceDir.empty()) {
+			base = StringType(metaBase.data(), metaBase.size());
+		} else {
+			base.push_back('/');
+			base.append(metaBase.data(), metaBase.size());
+		}
+	}
+
+	struct Marker {
+		size_t start;
+		size_t end;
+		size_t path;
+	};
+
+	VectorType<Marker> markers;
+	MapType<StringType, size_t> paths;
+	VectorType<const StringType *> pathList;
+
+	// markers in code fences are not expanded
+	BlockBoundary boundary(source, bodyStart);
+	bool hasNext = bodyStart < source.size();
+	while (hasNext) {
+		const size_t line = boundary.line;
+		const bool fenced = boundary.fence != 0;
+		hasNext = boundary.next();
+		if (fenced || boundary.fence != 0) {
+			continue;
+		}
+
+		auto p = source.data() + line;
+		auto end = source.data() + (hasNext ? boundary.line : source.size());
+		while (auto open = (const char *)memmem(p, end - p, "{{", 2)) {
+			auto close = (const char *)memmem(open + 2, end - open - 2, "}}", 2);
+			if (!close) {
+				break;
+			}
+
+			p = close + 2;
+
+			StringView name(open + 2, close - open - 2);
+			name.trimChars<StringView::CharGroup<CharGroupId::WhiteSpace>>();
+			if (name.empty() || name == "TOC" || name.is("TOC:")) {
+				continue;
+			}
+
+			StringType path;
+			if (name.is('/') || base.empty()) {
+				path = StringType(name.data(), name.size());
+			} else {
+				path = base;
+				if (path.back() != '/') {
+					path.push_back('/');
+				}
+				path.append(name.data(), name.size());
+			}
+
+			// the same fragment can be referenced with different paths
+			auto normalized = Transclusion::normalizePath(StringView(path));
+			path.assign(normalized.data(), normalized.size());
+
+			auto it = paths.find(path);
+			if (it == paths.end()) {
+				it = paths.emplace(move(path), pathList.size()).first;
+				pathList.emplace_back(&it->first);
+			}
+
+			markers.emplace_back(Marker{size_t(open - source.data()), size_t(p - source.data()), it->second});
+		}
+	}
+
+	std::vector<StringView> views; views.reserve(pathList.size());
+	for (auto &it : pathList) {
+		views.emplace_back(StringView(*it));
+	}
+
+	auto fragments = views.empty() ? std::vector<Rc<Transclusion::Fragment>>()
+			: transclusion->acquire(views, content.getExtensions(), fragment);
+
+	size_t size = fragment ? source.size() - bodyStart + 1 : source.size();
+	size_t available = 0;
+	for (auto &it : markers) {
+		if (auto &f = fragments[it.path]) {
+			size = size - (it.end - it.start) + f->getText().size();
+			++ available;
+		}
+	}
+
+	// document's source is used as is without fragments
+	if (available > 0 || fragment) {
+		auto data = (char *)memory::pool::palloc(pool, size + 1);
+		auto out = data;
+		if (fragment) {
+			*out ++ = '\n';
+		}
+
+		size_t copied = fragment ? bodyStart : 0;
+		for (auto &it : markers) {
+			auto &f = fragments[it.path];
+			if (!f) {
+				continue; // unavailable fragments are left as text
+			}
+
+			memcpy(out, source.data() + copied, it.start - copied);
+			out += it.start - copied;
+
+			auto text = f->getText();
+			transcluded.emplace_back(Transcluded{uint32_t(out - data), f});
+			memcpy(out, text.data(), text.size());
+			out += text.size();
+
+			copied = it.end;
+		}
+
+		memcpy(out, source.data() + copied, source.size() - copied);
+		data[size] = 0;
+
+		if (buffer) {
+			freeBuffer(buffer, bufferCapacity);
+		}
+
+		buffer = data;
+		bufferSize = size;
+		bufferCapacity = size;
+		setSource(StringView(buffer, bufferSize));
+	}
+
+	memory::pool::pop();
+}
+
+// Fragment is parsed only between first and last safe boundaries, so its blocks can be reused by documents
+bool Engine::Internal::prepareFragment() {
+	BlockBoundary boundary(source, 0);
+	while (boundary.next()) {
+		if (boundary.isSafe()) {
+			if (!blocks.start) {
+				blocks.start = boundary.line;
+			}
+			blocks.end = boundary.line;
+		}
+	}
+
+	if (blocks.start < blocks.end) {
+		memory::pool::push(pool);
+		arena.push();
+
+		engine.root = parse(source.sub(blocks.start, blocks.end - blocks.start));
+		blocks.flatten(engine.root, content, source);
+
+		arena.pop();
+		memory::pool::pop();
+	}
+
+	return true;
+}
+
+bool Engine::Internal::prepare() {
+	if (streaming) {
+		return finalize();
+	}
+
+	flushEdits();
+
+	if (!engine.root) {
+		transclude();
+
+		memory::pool::push(pool);
+		arena.push();
+
+		if (statsEnabled) {
+			stats = Stats();
+			stats.sourceBytes = source.size();
+			engine.max_recurse_depth = 0;
+		}
+
+		engine.root = parse(source);
+
+		StatsTimer timer(statsTarget());
+		if (!parallelParsed) {
+			// content for parallel parsing is processed by workers
+			content.process(source);
+			timer.lap(&Stats::contentTime);
+		}
+
+		// Process abbreviations, glossary, etc.
+		if (scanMode == ScanMode::Full) {
+			search_automatic_targets(content, source, engine.root);
+			timer.lap(&Stats::searchTime);
+		}
+
+		arena.pop();
+		memory::pool::pop();
+
+		updateStats();
+
+		if (isDebug) {
+			debug << "Allocated on parsing: " << memory::pool::get_allocated_bytes(pool) << "\n";
+			debug << "Tokens: " << arena.getAllocated() << " allocated in " << arena.getBlocks() << " blocks\n";
+		}
+		return engine.root != nullptr;
+	}
+
+	return true;
+}
+
+void Engine::Internal::reset() {
+	if (engine.root) {
+		engine.root = nullptr;
+	}
+
+	content.reset();
+
+	if (parallelParsed) {
+		// trees from previous parse are released, pools are reused
+		for (auto &it : workerPools) {
+			memory::pool::clear(it);
+		}
+		parallelParsed = false;
+	}
+}
+
+bool Engine::Internal::update(size_t offset, size_t removed, const StringView &text) {
+	if (streaming) {
+		return false;
+	}
+
+	// offsets are in transcluded text, fragment blocks are not reused after edit
+	transclude();
+	transcluded.clear();
+
+	const size_t size = edited ? bufferSize : source.size();
+	if (offset > size) {
+		return false;
+	}
+
+	removed = std::min(removed, size - offset);
+	if (removed == 0 && text.empty()) {
+		return true;
+	}
+
+	// inserted text can be a view of edited text, that is moved with the gap
+	std::string tmp;
+	StringView insert(text);
+	if (buffer && text.data() >= buffer && text.data() < buffer + bufferCapacity + 1) {
+		tmp.assign(text.data(), text.size());
+		insert = StringView(tmp);
+	}
+
+	if (!edited) {
+		if (!buffer) {
+			auto capacity = size + insert.size() + EditGapSize;
+			buffer = (char *)memory::pool::palloc(pool, capacity + 1);
+			memcpy(buffer, source.data(), size);
+			buffer[capacity] = 0;
+			bufferSize = size;
+			bufferCapacity = capacity;
+		}
+
+		edited = true;
+		edit = Edit{offset, removed, insert.size()};
+		gapStart = bufferSize;
+	} else {
+		// extend pending range, so it covers both edits; text outside of it is the same as in parsed source
+		auto start = std::min(edit.offset, offset);
+		auto end = std::max(edit.offset + edit.inserted, offset + removed);
+		edit.removed = end - edit.inserted + edit.removed - start;
+		edit.inserted = end - removed + insert.size() - start;
+		edit.offset = start;
+	}
+
+	moveGap(offset);
+	bufferSize -= removed;
+
+	if (bufferCapacity - bufferSize < insert.size()) {
+		growBuffer(bufferSize + insert.size());
+	}
+
+	memcpy(buffer + gapStart, insert.data(), insert.size());
+	gapStart += insert.size();
+	bufferSize += insert.size();
+	return true;
+}
+
+void Engine::Internal::moveGap(size_t offset) {
+	const size_t gap = bufferCapacity - bufferSize;
+	if (offset < gapStart) {
+		memmove(buffer + offset + gap, buffer + offset, gapStart - offset);
+	} else if (offset > gapStart) {
+		memmove(buffer + gapStart, buffer + gapStart + gap, offset - gapStart);
+	}
+	gapStart = offset;
+}
+
+void Engine::Internal::growBuffer(size_t size) {
+	const size_t capacity = std::max(size + EditGapSize, bufferCapacity + bufferCapacity / 2);
+	const size_t tail = bufferSize - gapStart;
+
+	auto data = (char *)memory::pool::palloc(pool, capacity + 1);
+	memcpy(data, buffer, gapStart);
+	memcpy(data + capacity - tail, buffer + bufferCapacity - tail, tail);
+	data[capacity] = 0;
+
+	// parsed source is used to rebase content strings on flush
+	if (buffer == source.data() && !retired) {
+		retired = buffer;
+		retiredCapacity = bufferCapacity;
+	} else {
+		freeBuffer(buffer, bufferCapacity);
+	}
+
+	buffer = data;
+	bufferCapacity = capacity;
+}
+
+// Own copies of source are allocated from pool
+void Engine::Internal::freeBuffer(char *buf, size_t capacity) {
+	memory::pool::free(pool, buf, capacity + 1);
+}
+
+void Engine::Internal::flushEdits() {
+	if (!edited) {
+		return;
+	}
+
+	edited = false;
+
+	// gap is moved to the end, so text is continuous and null-terminated again
+	moveGap(bufferSize);
+	buffer[bufferSize] = 0;
+
+	if (engine.root) {
+		memory::pool::push(pool);
+		arena.push();
+
+		// scanned tree is partial, so it's always parsed again
+		if (scanMode != ScanMode::Full || !updateBlocks(edit.offset, edit.removed, edit.inserted, StringView(buffer, bufferSize))) {
+			// release current tree, it will be parsed from scratch on next processing
+			sp_mmd_token_tree_free(engine.root);
+			reset();
+		}
+
+		arena.pop();
+		memory::pool::pop();
+	}
+
+	if (retired) {
+		freeBuffer(retired, retiredCapacity);
+		retired = nullptr;
+	}
+
+	setSource(StringView(buffer, bufferSize));
+
+	if (engine.root) {
+		updateStats();
+	}
+}
+
+bool Engine::Internal::updateBlocks(size_t offset, size_t removed, size_t inserted, const StringView &next) {
+	const int64_t diff = int64_t(inserted) - int64_t(removed);
+	token * doc = engine.root;
+
+	// Region starts on top-level block after an empty line, first block is never reused
+	// to keep metadata processing intact
+	token * first = nullptr;
+	for (token * b = doc->child; b && b->start <= offset; b = b->next) {
+		if (b->prev && b->prev->type == BLOCK_EMPTY && b->type != BLOCK_EMPTY && BlockBoundary::isSafeLine(next, b->start)) {
+			first = b;
+		}
+	}
+
+	if (!first) {
+		return false;
+	}
+
+	// Region ends on first safe boundary after the edit, that matches start of existing block
+	token * tail = first;
+	size_t end = next.size();
+	BlockBoundary boundary(next, first->start);
+	while (tail && boundary.next()) {
+		if (boundary.line >= offset + inserted && boundary.isSafe()) {
+			auto pos = int64_t(boundary.line) - diff;
+			while (tail && tail->start < pos) {
+				tail = tail->next;
+			}
+			if (tail && tail->start == pos) {
+				end = boundary.line;
+				break;
+			}
+		}
+	}
+
+	if (end == next.size()) {
+		tail = nullptr;
+	}
+
+	const uint32_t start = first->start;
+	const uint32_t oldEnd = tail ? tail->start : uint32_t(source.size());
+
+	// Abbreviations and glossary terms are searched through the whole document
+	if (content.hasSearchTargets(start, oldEnd)) {
+		return false;
+	}
+
+	token * prev = first->prev;
+	token * removedBlocks = (first != tail) ? first : nullptr;
+
+	content.erase(start, oldEnd);
+
+	if (tail && removedBlocks) {
+		tail->prev->next = nullptr;
+	}
+
+	prev->next = tail;
+	if (tail) {
+		tail->prev = prev;
+		if (diff != 0) {
+			shiftBlocks(tail, diff);
+		}
+	}
+
+	if (content.hasDeferredShifts()) {
+		for (token * b = removedBlocks; b; b = b->next) {
+			content.dropShift(b);
+		}
+	}
+
+	sp_mmd_token_tree_free(removedBlocks);
+
+	content.shift(oldEnd, diff, source, next.data());
+
+	source = next;
+	engine.str = next.data();
+	engine.len = uint32_t(next.size());
+
+	// Parse region with separate content to merge results in document order
+	Content fragment(content.getExtensions());
+	fragment.setQuotesLanguage(content.getQuotesLanguage());
+
+	setContent(&fragment);
+	token * chunk = parseChain(start, end - start);
+	setContent(&content);
+
+	fragment.process(source);
+
+	token * blocks = chunk ? chunk->child : nullptr;
+	if (blocks) {
+		token * last = blocks->tail;
+
+		prev->next = blocks;
+		blocks->prev = prev;
+		last->next = tail;
+		if (tail) {
+			tail->prev = last;
+		}
+
+		// limit search with new blocks
+		last->next = nullptr;
+		StatsTimer timer(statsTarget());
+		search_automatic_targets(content, source, blocks);
+		timer.lap(&Stats::searchTime);
+		last->next = tail;
+
+		chunk->child = nullptr;
+		sp_mmd_token_free(chunk);
+	}
+
+	// tail of the top-level chain is only stored in the head
+	if (!tail) {
+		doc->child->tail = prev;
+		while (doc->child->tail->next) {
+			doc->child->tail = doc->child->tail->next;
+		}
+	}
+	doc->len = doc->child->tail->start + doc->child->tail->len - doc->start;
+
+	if (!fragment.getAbbreviations().empty() || !fragment.getGlossary().empty()) {
+		return false;
+	}
+
+	content.merge(move(fragment));
+	return true;
+}
+
+// Top-level blocks after updated range are shifted immediately, their subtrees are shifted on first
+// access (see Content::resolveShift), so unchanged blocks are not walked on every update. Blocks with
+// tokens, referenced by content items, are shifted completely, item positions are compared on update.
+void Engine::Internal::shiftBlocks(token * t, int64_t diff) {
+	Content::Vector<uint32_t> positions;
+	content.getPositions(t->start, positions);
+
+	auto it = positions.begin();
+	while (t) {
+		const uint32_t end = t->next ? t->next->start : maxOf<uint32_t>();
+		bool referenced = false;
+		while (it != positions.end() && *it < end) {
+			referenced = true;
+			++ it;
+		}
+
+		t->start = uint32_t(int64_t(t->start) + diff);
+		if (t->child) {
+			content.deferShift(t, diff);
+			if (referenced) {
+				content.resolveShift(t);
+			}
+		}
+		t = t->next;
+	}
+}
+
+bool Engine::Internal::initFile(const StringView &path) {
+	StringType filePath(path.data(), path.size());
+	size_t size = 0;
+
+	memory::pool::push(pool);
+	auto dir = transclude_dir(path);
+	sourceDir.assign(dir.data(), dir.size());
+	memory::pool::pop();
+
+	int fd = ::open(filePath.data(), O_RDONLY);
+	if (fd >= 0) {
+		struct stat st;
+		if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+			size = size_t(st.st_size);
+
+			// Scanner expects null-terminated source, so mapping is followed by at least one zero byte:
+			// anonymous zero pages are reserved first, then file is mapped over them
+			const size_t page = size_t(sysconf(_SC_PAGESIZE));
+			const size_t mapSize = (size / page + 1) * page;
+
+			auto addr = mmap(nullptr, mapSize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (addr != MAP_FAILED) {
+				// file, that was changed while it was mapped, is read into own copy instead
+				struct stat mapped;
+				if (size == 0 || (mmap(addr, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) != MAP_FAILED
+						&& fstat(fd, &mapped) == 0 && mapped.st_size == st.st_size && mapped.st_mtime == st.st_mtime)) {
+					mapping = addr;
+					mappingSize = mapSize;
+					if (size > 0) {
+						madvise(addr, size, MADV_SEQUENTIAL);
+					}
+				} else {
+					munmap(addr, mapSize);
+				}
+			}
+		}
+		::close(fd);
+	}
+
+	if (mapping) {
+		setSource(StringView((const char *)mapping, size));
+		return true;
+	}
+
+	// file can not be mapped (e.g. application bundle resource), use own copy
+	auto data = filesystem::readFile(path);
+	if (data.empty()) {
+		return false;
+	}
+
+	buffer = (char *)memory::pool::palloc(pool, data.size() + 1);
+	memcpy(buffer, data.data(), data.size());
+	buffer[data.size()] = 0;
+	bufferSize = bufferCapacity = data.size();
+
+	setSource(StringView(buffer, bufferSize));
+	return true;
+}
+
+void Engine::Internal::setSource(const StringView &v) {
+	source = v;
+	engine.str = v.data();
+	engine.len = uint32_t(v.size());
+}
+
+bool Engine::Internal::writeCache(std::ostream &stream) {
+	if (scanMode != ScanMode::Full || !prepare()) {
+		return false;
+	}
+
+	// serialization buffers are temporary
+	auto tmp = memory::pool::create(pool);
+	memory::pool::push(tmp);
+
+	content.resolveShifts();
+
+	CacheWriter w(source);
+	w.index(engine.root);
+	content.writeCache(w);
+
+	auto &data = w.finalize(engine.root, engine.extensions, getTargetsDigest());
+	stream.write((const char *)data.data(), data.size());
+
+	memory::pool::pop();
+	memory::pool::destroy(tmp);
+
+	return stream.good();
+}
+
+bool Engine::Internal::loadCache(const uint8_t *data, size_t size) {
+	if (streaming) {
+		return false;
+	}
+
+	// cache is written for transcluded source
+	flushEdits();
+	transclude();
+
+	bool ret = false;
+	memory::pool::push(pool);
+
+	CacheReader r(source, data, size);
+	if (auto root = r.load(engine.extensions, getTargetsDigest())) {
+		reset();
+		if (content.readCache(r)) {
+			engine.root = root;
+			ret = true;
+		} else {
+			content.reset();
+		}
+	}
+
+	memory::pool::pop();
+	return ret;
+}
+
+bool Engine::Internal::write(const StringView &data) {
+	if (!streaming) {
+		return false;
+	}
+
+	if (data.empty()) {
+		return true;
+	}
+
+	// source offsets are 32-bit
+	if (bufferSize + data.size() >= size_t(maxOf<uint32_t>())) {
+		return false;
+	}
+
+	if (bufferSize + data.size() > bufferCapacity) {
+		// buffer is copied on growth, capacity is doubled to keep copying amortized
+		auto capacity = std::max(std::max(bufferCapacity * 2, bufferSize + data.size()), StreamBufferSize);
+		auto next = (char *)memory::pool::palloc(pool, capacity + 1);
+		if (buffer) {
+			memcpy(next, buffer, bufferSize);
+
+			// html ids refers to source directly
+			content.shift(maxOf<uint32_t>(), 0, StringView(buffer, bufferSize), next);
+			memory::pool::free(pool, buffer, bufferCapacity + 1);
+		}
+		buffer = next;
+		bufferCapacity = capacity;
+	}
+
+	memcpy(buffer + bufferSize, data.data(), data.size());
+	bufferSize += data.size();
+	buffer[bufferSize] = 0;
+
+	source = StringView(buffer, bufferSize);
+	engine.str = buffer;
+	engine.len = uint32_t(bufferSize);
+
+	// Block boundaries can be checked only on complete lines
+	auto end = bufferSize;
+	while (end > bufferSize - data.size() && buffer[end - 1] != '\n') {
+		-- end;
+	}
+
+	if (end == bufferSize - data.size()) {
+		return true;
+	}
+
+	streamBoundary.source = StringView(buffer, end);
+
+	// Line, where previous scan stopped, is checked first: it was at the end of data then, and it's
+	// complete only now; with one line per write every block starts at such position
+	size_t split = 0;
+	do {
+		if (streamBoundary.line > streamParsed && streamBoundary.isSafe()) {
+			split = streamBoundary.line;
+		}
+	} while (streamBoundary.next());
+
+	if (split) {
+		parseStream(split);
+	}
+
+	return true;
+}
+
+// Parse all blocks until `end` and pass them to callback
+void Engine::Internal::parseStream(size_t end) {
+	memory::pool::push(pool);
+	arena.push();
+
+	token * doc = parseChain(streamParsed, end - streamParsed);
+	if (doc) {
+		token * first = doc->child;
+		if (!engine.root) {
+			engine.root = doc;
+		} else if (first) {
+			if (engine.root->child) {
+				sp_mmd_token_chain_append(engine.root->child, first);
+			} else {
+				engine.root->child = first;
+			}
+			doc->child = nullptr;
+			sp_mmd_token_free(doc);
+		}
+
+		engine.root->len = uint32_t(end - engine.root->start);
+
+		if (streamCallback) {
+			for (token * t = first; t != nullptr; t = t->next) {
+				streamCallback(source, Token(t));
+			}
+		}
+	}
+
+	streamParsed = end;
+
+	arena.pop();
+	memory::pool::pop();
+}
+
+// Parse rest of the stream and resolve references
+bool Engine::Internal::finalize() {
+	if (!streaming) {
+		return engine.root != nullptr;
+	}
+
+	if (streamParsed < bufferSize) {
+		parseStream(bufferSize);
+	}
+
+	streaming = false;
+
+	memory::pool::push(pool);
+	arena.push();
+
+	StatsTimer timer(statsTarget());
+	content.process(source);
+	timer.lap(&Stats::contentTime);
+
+	// Process abbreviations, glossary, etc.
+	search_automatic_targets(content, source, engine.root);
+	timer.lap(&Stats::searchTime);
+
+	arena.pop();
+	memory::pool::pop();
+
+	updateStats();
+
+	return engine.root != nullptr;
+}
+
+// Tree and memory stats, collected after parsing or update
+void Engine::Internal::updateStats() {
+	if (!statsEnabled) {
+		return;
+	}
+
+	stats.sourceBytes = source.size();
+	stats.treeTokens = 0;
+	stats.treeDepth = 0;
+	stats.blocks = 0;
+	if (engine.root) {
+		mmd_stats_tree(stats, engine.root, 1);
+		for (auto t = engine.root->child; t; t = t->next) {
+			++ stats.blocks;
+		}
+	}
+
+	stats.parseBytes = memory::pool::get_allocated_bytes(pool);
+	for (auto &it : workerPools) {
+		stats.parseBytes += memory::pool::get_allocated_bytes(it);
+	}
+}
+
+void Engine::Internal::setContent(Content *c) {
+	engine.definition_stack = (void *)&c->getDefinitions();
+	engine.header_stack = (void *)&c->getHeaders();
+	engine.table_stack = (void *)&c->getTables();
+	engine.content = c;
+}
+
+void Engine::Internal::process(const ProcessCallback &cb, memory::pool_t *renderPool) {
+	if (!prepare()) {
+		log::text("MMD", "Fail to parse multimarkdown text");
+		return;
+	}
+
+	// external render pool is recycled by engine
+	auto p = renderPool ? renderPool : memory::pool::create(pool);
+	memory::pool::push(p);
+
+	StatsTimer timer(statsTarget());
+
+	content.resetUsage();
+	if (!lazyBlocks) {
+		content.resolveShifts();
+	}
+	cb(content, source, engine.root);
+
+	timer.lap(&Stats::exportTime);
+
+	memory::pool::pop();
+
+	if (statsEnabled) {
+		stats.exportBytes = memory::pool::get_allocated_bytes(p);
+		++ stats.exports;
+	}
+
+	if (isDebug) {
+		debug << "Allocated on processing: " << memory::pool::get_allocated_bytes(p) << "\n";
+	}
+	if (!renderPool) {
+		memory::pool::destroy(p);
+	}
+}
+
+bool Engine::trimThreadPool() {
+	return tl_pool.trim();
+}
+
+Engine::~Engine() {
+	clear();
+	releasePools();
+}
+
+bool Engine::init(memory::pool_t *p, const StringView &source, const Extensions & ext) {
+	clear();
+
+	auto pool = acquirePool(p, false);
+	memory::pool::push(pool);
+	_internal = new (pool) Internal(pool, source, ext);
+	_internal->transclusion = _transclusion;
+	memory::pool::pop();
+	return true;
+}
+
+bool Engine::init(const StringView &source, const Extensions & ext) {
+	clear();
+
+	auto pool = acquirePool(nullptr, true);
+	memory::pool::push(pool);
+	_internal = new (pool) Internal(pool, source, ext);
+	_internal->transclusion = _transclusion;
+	memory::pool::pop();
+	return true;
+}
+
+bool Engine::initFromFile(memory::pool_t *p, const StringView &path, const Extensions & ext) {
+	if (!init(p, StringView(), ext)) {
+		return false;
+	}
+
+	if (!_internal->initFile(path)) {
+		clear();
+		return false;
+	}
+	return true;
+}
+
+bool Engine::initFromFile(const StringView &path, const Extensions & ext) {
+	if (!init(StringView(), ext)) {
+		return false;
+	}
+
+	if (!_internal->initFile(path)) {
+		clear();
+		return false;
+	}
+	return true;
+}
+
+bool Engine::initFragment(Transclusion *t, Transclusion::Fragment *f, const StringView &data, const Extensions &ext) {
+	if (!init(nullptr, data, ext)) {
+		return false;
+	}
+
+	memory::pool::push(_internal->pool);
+	auto dir = transclude_dir(f->getPath());
+	_internal->sourceDir.assign(dir.data(), dir.size());
+	memory::pool::pop();
+
+	// fragment's data is released after building, transclusion replaces it with own copy; engine does not
+	// retain cache, that retains fragments
+	_internal->transclusion = t;
+	_internal->fragment = f;
+	_internal->transclude();
+	_internal->transclusion = nullptr;
+	_internal->fragment = nullptr;
+
+	return _internal->prepareFragment();
+}
+
+bool Engine::initStream(memory::pool_t *p, const Extensions & ext, const BlockCallback &cb) {
+	if (!init(p, StringView(), ext)) {
+		return false;
+	}
+
+	memory::pool::push(_internal->pool);
+	_internal->streaming = true;
+	_internal->streamCallback = cb;
+	memory::pool::pop();
+	return true;
+}
+
+bool Engine::initStream(const Extensions & ext, const BlockCallback &cb) {
+	if (!init(StringView(), ext)) {
+		return false;
+	}
+
+	memory::pool::push(_internal->pool);
+	_internal->streaming = true;
+	_internal->streamCallback = cb;
+	memory::pool::pop();
+	return true;
+}
+
+bool Engine::write(const StringView &data) {
+	if (_internal) {
+		return _internal->write(data);
+	}
+	return false;
+}
+
+bool Engine::read(const io::Producer &prod) {
+	if (!_internal || !_internal->streaming) {
+		return false;
+	}
+
+	StackBuffer<Internal::StreamReadSize> buf;
+	while (true) {
+		buf.clear();
+		auto size = prod.read(buf, Internal::StreamReadSize);
+		if (size == 0) {
+			break;
+		}
+
+		if (!_internal->write(StringView((const char *)buf.data(), size))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool Engine::read(int fd) {
+	if (!_internal || !_internal->streaming || fd < 0) {
+		return false;
+	}
+
+	char buf[Internal::StreamReadSize];
+	while (true) {
+		auto size = ::read(fd, buf, Internal::StreamReadSize);
+		if (size < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			log::format("MMD", "Fail to read from fd %d: %s", fd, strerror(errno));
+			return false;
+		} else if (size == 0) {
+			break;
+		}
+
+		if (!_internal->write(StringView(buf, size_t(size)))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool Engine::finalize() {
+	if (_internal) {
+		return _internal->finalize();
+	}
+	return false;
+}
+
+uint64_t Engine::getCacheKey() const {
+	if (_internal) {
+		_internal->flushEdits();
+		_internal->transclude();
+		return (Cache::hash(_internal->source) + 0x9E3779B97F4A7C15ULL * (uint64_t(_internal->engine.extensions) + 1))
+				^ _internal->getTargetsDigest();
+	}
+	return 0;
+}
+
+bool Engine::writeCache(std::ostream &stream) {
+	if (_internal) {
+		return _internal->writeCache(stream);
+	}
+	return false;
+}
+
+bool Engine::saveCache(const StringView &path) {
+	if (!_internal) {
+		return false;
+	}
+
+	std::ofstream stream(StringType(path.data(), path.size()).data(), std::ios::binary);
+	if (!stream.is_open()) {
+		return false;
+	}
+
+	return _internal->writeCache(stream);
+}
+
+bool Engine::loadCache(const uint8_t *data, size_t size) {
+	if (_internal) {
+		return _internal->loadCache(data, size);
+	}
+	return false;
+}
+
+bool Engine::loadCache(const StringView &path) {
+	if (!_internal) {
+		return false;
+	}
+
+	bool ret = false;
+	int fd = ::open(StringType(path.data(), path.size()).data(), O_RDONLY);
+	if (fd >= 0) {
+		struct stat st;
+		if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+			auto addr = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+			if (addr != MAP_FAILED) {
+				ret = _internal->loadCache((const uint8_t *)addr, size_t(st.st_size));
+				munmap(addr, size_t(st.st_size));
+			}
+		}
+		::close(fd);
+	}
+	return ret;
+}
+
+void Engine::clear() {
+	if (_internal) {
+		auto pool = _internal->pool;
+		_internal->~Internal();
+		_internal = nullptr;
+		if (pool == _pool) {
+			_pool = recyclePool(pool, _poolStats.documentBytes, _poolStats.peakDocumentBytes);
+			++ _poolStats.documents;
+		} else {
+			engine_pool_destroy(pool, _threadLocalPool);
+		}
+	}
+}
+
+void Engine::setReusable(bool value, size_t highWaterMark) {
+	_highWaterMark = highWaterMark;
+	if (_reusable == value) {
+		return;
+	}
+
+	_reusable = value;
+	if (!_reusable) {
+		if (_internal && _internal->pool == _pool) {
+			_pool = nullptr; // pool of current document will be destroyed by clear
+		}
+		releasePools();
+	}
+}
+
+bool Engine::isReusable() const {
+	return _reusable;
+}
+
+const Engine::PoolStats &Engine::getPoolStats() const {
+	return _poolStats;
+}
+
+memory::pool_t *Engine::acquirePool(memory::pool_t *parent, bool threadLocal) {
+	if (_pool || _renderPool) {
+		if (_threadLocalPool != threadLocal || _poolParent != parent) {
+			releasePools();
+		}
+	}
+
+	_poolParent = parent;
+	_threadLocalPool = threadLocal;
+
+	if (_pool) {
+		return _pool; // already cleared by previous reset
+	}
+
+	auto pool = engine_pool_create(parent, threadLocal);
+	if (_reusable) {
+		_pool = pool;
+	}
+	return pool;
+}
+
+memory::pool_t *Engine::recyclePool(memory::pool_t *pool, size_t &bytes, size_t &peak) {
+	bytes = memory::pool::get_allocated_bytes(pool);
+	peak = std::max(peak, bytes);
+
+	if (_highWaterMark && bytes > _highWaterMark) {
+		engine_pool_destroy(pool, _threadLocalPool);
+		++ _poolStats.recreated;
+		return nullptr;
+	}
+
+	memory::pool::clear(pool);
+	return pool;
+}
+
+void Engine::releasePools() {
+	if (_pool && (!_internal || _internal->pool != _pool)) {
+		engine_pool_destroy(_pool, _threadLocalPool);
+	}
+	_pool = nullptr;
+
+	if (_renderPool) {
+		engine_pool_destroy(_renderPool, _threadLocalPool);
+		_renderPool = nullptr;
+	}
+}
+
+void Engine::prepare() {
+	if (_internal) {
+		_internal->prepare();
+	}
+}
+
+void Engine::setQuotesLanguage(QuotesLanguage l) {
+	if (_internal) {
+		_internal->content.setQuotesLanguage(l);
+	}
+}
+QuotesLanguage Engine::getQuotesLanguage() const {
+	return (_internal)?_internal->content.getQuotesLanguage():QuotesLanguage::English;
+}
+
+bool Engine::update(size_t offset, size_t removedLen, const StringView &insertedText) {
+	if (_internal) {
+		return _internal->update(offset, removedLen, insertedText);
+	}
+	return false;
+}
+
+void Engine::setParseThreads(uint32_t n) {
+	if (_internal) {
+		_internal->threads = std::max(n, uint32_t(1));
+	}
+}
+
+uint32_t Engine::getParseThreads() const {
+	return _internal ? _internal->threads : 1;
+}
+
+void Engine::setSearchTargets(SearchTargets *targets) {
+	if (_internal) {
+		_internal->searchTargets = targets;
+		_internal->content.setSearchTargets(targets);
+	}
+}
+
+SearchTargets *Engine::getSearchTargets() const {
+	return _internal ? _internal->searchTargets.get() : nullptr;
+}
+
+void Engine::setTransclusion(Transclusion *t) {
+	_transclusion = t;
+	if (_internal) {
+		_internal->transclusion = t;
+	}
+}
+
+Transclusion *Engine::getTransclusion() const {
+	return _transclusion.get();
+}
+
+void Engine::setScanMode(ScanMode mode) {
+	if (_internal) {
+		_internal->scanMode = mode;
+	}
+}
+
+auto Engine::getScanMode() const -> ScanMode {
+	return _internal ? _internal->scanMode : ScanMode::Full;
+}
+
+void Engine::setLazyBlocks(bool value) {
+	if (_internal) {
+		_internal->lazyBlocks = value;
+	}
+}
+
+bool Engine::isLazyBlocks() const {
+	return _internal ? _internal->lazyBlocks : false;
+}
+
+void Engine::setStatsEnabled(bool value) {
+	if (_internal) {
+		_internal->statsEnabled = value;
+	}
+}
+
+bool Engine::isStatsEnabled() const {
+	return _internal ? _internal->statsEnabled : false;
+}
+
+const Engine::Stats &Engine::getStats() const {
+	static Stats s_empty;
+	return _internal ? _internal->stats : s_empty;
+}
+
+StringView Engine::getSource() const {
+	if (_internal) {
+		_internal->flushEdits();
+		return _internal->source;
+	}
+	return StringView();
+}
+
+void Engine::process(const ProcessCallback &cb) {
+	if (_internal) {
+		if (_reusable) {
+			if (!_renderPool) {
+				_renderPool = engine_pool_create(_poolParent, _threadLocalPool);
+			}
+			_internal->process(cb, _renderPool);
+			_renderPool = recyclePool(_renderPool, _poolStats.renderBytes, _poolStats.peakRenderBytes);
+			++ _poolStats.renders;
+		} else {
+			_internal->process(cb);
+		}
 	}
 }
 
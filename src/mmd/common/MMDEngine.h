@@ -43,32 +43,189 @@
 #define MMD_COMMON_MMDENGINE_H_
 
 #include "SPRef.h"
+#include "SPIO.h"
 #include "MMDCommon.h"
+#include "MMDTransclusion.h"
 
 NS_MMD_BEGIN
 
 class Engine : public Ref {
 public:
 	using ProcessCallback = Function<void(const Content &, const StringView &, const Token &)>;
+	using BlockCallback = Function<void(const StringView &, const Token &)>;
+
+	// Parsing and export statistics, collected only when enabled with setStatsEnabled
+	// Time is wall time in nanoseconds. For parallel parsing, time and counters of all workers are summed.
+	struct Stats {
+		uint64_t tokenizeTime = 0;
+		uint64_t parseTime = 0; // block parsing (lemon)
+		uint64_t pairTime = 0; // ambidextrous tokens and token pairing
+		uint64_t contentTime = 0; // definitions, headers, tables
+		uint64_t searchTime = 0; // automatic abbreviations and glossary search
+		uint64_t exportTime = 0; // all `process` calls
+
+		size_t sourceBytes = 0;
+		size_t transcludedBytes = 0; // source of fragment blocks, copied from transclusion cache
+		size_t lexTokens = 0; // tokens, produced by tokenizer
+		size_t treeTokens = 0; // tokens in parsed tree
+		size_t blocks = 0; // top-level blocks
+		size_t treeDepth = 0; // max depth of parsed tree
+		uint32_t recursionDepth = 0; // max nesting depth of block parser, containers below 1000 levels are not parsed
+
+		size_t parseBytes = 0; // memory, used by parsed tree and content
+		size_t exportBytes = 0; // memory, used by last `process` call
+		size_t exports = 0; // number of `process` calls
+	};
+
+	// Fast scan modes for indexing
+	enum class ScanMode {
+		Full,
+		Metadata, // only metadata block at the start of document
+		Outline, // metadata and top-level blocks, that can contain headers
+	};
+
+	struct PoolStats {
+		size_t documents = 0; // documents, parsed in recycled pool
+		size_t renders = 0; // renders with recycled pool
+		size_t recreated = 0; // pools, released on reset because of high-water mark
+		size_t documentBytes = 0; // memory, used by last document
+		size_t renderBytes = 0; // memory, used by last render
+		size_t peakDocumentBytes = 0;
+		size_t peakRenderBytes = 0;
+	};
+
+	// Release memory of thread-local pool, used by engines without explicit pool.
+	// Only possible when there is no live engines on this thread, returns false otherwise.
+	static bool trimThreadPool();
 
 	~Engine();
 
 	bool init(memory::pool_t *, const StringView &, const Extensions & = DefaultExtensions);
 	bool init(const StringView &, const Extensions & = DefaultExtensions);
 
+	// Parse file directly from read-only memory mapping, without copying it into memory.
+	// Mapped file should not be truncated or rewritten while engine is alive, access to truncated part
+	// of mapping terminates the process with SIGBUS. Use `init` with file contents for files, that can
+	// be changed by other writers.
+	bool initFromFile(memory::pool_t *, const StringView &path, const Extensions & = DefaultExtensions);
+	bool initFromFile(const StringView &path, const Extensions & = DefaultExtensions);
+
+	// Streaming input: source is added with `write` or `read`, every completed top-level block is
+	// passed to callback as soon as next block starts. References (links, footnotes, abbreviations,
+	// glossary) are resolved on `finalize` (or on first `process`), after the end of input.
+	// Block is emitted, when the first line of the next block is written. Callback receives only the
+	// source and the parsed block token, not Content: references in the block are not resolved yet,
+	// so it can be used for early inspection, not for final rendering. Whole written text and tree are
+	// kept until the engine is cleared, so memory use is the same as for `init`; buffer is moved on
+	// growth, so source view is valid only within the callback. Input is limited to 4 GiB.
+	bool initStream(memory::pool_t *, const Extensions & = DefaultExtensions, const BlockCallback & = nullptr);
+	bool initStream(const Extensions & = DefaultExtensions, const BlockCallback & = nullptr);
+
+	bool write(const StringView &);
+	bool read(const io::Producer &); // read until end of data
+	bool read(int fd); // read until EOF
+
+	bool finalize();
+
 	void clear();
 
 	void setQuotesLanguage(QuotesLanguage);
 	QuotesLanguage getQuotesLanguage() const;
 
+	// Apply edit to source text: removedLen bytes at offset replaced with insertedText
+	// Only affected top-level blocks are parsed again, the rest of the parsed tree is reused.
+	// Engine switches to its own copy of the source on first update. Edits are only applied to text,
+	// parsed tree is updated once for all pending edits on next `process` or `getSource` call.
+	bool update(size_t offset, size_t removedLen, const StringView &insertedText);
+
+	StringView getSource() const;
+
+	// Parse large documents with multiple threads, source is split on top-level block boundaries,
+	// that can be parsed independently. Output is the same as for single thread. Worker threads are
+	// shared by all engines and kept between parses, calling thread parses its share of chunks too.
+	void setParseThreads(uint32_t);
+	uint32_t getParseThreads() const;
+
+	// Collect parsing and export statistics, should be enabled before parsing
+	// Stats are reset on full parse and can be read after `process`
+	void setStatsEnabled(bool);
+	bool isStatsEnabled() const;
+	const Stats &getStats() const;
+
+	// Scan mode should be set before parsing. Scanned blocks are parsed the same way as in full document,
+	// other blocks are skipped, as well as automatic abbreviations and glossary search, so parsed tree
+	// contains only scanned blocks. Use Content in `process` callback: metadata with getMetaDict, outline
+	// with getHeaders, header ids are links with Header origin. Cache can not be written in scan mode,
+	// streaming input is always parsed completely.
+	void setScanMode(ScanMode);
+	ScanMode getScanMode() const;
+
+	// After `update`, positions in subtrees of top-level blocks after the edit are shifted lazily. By default
+	// all pending shifts are applied before `process` callback. With lazy blocks, tree is passed as is, and
+	// callback should call Content::resolveShift for top-level block before reading positions inside it
+	// (HtmlProcessor does it for every exported block), so blocks, served from fragment cache, are not walked.
+	void setLazyBlocks(bool);
+	bool isLazyBlocks() const;
+
+	// Prebuilt abbreviations and glossary, shared between documents. Only document-local definitions
+	// are compiled on parsing, shared automaton is used as is. Should be set before parsing.
+	void setSearchTargets(SearchTargets *);
+	SearchTargets *getSearchTargets() const;
+
+	// Fragments for `{{path}}` markers with Extensions::Transclude, shared between documents. Kept by engine
+	// for all next documents, should be set before parsing. Without shared cache, fragments are read from
+	// filesystem for every document. Relative paths are resolved against directory of file for initFromFile.
+	// Source is replaced with transcluded text, so offsets for `update` are offsets in transcluded text.
+	// Transclusion is not performed for streaming input.
+	void setTransclusion(Transclusion *);
+	Transclusion *getTransclusion() const;
+
+	// Reusable mode for batch processing: pools are cleared in place on init/clear and render,
+	// instead of being destroyed, so memory blocks are reused by the next document. Pool, that used
+	// more then highWaterMark bytes (0 - no limit) is released on reset. Disabling the mode releases
+	// retained pools.
+	void setReusable(bool, size_t highWaterMark = 0);
+	bool isReusable() const;
+
+	const PoolStats &getPoolStats() const;
+
+	// Binary cache of parsed tree and processed content. Cache can be loaded instead of parsing
+	// only for the same source, extensions and search targets, otherwise it's rejected and loadCache
+	// returns false. Search targets should be set before cache is written or loaded.
+	uint64_t getCacheKey() const; // source hash, extensions and targets, can be used as cache file name
+	bool writeCache(std::ostream &);
+	bool saveCache(const StringView &path);
+	bool loadCache(const uint8_t *, size_t);
+	bool loadCache(const StringView &path); // memory-mapped
+
 	void process(const ProcessCallback &);
 
 protected:
+	friend class Transclusion;
+
+	// Fragment of transclusion: metadata is dropped, nested fragments are expanded, then only blocks
+	// between first and last safe block boundaries are parsed, without content processing
+	bool initFragment(Transclusion *, Transclusion::Fragment *, const StringView &, const Extensions &);
+
 	void prepare();
 
+	memory::pool_t *acquirePool(memory::pool_t *parent, bool threadLocal);
+	memory::pool_t *recyclePool(memory::pool_t *, size_t &bytes, size_t &peak);
+	void releasePools();
+
 	struct Internal;
 
 	Internal *_internal = nullptr;
+
+	Rc<Transclusion> _transclusion;
+
+	memory::pool_t *_pool = nullptr; // retained document pool in reusable mode
+	memory::pool_t *_renderPool = nullptr;
+	memory::pool_t *_poolParent = nullptr;
+	bool _threadLocalPool = false;
+	bool _reusable = false;
+	size_t _highWaterMark = 0;
+	PoolStats _poolStats;
 };
 
 NS_MMD_END
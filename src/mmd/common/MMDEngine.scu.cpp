@@ -26,8 +26,11 @@ THE SOFTWARE.
 #include "SPCommon.h"
 #include "engine.cc"
 #include "MMDAhoCorasick.cc"
+#include "MMDCache.cc"
 #include "MMDChars.cc"
 #include "MMDContent.cc"
 #include "MMDEngine.cc"
+#include "MMDSearchTargets.cc"
 #include "MMDToken.cc"
 #include "MMDTokenPair.cc"
+#include "MMDTransclusion.cc"
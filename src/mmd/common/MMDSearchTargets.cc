@@ -0,0 +1,223 @@
+/**
+Copyright (c) 2017 Roman Katuntsev <sbkarr@stappler.org>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+**/
+
+#include "SPCommon.h"
+#include "MMDSearchTargets.h"
+#include "MMDCache.h"
+#include "SPFilesystem.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fstream>
+
+NS_MMD_BEGIN
+
+static constexpr char s_targetsMagic[8] = { 'M', 'M', 'D', 'T', 'E', 'R', 'M', 'S' };
+
+SearchTargets::~SearchTargets() {
+	clear();
+}
+
+bool SearchTargets::init(const StringView &source, const Extensions &ext) {
+	if (!initSource(source, ext)) {
+		return false;
+	}
+
+	return prepare();
+}
+
+bool SearchTargets::initFromFile(const StringView &path, const Extensions &ext) {
+	auto data = filesystem::readFile(path);
+	if (data.empty()) {
+		return false;
+	}
+
+	return init(StringView((const char *)data.data(), data.size()), ext);
+}
+
+bool SearchTargets::load(const uint8_t *data, size_t size) {
+	Header header;
+	if (size < sizeof(Header)) {
+		return false;
+	}
+
+	memcpy(&header, data, sizeof(Header));
+	if (memcmp(header.magic, s_targetsMagic, sizeof(s_targetsMagic)) != 0 || header.version != Version
+			|| header.byteOrder != Cache::ByteOrderMark || header.sourceSize > size - sizeof(Header)
+			|| header.cacheSize > size - sizeof(Header) - header.sourceSize) {
+		return false;
+	}
+
+	auto source = StringView((const char *)data + sizeof(Header), header.sourceSize);
+	auto cache = data + sizeof(Header) + header.sourceSize;
+	auto trie = cache + header.cacheSize;
+
+	if (!initSource(source, Extensions(Extensions::Value(header.extensions)))) {
+		return false;
+	}
+
+	if (!_engine.loadCache(cache, header.cacheSize)) {
+		clear();
+		return false;
+	}
+
+	memory::pool::push(_pool);
+	_trie = new (_pool) Trie();
+	auto ret = _trie->read(trie, size - (trie - data)) > 0;
+	memory::pool::pop();
+
+	if (!ret) {
+		clear();
+		return false;
+	}
+
+	return prepare();
+}
+
+bool SearchTargets::load(const StringView &path) {
+	bool ret = false;
+	int fd = ::open(String(path.data(), path.size()).data(), O_RDONLY);
+	if (fd >= 0) {
+		struct stat st;
+		if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+			auto addr = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+			if (addr != MAP_FAILED) {
+				ret = load((const uint8_t *)addr, size_t(st.st_size));
+				munmap(addr, size_t(st.st_size));
+			}
+		}
+		::close(fd);
+	}
+	return ret;
+}
+
+bool SearchTargets::write(std::ostream &stream) {
+	if (!_trie) {
+		return false;
+	}
+
+	// engine cache is written into temporary stream to get its size
+	StringStream cache;
+	if (!_engine.writeCache(cache)) {
+		return false;
+	}
+
+	auto cacheData = cache.str();
+
+	Header header;
+	memset(&header, 0, sizeof(Header));
+	memcpy(header.magic, s_targetsMagic, sizeof(s_targetsMagic));
+	header.version = Version;
+	header.byteOrder = Cache::ByteOrderMark;
+	header.extensions = toInt(_content->getExtensions().flags);
+	header.sourceSize = _source.size();
+	header.cacheSize = cacheData.size();
+
+	stream.write((const char *)&header, sizeof(Header));
+	stream.write(_source.data(), _source.size());
+	stream.write(cacheData.data(), cacheData.size());
+	_trie->write(stream);
+	return stream.good();
+}
+
+bool SearchTargets::save(const StringView &path) {
+	std::ofstream stream(String(path.data(), path.size()).data(), std::ios::binary);
+	if (!stream.is_open()) {
+		return false;
+	}
+
+	return write(stream);
+}
+
+StringView SearchTargets::getSource() const {
+	return _source;
+}
+
+const Trie *SearchTargets::getTrie() const {
+	return _trie;
+}
+
+uint64_t SearchTargets::getDigest() const {
+	if (!_content) {
+		return 0;
+	}
+	return (Cache::hash(_source) + 0x9E3779B97F4A7C15ULL * (uint64_t(toInt(_content->getExtensions().flags)) + 1)) | 1;
+}
+
+const Content::Footnote *SearchTargets::getAbbreviation(const StringView &str) const {
+	return _content ? _content->getAbbreviation(str) : nullptr;
+}
+
+const Content::Footnote *SearchTargets::getGlossary(const StringView &str) const {
+	return _content ? _content->getGlossary(str) : nullptr;
+}
+
+bool SearchTargets::initSource(const StringView &source, const Extensions &ext) {
+	clear();
+
+	_pool = memory::pool::create(nullptr);
+
+	// own null-terminated copy of source
+	auto buf = (char *)memory::pool::palloc(_pool, source.size() + 1);
+	memcpy(buf, source.data(), source.size());
+	buf[source.size()] = 0;
+	_source = StringView(buf, source.size());
+
+	return _engine.init(_pool, _source, ext);
+}
+
+bool SearchTargets::prepare() {
+	_engine.process([&] (const Content &c, const StringView &, const Token &) {
+		_content = &c;
+	});
+
+	if (!_content) {
+		clear();
+		return false;
+	}
+
+	if (!_trie) {
+		memory::pool::push(_pool);
+		_trie = new (_pool) Trie();
+		_content->addSearchTargets(*_trie);
+		_trie->prepare();
+		memory::pool::pop();
+	}
+
+	return true;
+}
+
+void SearchTargets::clear() {
+	_engine.clear();
+	_content = nullptr;
+	_trie = nullptr;
+	_source = StringView();
+
+	if (_pool) {
+		memory::pool::destroy(_pool);
+		_pool = nullptr;
+	}
+}
+
+NS_MMD_END
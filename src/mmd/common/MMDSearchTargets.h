@@ -0,0 +1,87 @@
+/**
+Copyright (c) 2017 Roman Katuntsev <sbkarr@stappler.org>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+**/
+
+#ifndef MMD_COMMON_MMDSEARCHTARGETS_H_
+#define MMD_COMMON_MMDSEARCHTARGETS_H_
+
+#include "MMDEngine.h"
+#include "MMDContent.h"
+#include "MMDAhoCorasick.h"
+
+NS_MMD_BEGIN
+
+/// Prebuilt abbreviations and glossary, shared between documents
+///
+/// Targets are collected from definitions in markdown source and compiled into search automaton once.
+/// Targets can be saved with parsed definitions and prepared automaton, so loading does not require
+/// parsing or building. After init or load targets are immutable, and can be used by multiple engines
+/// on different threads. Local definitions of the document override shared ones.
+class SearchTargets : public Ref {
+public:
+	static constexpr uint32_t Version = 1;
+
+	~SearchTargets();
+
+	bool init(const StringView &source, const Extensions & = DefaultExtensions);
+	bool initFromFile(const StringView &path, const Extensions & = DefaultExtensions);
+
+	bool load(const uint8_t *, size_t);
+	bool load(const StringView &path); // memory-mapped
+
+	// not thread-safe, should not be called when targets are in use
+	bool write(std::ostream &);
+	bool save(const StringView &path);
+
+	StringView getSource() const;
+	const Trie *getTrie() const;
+
+	// digest of definitions source and extensions, never 0 for initialized targets
+	uint64_t getDigest() const;
+
+	const Content::Footnote *getAbbreviation(const StringView &) const;
+	const Content::Footnote *getGlossary(const StringView &) const;
+
+protected:
+	struct Header {
+		char magic[8]; // "MMDTERMS"
+		uint32_t version;
+		uint32_t byteOrder;
+		uint32_t extensions;
+		uint32_t reserved;
+		uint64_t sourceSize;
+		uint64_t cacheSize;
+	};
+
+	bool initSource(const StringView &, const Extensions &);
+	bool prepare();
+	void clear();
+
+	memory::pool_t *_pool = nullptr;
+	StringView _source;
+	Engine _engine;
+	const Content *_content = nullptr;
+	Trie *_trie = nullptr;
+};
+
+NS_MMD_END
+
+#endif /* MMD_COMMON_MMDSEARCHTARGETS_H_ */
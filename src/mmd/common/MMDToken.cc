@@ -112,13 +112,48 @@ void Token::describeTree(std::ostream &stream, const StringView &source) {
 
 Token::Token(token *t) : _token(t) { }
 
+static thread_local TokenArena *tl_arena = nullptr;
+
+TokenArena *TokenArena::get() {
+	return tl_arena;
+}
+
+TokenArena::TokenArena(memory::pool_t *p) : _pool(p) { }
+
+token *TokenArena::alloc() {
+	if (_blockUsed == BlockSize) {
+		_block = (token *)memory::pool::palloc(_pool, sizeof(token) * BlockSize);
+		_blockUsed = 0;
+		++ _blocks;
+	}
+	++ _allocated;
+	return _block + (_blockUsed ++);
+}
+
+void TokenArena::push() {
+	_prev = tl_arena;
+	tl_arena = this;
+}
+
+void TokenArena::pop() {
+	tl_arena = _prev;
+	_prev = nullptr;
+}
+
 extern "C" {
 
 using token = _sp_mmd_token;
 
+static token * sp_mmd_token_alloc() {
+	if (auto arena = TokenArena::get()) {
+		return arena->alloc();
+	}
+	return (token *)memory::pool::palloc(memory::pool::acquire(), sizeof(token));
+}
+
 /// Get pointer to a new token
 token * sp_mmd_token_new(unsigned short type, uint32_t start, uint32_t len) {
-	token * t = (token *)memory::pool::palloc(memory::pool::acquire(), sizeof(token));
+	token * t = sp_mmd_token_alloc();
 
 	if (t) {
 		t->type = type;
@@ -144,7 +179,7 @@ token * sp_mmd_token_new(unsigned short type, uint32_t start, uint32_t len) {
 
 /// Duplicate an existing token
 token * sp_mmd_token_copy(token * original) {
-	token * t = (token *)memory::pool::palloc(memory::pool::acquire(), sizeof(token));
+	token * t = sp_mmd_token_alloc();
 
 	if (t) {
 		* t = * original;
@@ -255,9 +290,9 @@ void sp_mmd_token_remove_last_child(token * parent) {
 	if (t->prev) {
 		t->prev->next = NULL;
 		parent->child->tail = t->prev;
-	}
 
-	sp_mmd_token_free(t);
+		sp_mmd_token_free(t);
+	}
 }
 
 
@@ -272,9 +307,9 @@ void sp_mmd_token_remove_tail(token * head) {
 	if (t->prev) {
 		t->prev->next = NULL;
 		head->tail = t->prev;
-	}
 
-	sp_mmd_token_free(t);
+		sp_mmd_token_free(t);
+	}
 }
 
 
@@ -375,7 +410,8 @@ token * sp_mmd_token_prune_graft(token * first, token * last, unsigned short con
 }
 
 
-/// Free token
+/// Free token with it's children
+/// Tokens are released with their pool; pruned tokens may still be referenced by the caller
 void sp_mmd_token_free(token * t) {
 	return;
 }
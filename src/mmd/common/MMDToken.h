@@ -68,6 +68,44 @@ protected:
 	token *_token = nullptr;
 };
 
+/// Block allocator for parse tree tokens
+///
+/// Tokens are placed into blocks, allocated from the owner's pool, instead of separate
+/// palloc calls. This only reduces allocation calls: token layout is not changed, links
+/// are still pointers, and memory used by a parse tree is not reduced. Tokens are never
+/// recycled, sp_mmd_token_free and tokens_prune are no-ops, so pruned tokens stay valid
+/// until the pool is destroyed. Arena should be activated with push() to be used by
+/// sp_mmd_token_* functions on the current thread.
+class TokenArena {
+public:
+	static constexpr size_t BlockSize = 1024;
+
+	/// Current arena for this thread, or nullptr if tokens should be allocated from current pool
+	static TokenArena *get();
+
+	TokenArena(memory::pool_t *);
+
+	TokenArena(const TokenArena &) = delete;
+	TokenArena &operator=(const TokenArena &) = delete;
+
+	token *alloc();
+
+	void push();
+	void pop();
+
+	size_t getAllocated() const { return _allocated; } // tokens allocated
+	size_t getBlocks() const { return _blocks; }
+
+protected:
+	memory::pool_t *_pool = nullptr;
+	TokenArena *_prev = nullptr;
+
+	token *_block = nullptr;
+	size_t _blockUsed = BlockSize;
+	size_t _blocks = 0;
+	size_t _allocated = 0;
+};
+
 NS_MMD_END
 
 #endif /* MMD_COMMON_MMDTOKEN_H_ */
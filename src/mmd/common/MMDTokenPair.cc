@@ -46,30 +46,46 @@
 
 NS_MMD_BEGIN
 
-TokenPair::TokenPair() {
-	memset(this, 0, sizeof(TokenPair));
-}
+constexpr void TokenPair::add(uint8_t open_type, uint8_t close_type, uint8_t type, uint8_t options) {
+	if (open_type >= kMaxTokenTypes || close_type >= kMaxTokenTypes) {
+		return;
+	}
+
+	// Assign classes for token types on first use, number of classes is checked with static_assert
+	auto &open = classes[open_type].open;
+	if (!open && openers < kMaxPairClasses) {
+		open = ++ openers;
+	}
 
-void TokenPair::add(uint8_t open_type, uint8_t close_type, uint8_t type, Options options) {
-	if (open_type > 255 || close_type > 255 || type > 255) {
-		std::cout << "Warn - too large\n";
+	auto &close = classes[close_type].close;
+	if (!close && closers < kMaxPairClasses) {
+		close = ++ closers;
 	}
-	// \todo: This needs to be more sophisticated
-	can_open_pair[open_type] = 1;
-	can_close_pair[close_type] = 1;
-	(pair_type)[open_type][close_type] = type;
 
-	if ((options & Options::AllowEmpty) != Options::None) {
-		empty_allowed[type] = true;
+	if (!open || !close) {
+		return;
 	}
 
-	if ((options & Options::MatchLength) != Options::None) {
-		match_len[type] = true;
+	// Options are defined per pair type, merge with options from other pairs of the same type
+	for (uint8_t i = 0; i < openers; ++ i) {
+		for (uint8_t j = 0; j < closers; ++ j) {
+			if (pairs[i][j].type == type) {
+				options |= pairs[i][j].options;
+			}
+		}
 	}
 
-	if ((options & Options::PruneMatch) != Options::None) {
-		should_prune[type] = true;
+	for (uint8_t i = 0; i < openers; ++ i) {
+		for (uint8_t j = 0; j < closers; ++ j) {
+			if (pairs[i][j].type == type) {
+				pairs[i][j].options = options;
+			}
+		}
 	}
+
+	pairs[open - 1][close - 1].type = type;
+	pairs[open - 1][close - 1].options = options;
+	++ pairs_count;
 }
 
 static void token_pair_mate(token * a, token * b) {
@@ -85,6 +101,74 @@ static void token_pair_mate(token * a, token * b) {
 }
 /// Mate opener and closer together
 
+/// Lower bound of opener stack for specific closer type
+///
+/// All openers below `bottom` were already checked for this closer and can not match it,
+/// so the next search can stop there. Openers are only pushed and popped from the top,
+/// and pairing conditions depends only on token types (and lengths), so bound remains valid
+/// until stack is popped below it. Each opener is examined O(1) amortized times for
+/// each closer type.
+struct TokenPairBottom {
+	static constexpr size_t kMaxEntries = 16;
+
+	struct Entry {
+		uint16_t type; // closer type
+		uint16_t len; // closer length, if bound was limited by match_len, 0 for any length
+		uint32_t bottom;
+	};
+
+	size_t get(const token * t, size_t start) const {
+		for (size_t i = 0; i < count; ++ i) {
+			auto &it = entries[i];
+			if (it.type == t->type && (it.len == 0 || it.len == t->len)) {
+				return std::max(size_t(it.bottom), start);
+			}
+		}
+		return start;
+	}
+
+	void set(const token * t, bool withLength, size_t bottom) {
+		Entry *e = nullptr;
+		for (size_t i = 0; i < count; ++ i) {
+			if (entries[i].type == t->type) {
+				e = &entries[i];
+				break;
+			}
+		}
+
+		if (!e) {
+			if (count < kMaxEntries) {
+				e = &entries[count ++];
+			} else {
+				e = &entries[(next ++) % kMaxEntries];
+			}
+		}
+
+		if (withLength && t->len > maxOf<uint16_t>()) {
+			// length can not be stored, bound can not be used
+			e->type = maxOf<uint16_t>();
+			return;
+		}
+
+		e->type = t->type;
+		e->len = withLength ? uint16_t(t->len) : 0;
+		e->bottom = uint32_t(bottom);
+	}
+
+	// stack was popped to `size`
+	void trim(size_t size) {
+		for (size_t i = 0; i < count; ++ i) {
+			if (entries[i].bottom > size) {
+				entries[i].bottom = uint32_t(size);
+			}
+		}
+	}
+
+	Entry entries[kMaxEntries];
+	size_t count = 0;
+	size_t next = 0;
+};
+
 void TokenPair::match(const Token &tparent, Vector<Token> &stack, uint16_t depth) const {
 	// Avoid stack overflow in "pathologic" input
 	if (depth == kMaxPairRecursiveDepth) {
@@ -98,56 +182,48 @@ void TokenPair::match(const Token &tparent, Vector<Token> &stack, uint16_t depth
 	// Counter
 	size_t start_counter = stack.size();
 	size_t i;				// We're sharing one stack, so any opener earlier than this belongs to a parent
+	size_t bottom;
+	bool length_skipped;
 
 	token * peek;
 	uint8_t type;
 
-	unsigned int opener_count[kMaxTokenTypes] = {0};	// Keep track of which token types are on the stack
+	TokenPairBottom openers_bottom;
 	while (walker != NULL) {
 		if (walker->child) {
 			match(Token(walker), stack, depth + 1);
 		}
 
 		// Is this a closer?
-		if (walker->can_close && can_close_pair[walker->type] && walker->unmatched ) {
+		if (walker->can_close && classes[walker->type].close && walker->unmatched ) {
 			i = stack.size();
+			bottom = openers_bottom.get(walker, start_counter);
+			length_skipped = false;
 
-			// Do we even have a valid opener in the stack?
-			// It's only worth checking if the stack is beyond a certain size
-			if (i > start_counter + kLargeStackThreshold) {
-				for (int j = 0; j < kMaxTokenTypes; ++j) {
-					if (opener_count[j]) {
-						if (pair_type[j][walker->type]) {
-							goto close;
-						}
-					}
-				}
-
-				// No opener available for this as closer
-				goto open;
-			}
+			const uint8_t closer = classes[walker->type].close - 1;
 
-close:
 			// Find matching opener for this closer
-			while (i > start_counter) {
+			while (i > bottom) {
 				peek = stack.at(i - 1).getToken();
 
-				type = pair_type[peek->type][walker->type];
+				auto &pair = pairs[classes[peek->type].open - 1][closer];
+				type = pair.type;
 
 				if (type) {
-					if (!empty_allowed[type]) {
+					if (!(pair.options & AllowEmpty)) {
 						// Make sure they aren't consecutive tokens
 						if ((peek->next == walker) &&
 						        (peek->start + peek->len == walker->start)) {
-							// i--;
-							i = start_counter;	// In this situation, we can't use this token as a closer
-							continue;
+							// In this situation, we can't use this token as a closer
+							// Stack below was not checked, so bottom is not updated
+							goto open;
 						}
 					}
 
-					if (match_len[type]) {
+					if (pair.options & MatchLength) {
 						// Lengths must match
 						if (peek->len != walker->len) {
+							length_skipped = true;
 							i--;
 							continue;
 						}
@@ -156,150 +232,196 @@ close:
 					token_pair_mate(peek, walker);
 
 					// Clear portion of stack between opener and closer as they are now unavailable for mating
-					while (stack.size() > (i - 1)) {
-						peek = stack.back().getToken();
-						stack.pop_back();
-						opener_count[peek->type]--;
-					}
+					stack.resize(i - 1);
+					openers_bottom.trim(i - 1);
 
-					#ifndef NDEBUG
-					//fprintf(stderr, "stack now sized %lu\n", stack.size());
-					#endif
 					// Prune matched section
 
-					if (should_prune[type]) {
+					if (pair.options & PruneMatch) {
 						if (peek->prev == NULL) {
-							walker = sp_mmd_token_prune_graft(peek, walker, pair_type[peek->type][walker->type]);
+							walker = sp_mmd_token_prune_graft(peek, walker, type);
 							parent->child = walker;
 						} else {
-							walker = sp_mmd_token_prune_graft(peek, walker, pair_type[peek->type][walker->type]);
+							walker = sp_mmd_token_prune_graft(peek, walker, type);
 						}
 					}
 
-					break;
-				}
-
-				#ifndef NDEBUG
-				else {
-					//fprintf(stderr, "token type %d failed to match stack element\n", walker->type);
+					goto open;
 				}
 
-				#endif
 				i--;
 			}
+
+			// No opener available for this closer in current stack
+			openers_bottom.set(walker, length_skipped, stack.size());
 		}
 
 open:
 
 		// Is this an opener?
-		if (walker->can_open && can_open_pair[walker->type] && walker->unmatched) {
+		if (walker->can_open && classes[walker->type].open && walker->unmatched) {
 			stack.push_back(walker);
-			opener_count[walker->type]++;
-			#ifndef NDEBUG
-			//fprintf(stderr, "push token type %d to stack (%lu elements)\n", walker->type, stack.size());
-			#endif
 		}
 
 		walker = walker->next;
 	}
 
-	#ifndef NDEBUG
-	//fprintf(stderr, "token stack has %lu elements (of %lu)\n", stack.size(), stack.capacity());
-	#endif
-
 	// Remove unused tokens from stack and return to parent
 	stack.resize(start_counter);
 }
 
-struct TokenPairEngineNode {
-	Extensions ext;
-	TokenPairEngine engine;
+/// Pairing rules, tables for each pass are generated from rules at compile time
+struct TokenPairRule {
+	uint8_t pass;
+	uint8_t open;
+	uint8_t close;
+	uint8_t type;
+	uint8_t options;
+	uint32_t require; // rule is used only when all of this extensions are enabled
+	uint32_t exclude; // rule is not used when any of this extensions is enabled
 };
 
-std::mutex s_engineMutex;
-std::map<Extensions::Value, TokenPairEngine> s_engineMap;
-
-TokenPairEngine *TokenPairEngine::engineForExtensions(Extensions::Value extensions) {
-	extensions &= (Extensions::Critic | Extensions::Notes | Extensions::Compatibility);
-
-	s_engineMutex.lock();
+static constexpr uint8_t TokenPairEmptyPrune = uint8_t(TokenPair::AllowEmpty) | uint8_t(TokenPair::PruneMatch);
+static constexpr uint8_t TokenPairEmptyLength = uint8_t(TokenPair::AllowEmpty) | uint8_t(TokenPair::MatchLength);
+static constexpr uint8_t TokenPairPruneLength = uint8_t(TokenPair::PruneMatch) | uint8_t(TokenPair::MatchLength);
+static constexpr uint8_t TokenPairPrune = uint8_t(TokenPair::PruneMatch);
+static constexpr uint8_t TokenPairNone = uint8_t(TokenPair::None);
 
-	auto it = s_engineMap.find(extensions);
-	if (it == s_engineMap.end()) {
-		it = s_engineMap.emplace(extensions, extensions).first;
-	}
+static constexpr uint32_t TokenPairCritic = uint32_t(Extensions::Critic);
+static constexpr uint32_t TokenPairNotes = uint32_t(Extensions::Notes);
+static constexpr uint32_t TokenPairCompatibility = uint32_t(Extensions::Compatibility);
 
-	auto ret = &(it->second);
-	s_engineMutex.unlock();
-	return ret;
-}
-
-TokenPairEngine::TokenPairEngine(Extensions::Value extensions) {
+static constexpr TokenPairRule s_tokenPairRules[] = {
 	// CriticMarkup
-	if ((extensions & Extensions::Critic) != Extensions::None) {
-		pairings1.add(CRITIC_ADD_OPEN, CRITIC_ADD_CLOSE, PAIR_CRITIC_ADD, TokenPair::Options::AllowEmpty | TokenPair::Options::PruneMatch);
-		pairings1.add(CRITIC_DEL_OPEN, CRITIC_DEL_CLOSE, PAIR_CRITIC_DEL, TokenPair::Options::AllowEmpty | TokenPair::Options::PruneMatch);
-		pairings1.add(CRITIC_COM_OPEN, CRITIC_COM_CLOSE, PAIR_CRITIC_COM, TokenPair::Options::AllowEmpty | TokenPair::Options::PruneMatch);
-		pairings1.add(CRITIC_SUB_OPEN, CRITIC_SUB_DIV_A, PAIR_CRITIC_SUB_DEL, TokenPair::Options::AllowEmpty | TokenPair::Options::PruneMatch);
-		pairings1.add(CRITIC_SUB_DIV_B, CRITIC_SUB_CLOSE, PAIR_CRITIC_SUB_ADD, TokenPair::Options::AllowEmpty | TokenPair::Options::PruneMatch);
-		pairings1.add(CRITIC_HI_OPEN, CRITIC_HI_CLOSE, PAIR_CRITIC_HI, TokenPair::Options::AllowEmpty | TokenPair::Options::PruneMatch);
-	}
+	{ 1, CRITIC_ADD_OPEN, CRITIC_ADD_CLOSE, PAIR_CRITIC_ADD, TokenPairEmptyPrune, TokenPairCritic, 0 },
+	{ 1, CRITIC_DEL_OPEN, CRITIC_DEL_CLOSE, PAIR_CRITIC_DEL, TokenPairEmptyPrune, TokenPairCritic, 0 },
+	{ 1, CRITIC_COM_OPEN, CRITIC_COM_CLOSE, PAIR_CRITIC_COM, TokenPairEmptyPrune, TokenPairCritic, 0 },
+	{ 1, CRITIC_SUB_OPEN, CRITIC_SUB_DIV_A, PAIR_CRITIC_SUB_DEL, TokenPairEmptyPrune, TokenPairCritic, 0 },
+	{ 1, CRITIC_SUB_DIV_B, CRITIC_SUB_CLOSE, PAIR_CRITIC_SUB_ADD, TokenPairEmptyPrune, TokenPairCritic, 0 },
+	{ 1, CRITIC_HI_OPEN, CRITIC_HI_CLOSE, PAIR_CRITIC_HI, TokenPairEmptyPrune, TokenPairCritic, 0 },
 
 	// HTML Comments
-	pairings2.add(HTML_COMMENT_START, HTML_COMMENT_STOP, PAIR_HTML_COMMENT, TokenPair::Options::AllowEmpty | TokenPair::Options::PruneMatch);
+	{ 2, HTML_COMMENT_START, HTML_COMMENT_STOP, PAIR_HTML_COMMENT, TokenPairEmptyPrune, 0, 0 },
 
 	// Brackets, Parentheses, Angles
-	pairings3.add(BRACKET_LEFT, BRACKET_RIGHT, PAIR_BRACKET, TokenPair::Options::AllowEmpty | TokenPair::Options::PruneMatch);
-
-	if ((extensions & Extensions::Notes) != Extensions::None) {
-		pairings3.add(BRACKET_CITATION_LEFT, BRACKET_RIGHT, PAIR_BRACKET_CITATION, TokenPair::Options::AllowEmpty | TokenPair::Options::PruneMatch);
-		pairings3.add(BRACKET_FOOTNOTE_LEFT, BRACKET_RIGHT, PAIR_BRACKET_FOOTNOTE, TokenPair::Options::AllowEmpty | TokenPair::Options::PruneMatch);
-		pairings3.add(BRACKET_GLOSSARY_LEFT, BRACKET_RIGHT, PAIR_BRACKET_GLOSSARY, TokenPair::Options::AllowEmpty | TokenPair::Options::PruneMatch);
-		pairings3.add(BRACKET_ABBREVIATION_LEFT, BRACKET_RIGHT, PAIR_BRACKET_ABBREVIATION, TokenPair::Options::AllowEmpty | TokenPair::Options::PruneMatch);
-	} else {
-		pairings3.add(BRACKET_CITATION_LEFT, BRACKET_RIGHT, PAIR_BRACKET, TokenPair::Options::AllowEmpty | TokenPair::Options::PruneMatch);
-		pairings3.add(BRACKET_FOOTNOTE_LEFT, BRACKET_RIGHT, PAIR_BRACKET, TokenPair::Options::AllowEmpty | TokenPair::Options::PruneMatch);
-		pairings3.add(BRACKET_GLOSSARY_LEFT, BRACKET_RIGHT, PAIR_BRACKET, TokenPair::Options::AllowEmpty | TokenPair::Options::PruneMatch);
-		pairings3.add(BRACKET_ABBREVIATION_LEFT, BRACKET_RIGHT, PAIR_BRACKET, TokenPair::Options::AllowEmpty | TokenPair::Options::PruneMatch);
-	}
+	{ 3, BRACKET_LEFT, BRACKET_RIGHT, PAIR_BRACKET, TokenPairEmptyPrune, 0, 0 },
+
+	{ 3, BRACKET_CITATION_LEFT, BRACKET_RIGHT, PAIR_BRACKET_CITATION, TokenPairEmptyPrune, TokenPairNotes, 0 },
+	{ 3, BRACKET_FOOTNOTE_LEFT, BRACKET_RIGHT, PAIR_BRACKET_FOOTNOTE, TokenPairEmptyPrune, TokenPairNotes, 0 },
+	{ 3, BRACKET_GLOSSARY_LEFT, BRACKET_RIGHT, PAIR_BRACKET_GLOSSARY, TokenPairEmptyPrune, TokenPairNotes, 0 },
+	{ 3, BRACKET_ABBREVIATION_LEFT, BRACKET_RIGHT, PAIR_BRACKET_ABBREVIATION, TokenPairEmptyPrune, TokenPairNotes, 0 },
+
+	{ 3, BRACKET_CITATION_LEFT, BRACKET_RIGHT, PAIR_BRACKET, TokenPairEmptyPrune, 0, TokenPairNotes },
+	{ 3, BRACKET_FOOTNOTE_LEFT, BRACKET_RIGHT, PAIR_BRACKET, TokenPairEmptyPrune, 0, TokenPairNotes },
+	{ 3, BRACKET_GLOSSARY_LEFT, BRACKET_RIGHT, PAIR_BRACKET, TokenPairEmptyPrune, 0, TokenPairNotes },
+	{ 3, BRACKET_ABBREVIATION_LEFT, BRACKET_RIGHT, PAIR_BRACKET, TokenPairEmptyPrune, 0, TokenPairNotes },
 
-	pairings3.add(BRACKET_VARIABLE_LEFT, BRACKET_RIGHT, PAIR_BRACKET_VARIABLE, TokenPair::Options::AllowEmpty | TokenPair::Options::PruneMatch);
+	{ 3, BRACKET_VARIABLE_LEFT, BRACKET_RIGHT, PAIR_BRACKET_VARIABLE, TokenPairEmptyPrune, 0, 0 },
 
-	pairings3.add(BRACKET_IMAGE_LEFT, BRACKET_RIGHT, PAIR_BRACKET_IMAGE, TokenPair::Options::AllowEmpty | TokenPair::Options::PruneMatch);
-	pairings3.add(PAREN_LEFT, PAREN_RIGHT, PAIR_PAREN, TokenPair::Options::AllowEmpty | TokenPair::Options::PruneMatch);
-	pairings3.add(ANGLE_LEFT, ANGLE_RIGHT, PAIR_ANGLE, TokenPair::Options::AllowEmpty | TokenPair::Options::PruneMatch);
-	pairings3.add(BRACE_DOUBLE_LEFT, BRACE_DOUBLE_RIGHT, PAIR_BRACES, TokenPair::Options::AllowEmpty | TokenPair::Options::PruneMatch);
+	{ 3, BRACKET_IMAGE_LEFT, BRACKET_RIGHT, PAIR_BRACKET_IMAGE, TokenPairEmptyPrune, 0, 0 },
+	{ 3, PAREN_LEFT, PAREN_RIGHT, PAIR_PAREN, TokenPairEmptyPrune, 0, 0 },
+	{ 3, ANGLE_LEFT, ANGLE_RIGHT, PAIR_ANGLE, TokenPairEmptyPrune, 0, 0 },
+	{ 3, BRACE_DOUBLE_LEFT, BRACE_DOUBLE_RIGHT, PAIR_BRACES, TokenPairEmptyPrune, 0, 0 },
 
 	// Strong/Emph
-	pairings4.add(STAR, STAR, PAIR_STAR, TokenPair::Options::None);
-	pairings4.add(UL, UL, PAIR_UL, TokenPair::Options::None);
+	{ 4, STAR, STAR, PAIR_STAR, TokenPairNone, 0, 0 },
+	{ 4, UL, UL, PAIR_UL, TokenPairNone, 0, 0 },
 
 	// Quotes and Backticks
-	pairings3.add(BACKTICK, BACKTICK, PAIR_BACKTICK, TokenPair::Options::PruneMatch | TokenPair::Options::MatchLength);
+	{ 3, BACKTICK, BACKTICK, PAIR_BACKTICK, TokenPairPruneLength, 0, 0 },
 
-	pairings4.add(BACKTICK,   QUOTE_RIGHT_ALT,   PAIR_QUOTE_ALT, TokenPair::Options::AllowEmpty | TokenPair::Options::MatchLength);
-	pairings4.add(QUOTE_SINGLE, QUOTE_SINGLE, PAIR_QUOTE_SINGLE, TokenPair::Options::AllowEmpty | TokenPair::Options::PruneMatch);
-	pairings4.add(QUOTE_DOUBLE, QUOTE_DOUBLE, PAIR_QUOTE_DOUBLE, TokenPair::Options::AllowEmpty | TokenPair::Options::PruneMatch);
+	{ 4, BACKTICK, QUOTE_RIGHT_ALT, PAIR_QUOTE_ALT, TokenPairEmptyLength, 0, 0 },
+	{ 4, QUOTE_SINGLE, QUOTE_SINGLE, PAIR_QUOTE_SINGLE, TokenPairEmptyPrune, 0, 0 },
+	{ 4, QUOTE_DOUBLE, QUOTE_DOUBLE, PAIR_QUOTE_DOUBLE, TokenPairEmptyPrune, 0, 0 },
 
 	// Math
-	if ((extensions & Extensions::Compatibility) == Extensions::None) {
-		pairings3.add(MATH_PAREN_OPEN, MATH_PAREN_CLOSE, PAIR_MATH, TokenPair::Options::AllowEmpty | TokenPair::Options::PruneMatch);
-		pairings3.add(MATH_BRACKET_OPEN, MATH_BRACKET_CLOSE, PAIR_MATH, TokenPair::Options::AllowEmpty | TokenPair::Options::PruneMatch);
-		pairings3.add(MATH_DOLLAR_SINGLE, MATH_DOLLAR_SINGLE, PAIR_MATH, TokenPair::Options::AllowEmpty | TokenPair::Options::PruneMatch);
-		pairings3.add(MATH_DOLLAR_DOUBLE, MATH_DOLLAR_DOUBLE, PAIR_MATH, TokenPair::Options::AllowEmpty | TokenPair::Options::PruneMatch);
-	}
+	{ 3, MATH_PAREN_OPEN, MATH_PAREN_CLOSE, PAIR_MATH, TokenPairEmptyPrune, 0, TokenPairCompatibility },
+	{ 3, MATH_BRACKET_OPEN, MATH_BRACKET_CLOSE, PAIR_MATH, TokenPairEmptyPrune, 0, TokenPairCompatibility },
+	{ 3, MATH_DOLLAR_SINGLE, MATH_DOLLAR_SINGLE, PAIR_MATH, TokenPairEmptyPrune, 0, TokenPairCompatibility },
+	{ 3, MATH_DOLLAR_DOUBLE, MATH_DOLLAR_DOUBLE, PAIR_MATH, TokenPairEmptyPrune, 0, TokenPairCompatibility },
 
 	// Superscript/Subscript
-	if ((extensions & Extensions::Compatibility) == Extensions::None) {
-		pairings4.add(SUPERSCRIPT, SUPERSCRIPT, PAIR_SUPERSCRIPT, TokenPair::Options::PruneMatch);
-		pairings4.add(SUBSCRIPT, SUBSCRIPT, PAIR_SUBSCRIPT, TokenPair::Options::PruneMatch);
-	}
+	{ 4, SUPERSCRIPT, SUPERSCRIPT, PAIR_SUPERSCRIPT, TokenPairPrune, 0, TokenPairCompatibility },
+	{ 4, SUBSCRIPT, SUBSCRIPT, PAIR_SUBSCRIPT, TokenPairPrune, 0, TokenPairCompatibility },
 
 	// Text Braces -- for raw text syntax
-	if ((extensions & Extensions::Compatibility) == Extensions::None) {
-		pairings4.add(TEXT_BRACE_LEFT, TEXT_BRACE_RIGHT, PAIR_BRACE, TokenPair::Options::PruneMatch);
-		pairings4.add(RAW_FILTER_LEFT, TEXT_BRACE_RIGHT, PAIR_RAW_FILTER, TokenPair::Options::PruneMatch);
+	{ 4, TEXT_BRACE_LEFT, TEXT_BRACE_RIGHT, PAIR_BRACE, TokenPairPrune, 0, TokenPairCompatibility },
+	{ 4, RAW_FILTER_LEFT, TEXT_BRACE_RIGHT, PAIR_RAW_FILTER, TokenPairPrune, 0, TokenPairCompatibility },
+};
+
+static constexpr bool token_pair_rule_enabled(const TokenPairRule &rule, uint32_t extensions) {
+	return (extensions & rule.require) == rule.require && (extensions & rule.exclude) == 0;
+}
+
+// Number of distinct opener and closer types in pass, for the worst case of enabled extensions
+static constexpr size_t token_pair_max_classes() {
+	size_t ret = 0;
+	for (uint8_t pass = 1; pass <= 4; ++ pass) {
+		size_t openers = 0;
+		size_t closers = 0;
+		for (size_t i = 0; i < sizeof(s_tokenPairRules) / sizeof(TokenPairRule); ++ i) {
+			auto &rule = s_tokenPairRules[i];
+			if (rule.pass != pass) {
+				continue;
+			}
+
+			bool newOpener = true;
+			bool newCloser = true;
+			for (size_t j = 0; j < i; ++ j) {
+				auto &prev = s_tokenPairRules[j];
+				if (prev.pass == pass) {
+					newOpener = newOpener && prev.open != rule.open;
+					newCloser = newCloser && prev.close != rule.close;
+				}
+			}
+
+			openers += newOpener ? 1 : 0;
+			closers += newCloser ? 1 : 0;
+		}
+
+		ret = std::max(ret, std::max(openers, closers));
+	}
+	return ret;
+}
+
+static_assert(token_pair_max_classes() <= TokenPair::kMaxPairClasses, "TokenPair::kMaxPairClasses is too small for pairing rules");
+
+static constexpr TokenPair token_pair_build(uint8_t pass, uint32_t extensions) {
+	TokenPair ret;
+	for (auto &it : s_tokenPairRules) {
+		if (it.pass == pass && token_pair_rule_enabled(it, extensions)) {
+			ret.add(it.open, it.close, it.type, it.options);
+		}
 	}
+	return ret;
+}
+
+constexpr TokenPairEngine::TokenPairEngine(uint32_t extensions)
+: pairings1(token_pair_build(1, extensions))
+, pairings2(token_pair_build(2, extensions))
+, pairings3(token_pair_build(3, extensions))
+, pairings4(token_pair_build(4, extensions)) { }
+
+// Only Critic, Notes and Compatibility affect pairing, index is a combination of them
+static constexpr uint32_t token_pair_engine_extensions(size_t idx) {
+	return ((idx & 1) ? TokenPairCritic : 0) | ((idx & 2) ? TokenPairNotes : 0) | ((idx & 4) ? TokenPairCompatibility : 0);
+}
+
+static constexpr TokenPairEngine s_tokenPairEngines[] = {
+	TokenPairEngine(token_pair_engine_extensions(0)),
+	TokenPairEngine(token_pair_engine_extensions(1)),
+	TokenPairEngine(token_pair_engine_extensions(2)),
+	TokenPairEngine(token_pair_engine_extensions(3)),
+	TokenPairEngine(token_pair_engine_extensions(4)),
+	TokenPairEngine(token_pair_engine_extensions(5)),
+	TokenPairEngine(token_pair_engine_extensions(6)),
+	TokenPairEngine(token_pair_engine_extensions(7)),
+};
+
+const TokenPairEngine *TokenPairEngine::engineForExtensions(Extensions::Value extensions) {
+	const uint32_t flags = uint32_t(extensions);
+	const size_t idx = ((flags & TokenPairCritic) ? 1 : 0) | ((flags & TokenPairNotes) ? 2 : 0) | ((flags & TokenPairCompatibility) ? 4 : 0);
+	return &s_tokenPairEngines[idx];
 }
 
 NS_MMD_END
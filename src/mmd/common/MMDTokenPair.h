@@ -50,7 +50,7 @@ struct TokenPair {
 	using Vector = memory::PoolInterface::VectorType<T>;
 
 	constexpr static int kMaxTokenTypes	= 230;			//!< This needs to be larger than the largest token type being used
-	constexpr static int kLargeStackThreshold = 1000;	//!< Avoid unnecessary searches of large stacks
+	constexpr static int kMaxPairClasses = 16;			//!< Max number of distinct opener (or closer) token types in one pass
 	constexpr static int kMaxPairRecursiveDepth = 100;	//!< Maximum recursion depth to traverse when pairing tokens -- to prevent stack overflow with "pathologic" input
 
 	enum Options {
@@ -60,27 +60,42 @@ struct TokenPair {
 		PruneMatch		= 1 << 2,		//!< Move the matched sub-chain into a child chain
 	};
 
-	bool empty_allowed[kMaxTokenTypes];				//!< Is this pair type allowed to be empty?
-	bool match_len[kMaxTokenTypes];					//!< Does this pair type require matched lengths of openers/closers?
-	bool should_prune[kMaxTokenTypes];				//!< Does this pair type need to be pruned to a child token chain?
+	// Only token types, that can open or close a pair in this pass, have a class;
+	// pair table is indexed by classes, so it fits in a few cache lines
+	struct TypeClass {
+		uint8_t open = 0;			//!< Opener class + 1, 0 if token type can not open a pair
+		uint8_t close = 0;			//!< Closer class + 1, 0 if token type can not close a pair
+	};
+
+	struct Pair {
+		uint8_t type = 0;			//!< Which pair are we forming?
+		uint8_t options = 0;		//!< Options of this pair type
+	};
+
+	TypeClass classes[kMaxTokenTypes] = { };
+	Pair pairs[kMaxPairClasses][kMaxPairClasses] = { };
+
+	uint8_t openers = 0;
+	uint8_t closers = 0;
+	uint16_t pairs_count = 0;							//!< Number of pair types added, empty tables are skipped on matching
 
-	uint8_t can_open_pair[kMaxTokenTypes];				//!< Can token type open a pair?
-	uint8_t can_close_pair[kMaxTokenTypes];				//!< Can token type close a pair?
-	uint8_t pair_type[kMaxTokenTypes][kMaxTokenTypes];	//!< Which pair are we forming?
+	constexpr TokenPair() { }
 
-	TokenPair();
+	constexpr void add(uint8_t open_type, uint8_t close_type, uint8_t pair_type, uint8_t options);
 
-	void add(uint8_t open_type, uint8_t close_type, uint8_t pair_type, Options options);
+	bool empty() const { return pairs_count == 0; }
 
 	void match(const Token &parent, Vector<Token> &stack, uint16_t depth) const;
 };
 
 SP_DEFINE_ENUM_AS_MASK(TokenPair::Options);
 
+// Pairing tables for all passes are generated at compile time for every meaningful
+// combination of extensions, see TokenPairEngine::engineForExtensions
 struct TokenPairEngine {
-	static TokenPairEngine *engineForExtensions(Extensions::Value);
+	static const TokenPairEngine *engineForExtensions(Extensions::Value);
 
-	TokenPairEngine(Extensions::Value);
+	constexpr TokenPairEngine(uint32_t extensions);
 
 	TokenPair pairings1;
 	TokenPair pairings2;
@@ -0,0 +1,329 @@
+/**
+Copyright (c) 2017 Roman Katuntsev <sbkarr@stappler.org>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+**/
+
+#include "SPCommon.h"
+#include "MMDTransclusion.h"
+#include "MMDEngine.h"
+#include "SPFilesystem.h"
+
+#include <sys/stat.h>
+
+NS_MMD_BEGIN
+
+static uint64_t transclusion_file_mtime(const StringView &path) {
+	struct stat st;
+	if (::stat(std::string(path.data(), path.size()).data(), &st) != 0 || !S_ISREG(st.st_mode)) {
+		return 0;
+	}
+
+	// zero is reserved for unavailable fragments
+	return uint64_t(st.st_mtim.tv_sec) * 1000000000ULL + uint64_t(st.st_mtim.tv_nsec) + 1;
+}
+
+static bool transclusion_file_load(const StringView &path, Bytes &data) {
+	data = filesystem::readFile(path);
+	return !data.empty() || transclusion_file_mtime(path) != 0;
+}
+
+Transclusion::Fragment::~Fragment() { }
+
+StringView Transclusion::Fragment::getPath() const {
+	return StringView(_path);
+}
+
+StringView Transclusion::Fragment::getText() const {
+	// fragment source starts with empty line, added for parsing
+	return _engine ? _engine->getSource().sub(1) : StringView();
+}
+
+uint64_t Transclusion::Fragment::getModificationTime() const {
+	return _mtime;
+}
+
+Engine *Transclusion::Fragment::getEngine() const {
+	return _engine.get();
+}
+
+bool Transclusion::Fragment::isValid(const StatCallback &stat) const {
+	if (stat(StringView(_path)) != _mtime) {
+		return false;
+	}
+
+	for (auto &it : _nested) {
+		if (!it->isValid(stat)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+std::string Transclusion::normalizePath(const StringView &path) {
+	std::string ret; ret.reserve(path.size());
+	const bool absolute = path.is('/');
+	size_t fixed = absolute ? 1 : 0; // prefix, that can not be removed with `..`
+	if (absolute) {
+		ret.push_back('/');
+	}
+
+	StringView r(path);
+	while (!r.empty()) {
+		auto name = r.readUntil<StringView::Chars<'/'>>();
+		if (r.is('/')) {
+			++ r;
+		}
+
+		if (name.empty() || name == ".") {
+			continue;
+		} else if (name == "..") {
+			if (ret.size() > fixed) {
+				// remove last component with separator
+				auto pos = ret.find_last_of('/', ret.size() - 1);
+				ret.resize((pos == std::string::npos || pos < fixed) ? fixed : pos);
+				continue;
+			} else if (absolute) {
+				continue; // `/..` is `/`
+			}
+			// leading `..` of relative path is kept
+		}
+
+		if (ret.size() > 0 && ret.back() != '/') {
+			ret.push_back('/');
+		}
+		ret.append(name.data(), name.size());
+		if (name == "..") {
+			fixed = ret.size();
+		}
+	}
+
+	if (ret.empty()) {
+		ret.push_back('.');
+	}
+	return ret;
+}
+
+Transclusion::~Transclusion() {
+	stopWorkers();
+	clear();
+}
+
+bool Transclusion::init(StatCallback &&stat, LoadCallback &&load) {
+	_stat = stat ? move(stat) : StatCallback(&transclusion_file_mtime);
+	_load = load ? move(load) : LoadCallback(&transclusion_file_load);
+	return true;
+}
+
+void Transclusion::setThreads(uint32_t n) {
+	n = std::max(n, uint32_t(1));
+	if (n != _threads) {
+		// should not be called while fragments are acquired
+		stopWorkers();
+		_threads = n;
+	}
+}
+
+uint32_t Transclusion::getThreads() const {
+	return _threads;
+}
+
+auto Transclusion::acquire(const std::vector<StringView> &paths, const Extensions &ext, Fragment *parent) -> std::vector<Rc<Fragment>> {
+	std::vector<Rc<Fragment>> ret; ret.resize(paths.size());
+
+	// nested fragments are acquired by worker, that builds the parent
+	const size_t nworkers = parent ? 1 : std::min(size_t(_threads), paths.size());
+	if (nworkers <= 1) {
+		for (size_t i = 0; i < paths.size(); ++ i) {
+			ret[i] = get(paths[i], ext, parent);
+		}
+	} else {
+		Job job;
+		job.paths = &paths;
+		job.ext = &ext;
+		job.ret = &ret;
+
+		std::unique_lock<std::mutex> lock(_jobMutex);
+		if (_workers.empty()) {
+			startWorkers(_threads - 1);
+		}
+
+		_jobs.emplace_back(&job);
+		_jobAvailable.notify_all();
+
+		// calling thread works on its own job, then waits for paths, taken by workers
+		while (runJob(job, lock)) { }
+		_jobDone.wait(lock, [&] { return job.done == paths.size(); });
+	}
+
+	if (parent) {
+		for (auto &it : ret) {
+			if (it) {
+				parent->_nested.emplace_back(it);
+			}
+		}
+	}
+
+	return ret;
+}
+
+void Transclusion::startWorkers(size_t n) {
+	_stopWorkers = false;
+	for (size_t i = 0; i < n; ++ i) {
+		_workers.emplace_back(&Transclusion::runWorker, this);
+	}
+}
+
+void Transclusion::stopWorkers() {
+	do {
+		std::unique_lock<std::mutex> lock(_jobMutex);
+		_stopWorkers = true;
+		_jobAvailable.notify_all();
+	} while (0);
+
+	for (auto &it : _workers) {
+		it.join();
+	}
+	_workers.clear();
+}
+
+void Transclusion::runWorker() {
+	std::unique_lock<std::mutex> lock(_jobMutex);
+	while (!_stopWorkers) {
+		if (_jobs.empty()) {
+			_jobAvailable.wait(lock);
+		} else {
+			runJob(*_jobs.front(), lock);
+		}
+	}
+}
+
+bool Transclusion::runJob(Job &job, std::unique_lock<std::mutex> &lock) {
+	const size_t size = job.paths->size();
+	if (job.next >= size) {
+		return false;
+	}
+
+	const size_t idx = job.next ++;
+	if (job.next == size) {
+		// all paths are taken, job is finished by threads, that took them
+		_jobs.erase(std::find(_jobs.begin(), _jobs.end(), &job));
+	}
+
+	lock.unlock();
+	auto f = get((*job.paths)[idx], *job.ext, nullptr);
+	lock.lock();
+
+	(*job.ret)[idx] = move(f);
+	if (++ job.done == size) {
+		_jobDone.notify_all();
+	}
+	return true;
+}
+
+void Transclusion::clear() {
+	std::unique_lock<std::mutex> lock(_mutex);
+	_fragments.clear();
+}
+
+size_t Transclusion::size() const {
+	std::unique_lock<std::mutex> lock(_mutex);
+	return _fragments.size();
+}
+
+auto Transclusion::getStats() const -> Stats {
+	Stats ret;
+	ret.hits = _hits.load();
+	ret.loads = _loads.load();
+	ret.failures = _failures.load();
+	return ret;
+}
+
+auto Transclusion::get(const StringView &path, const Extensions &ext, Fragment *parent) -> Rc<Fragment> {
+	std::string key = normalizePath(path);
+
+	// recursive or too deep inclusion, marker is left as is
+	size_t depth = 0;
+	for (const Fragment *p = parent; p; p = p->_parent) {
+		if (p->_path == key || ++ depth >= MaxDepth) {
+			++ _failures;
+			return nullptr;
+		}
+	}
+
+	Rc<Fragment> cached;
+
+	do {
+		std::unique_lock<std::mutex> lock(_mutex);
+		auto it = _fragments.find(key);
+		if (it != _fragments.end()) {
+			cached = it->second;
+		}
+	} while (0);
+
+	if (cached && cached->_extensions == toInt(ext.flags) && cached->isValid(_stat)) {
+		++ _hits;
+		return cached;
+	}
+
+	auto ret = build(StringView(key), ext, parent);
+
+	do {
+		std::unique_lock<std::mutex> lock(_mutex);
+		if (ret) {
+			_fragments[key] = ret;
+		} else if (cached) {
+			_fragments.erase(key);
+		}
+	} while (0);
+
+	return ret;
+}
+
+auto Transclusion::build(const StringView &path, const Extensions &ext, Fragment *parent) -> Rc<Fragment> {
+	// modification time is taken before reading, so changes during reading are detected on next use
+	auto mtime = _stat(path);
+
+	Bytes data;
+	if (mtime == 0 || !_load(path, data)) {
+		++ _failures;
+		return nullptr;
+	}
+
+	// scanners expect null-terminated source
+	data.emplace_back(0);
+
+	auto ret = Rc<Fragment>::alloc();
+	ret->_path = std::string(path.data(), path.size());
+	ret->_mtime = mtime;
+	ret->_extensions = toInt(ext.flags);
+	ret->_parent = parent;
+	ret->_engine = Rc<Engine>::alloc();
+
+	if (!ret->_engine->initFragment(this, ret.get(), StringView((const char *)data.data(), data.size() - 1), ext)) {
+		++ _failures;
+		return nullptr;
+	}
+
+	ret->_parent = nullptr;
+	++ _loads;
+	return ret;
+}
+
+NS_MMD_END
@@ -0,0 +1,156 @@
+/**
+Copyright (c) 2017 Roman Katuntsev <sbkarr@stappler.org>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+**/
+
+#ifndef MMD_COMMON_MMDTRANSCLUSION_H_
+#define MMD_COMMON_MMDTRANSCLUSION_H_
+
+#include "SPRef.h"
+#include "MMDCommon.h"
+
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+
+NS_MMD_BEGIN
+
+class Engine;
+
+/// Fragments for `{{path}}` transclusion, shared between documents
+///
+/// With Extensions::Transclude, markers are replaced with text of fragments before parsing (except
+/// `{{TOC}}` and markers in fenced code). Relative paths are resolved against `transcludebase` metadata
+/// or directory of including file. Nested markers are expanded, metadata of fragment is dropped.
+/// Paths are normalized lexically (`.`, `..` and repeated separators are resolved), fragments
+/// included recursively or deeper than MaxDepth are not expanded.
+///
+/// Every fragment is loaded and parsed once and cached by path and modification time (of fragment and
+/// all nested fragments). Parsed blocks of fragment are copied into document, when fragment starts on
+/// top-level block boundary, otherwise its text is parsed with the document. Fragments of document
+/// are loaded and parsed in parallel by worker threads of cache, workers are started on first use
+/// and reused. Cache can be used by multiple engines on different threads.
+class Transclusion : public Ref {
+public:
+	static constexpr size_t MaxDepth = 32;
+
+	// Modification time of fragment (any value, that changes with content), 0 if fragment is not available
+	using StatCallback = Function<uint64_t(const StringView &path)>;
+
+	// Read fragment data, returns false if fragment is not available
+	using LoadCallback = Function<bool(const StringView &path, Bytes &)>;
+
+	struct Stats {
+		size_t hits = 0; // fragments, reused from cache
+		size_t loads = 0; // fragments, loaded and parsed
+		size_t failures = 0; // fragments, that are not available or included recursively
+	};
+
+	class Fragment : public Ref {
+	public:
+		~Fragment();
+
+		StringView getPath() const;
+		StringView getText() const; // expanded text without metadata
+		uint64_t getModificationTime() const;
+
+		// parsed blocks, used by including engine
+		Engine *getEngine() const;
+
+	protected:
+		friend class Transclusion;
+
+		bool isValid(const StatCallback &) const;
+
+		std::string _path;
+		uint64_t _mtime = 0;
+		uint32_t _extensions = 0;
+		Rc<Engine> _engine;
+		std::vector<Rc<Fragment>> _nested; // fragments, included into this one
+		const Fragment *_parent = nullptr; // including fragment, only while fragment is being built
+	};
+
+	~Transclusion();
+
+	// Callbacks are called from worker threads. Without callbacks fragments are read from filesystem.
+	bool init(StatCallback && = nullptr, LoadCallback && = nullptr);
+
+	// Path without `.` and `..` components and repeated separators
+	static std::string normalizePath(const StringView &);
+
+	// Threads for loading and parsing of fragments, requested by document (including calling thread)
+	void setThreads(uint32_t);
+	uint32_t getThreads() const;
+
+	// Fragments for unique resolved paths in the same order, nullptr for fragments, that is not available.
+	// Changed fragments are loaded again. Parent is the fragment, that is being built, nested fragments
+	// are loaded in its thread and become its dependencies.
+	std::vector<Rc<Fragment>> acquire(const std::vector<StringView> &paths, const Extensions &, Fragment *parent = nullptr);
+
+	// drop cached fragments, fragments in use are released with their documents
+	void clear();
+	size_t size() const;
+
+	Stats getStats() const;
+
+protected:
+	// paths of single acquire call, processed by workers and calling thread
+	struct Job {
+		const std::vector<StringView> *paths;
+		const Extensions *ext;
+		std::vector<Rc<Fragment>> *ret;
+		size_t next = 0; // next path to process
+		size_t done = 0; // processed paths
+	};
+
+	Rc<Fragment> get(const StringView &path, const Extensions &, Fragment *parent);
+	Rc<Fragment> build(const StringView &path, const Extensions &, Fragment *parent);
+
+	void startWorkers(size_t);
+	void stopWorkers();
+	void runWorker();
+
+	// process next path of job, lock is released while fragment is built; returns false if no paths left
+	bool runJob(Job &, std::unique_lock<std::mutex> &);
+
+	StatCallback _stat;
+	LoadCallback _load;
+	uint32_t _threads = 1;
+
+	mutable std::mutex _mutex;
+	std::map<std::string, Rc<Fragment>> _fragments;
+
+	std::mutex _jobMutex;
+	std::condition_variable _jobAvailable;
+	std::condition_variable _jobDone;
+	std::deque<Job *> _jobs;
+	std::vector<std::thread> _workers;
+	bool _stopWorkers = false;
+
+	std::atomic<size_t> _hits { 0 };
+	std::atomic<size_t> _loads { 0 };
+	std::atomic<size_t> _failures { 0 };
+};
+
+NS_MMD_END
+
+#endif /* MMD_COMMON_MMDTRANSCLUSION_H_ */
@@ -7,10 +7,42 @@
 #include "MMDChars.h"
 #include "SPHtmlParser.h"
 
-#define kMaxParseRecursiveDepth 1000		//!< Maximum recursion depth when parsing -- to prevent stack overflow with "pathologic" input
+#define kMaxParseRecursiveDepth 1000		//!< Maximum nesting depth when parsing -- to prevent stack overflow in tree walkers with "pathologic" input
 
 NS_MMD_BEGIN
 
+/// Nested containers (list items, blockquotes, indented definitions) are not parsed recursively from
+/// parser actions. Container is queued instead, and parsed by the same parser object after the current
+/// chain is finished. Actions, that expect parsed container content (list looseness, line stripping,
+/// list marker, parent length), are deferred and applied after all parsing in reverse order, so every container is
+/// complete before its parent is processed, as it was with recursive parsing.
+///
+/// Parser itself does not need the stack for nesting, but nesting depth is still limited with
+/// kMaxParseRecursiveDepth: token pairing, ambidextrous token assignment, automatic search, tree copy,
+/// stats and export recurse once per tree level. Containers below the limit are left as unparsed lines.
+struct ParseTask {
+	enum Type : uint8_t {
+		Chain,
+		ChainLength,
+		ListMarker,
+		ListLoose,
+		Strip,
+	};
+
+	Type type;
+	uint32_t depth;
+	_sp_mmd_token * block;
+	_sp_mmd_token * marker;
+};
+
+struct ParseState : memory::AllocPool {
+	void * parser = nullptr; // lemon parser, reset for every chain
+	memory::PoolInterface::VectorType<ParseTask> pending; // containers, waiting for parsing
+	memory::PoolInterface::VectorType<ParseTask> deferred; // actions on parsed containers
+	uint32_t depth = 0;
+	bool active = false;
+};
+
 static Content *acquireContent(void *enginePtr) {
 	using mmd_engine = _sp_mmd_engine;
 
@@ -28,7 +60,7 @@ using token = _sp_mmd_token;
 // Basic parser function declarations
 void * ParseAlloc( void *(*mallocProc)(size_t) );
 void Parse(void *yyp, int yymajor, token * yyminor, mmd_engine *engine);
-void ParseFree(void *p, void (*freeProc)(void *, size_t));
+void ParseReset(void *p);
 void ParseTrace(FILE *TraceFILE, const char *zTracePrompt);
 
 static void check_html_id(mmd_engine * e, token *t, const char *start) {
@@ -678,19 +710,89 @@ static void *sp_mmd_malloc(size_t s) {
 	return memory::pool::palloc(memory::pool::acquire(), s);
 }
 
-static void sp_mmd_free(void *ptr, size_t size) {
-	memory::pool::free(memory::pool::acquire(), ptr, size);
+static void is_list_loose(token * list);
+
+/// Parser and task stacks are allocated once per engine from the current pool
+static ParseState * parse_state_acquire(mmd_engine * e) {
+	if (!e->parse_state) {
+		auto state = new (memory::pool::acquire()) ParseState;
+		state->parser = ParseAlloc(sp_mmd_malloc);		// Create a parser (for lemon)
+		e->parse_state = state;
+	}
+
+	return (ParseState *)e->parse_state;
 }
 
-/// Parse token tree
-void sp_mmd_parse_token_chain(mmd_engine * e, token * chain) {
-	if (e->recurse_depth == kMaxParseRecursiveDepth) {
-		return;
+static void parse_apply(mmd_engine * e, const ParseTask & task) {
+	switch (task.type) {
+		case ParseTask::Chain:
+			break;
+
+		case ParseTask::ChainLength:
+			// length of parsed chain, as it was set on parsing, when content of nested containers is known
+			if (task.block->child) {
+				task.block->len = task.block->child->tail->start + task.block->child->tail->len - task.block->start;
+			}
+			break;
+
+		case ParseTask::ListMarker:
+			// Insert marker back in place
+			task.marker->next = task.block->child->child;
+
+			if (task.block->child->child) {
+				task.block->child->child->prev = task.marker;
+			}
+
+			task.block->child->child = task.marker;
+			break;
+
+		case ParseTask::ListLoose:
+			is_list_loose(task.block);
+			break;
+
+		case ParseTask::Strip:
+			switch (task.block->type) {
+				case BLOCK_DEFLIST:
+				case BLOCK_LIST_BULLETED:
+				case BLOCK_LIST_ENUMERATED:
+					// parent length, as it was set by parser after parsing of nested containers
+					if (token * tail = task.block->child) {
+						while (tail->next) {
+							tail = tail->next;
+						}
+						task.block->len = tail->start + tail->len - task.block->start;
+					}
+					break;
+			}
+
+			sp_mmd_strip_line_tokens_from_block(e, task.block);
+			break;
+	}
+}
+
+/// Apply action immediately, or after all containers are parsed, if called from parser
+static bool parse_defer(mmd_engine * e, ParseTask::Type type, token * block, token * marker = nullptr) {
+	auto state = (ParseState *)e->parse_state;
+	if (!state || !state->active) {
+		return false;
+	}
+
+	state->deferred.emplace_back(ParseTask{type, state->depth, block, marker});
+	return true;
+}
+
+static void parse_chain(mmd_engine * e, ParseState * state, token * chain, uint32_t depth) {
+	state->depth = depth;
+	e->recurse_depth = depth;
+	if (e->recurse_depth > e->max_recurse_depth) {
+		e->max_recurse_depth = e->recurse_depth;
 	}
 
-	e->recurse_depth++;
+	ParseReset(state->parser);
+
+	// should be applied after all actions on chain content
+	parse_defer(e, ParseTask::ChainLength, chain);
 
-	void* pParser = ParseAlloc (sp_mmd_malloc);		// Create a parser (for lemon)
 	token * walker = chain->child;				// Walk the existing tree
 	token * remainder;							// Hold unparsed tail of chain
 
@@ -716,22 +818,66 @@ void sp_mmd_parse_token_chain(mmd_engine * e, token * chain) {
 		// fprintf(stderr, "\nNew line\n");
 		#endif
 
-		Parse(pParser, walker->type, walker, e);
+		Parse(state->parser, walker->type, walker, e);
 
 		walker = remainder;
 	}
 
 	// Signal finish to parser
-	Parse(pParser, 0, NULL, e);
+	Parse(state->parser, 0, NULL, e);
 
 	// Disconnect of (now empty) root
 	chain->child = NULL;
 	sp_mmd_token_append_child(chain, e->root);
 	e->root = NULL;
+}
+
+/// Parse token tree
+void sp_mmd_parse_token_chain(mmd_engine * e, token * chain) {
+	auto state = parse_state_acquire(e);
+	if (state->active) {
+		// nested container, called from parser action; containers below depth limit are left unparsed,
+		// so depth of resulting tree is bounded for recursive tree walkers
+		if (state->depth < kMaxParseRecursiveDepth) {
+			state->pending.emplace_back(ParseTask{ParseTask::Chain, state->depth + 1, chain, nullptr});
+		}
+		return;
+	}
+
+	size_t definitions = sp_mmd_stack_size(e->definition_stack);
+	size_t headers = sp_mmd_stack_size(e->header_stack);
+	size_t tables = sp_mmd_stack_size(e->table_stack);
+	size_t chains = 0;
+
+	state->active = true;
+	state->pending.emplace_back(ParseTask{ParseTask::Chain, 1, chain, nullptr});
+
+	while (!state->pending.empty()) {
+		auto task = state->pending.back();
+		state->pending.pop_back();
+
+		parse_chain(e, state, task.block, task.depth);
+		++ chains;
+	}
+
+	state->active = false;
+
+	while (!state->deferred.empty()) {
+		auto task = state->deferred.back();
+		state->deferred.pop_back();
+
+		parse_apply(e, task);
+	}
 
-	ParseFree(pParser, sp_mmd_free);
+	state->depth = 0;
+	e->recurse_depth = 0;
 
-	e->recurse_depth--;
+	if (chains > 1) {
+		// containers are parsed out of document order, restore it
+		sp_mmd_stack_sort(e->definition_stack, definitions);
+		sp_mmd_stack_sort(e->header_stack, headers);
+		sp_mmd_stack_sort(e->table_stack, tables);
+	}
 }
 
 void sp_mmd_recursive_parse_indent(mmd_engine * e, token * block) {
@@ -763,14 +909,9 @@ void sp_mmd_recursive_parse_list_item(mmd_engine * e, token * block) {
 
 	sp_mmd_parse_token_chain(e, block);
 
-	// Insert marker back in place
-	marker->next = block->child->child;
-
-	if (block->child->child) {
-		block->child->child->prev = marker;
+	if (!parse_defer(e, ParseTask::ListMarker, block, marker)) {
+		parse_apply(e, ParseTask{ParseTask::ListMarker, 0, block, marker});
 	}
-
-	block->child->child = marker;
 }
 
 void sp_mmd_recursive_parse_blockquote(mmd_engine * e, token * block) {
@@ -780,7 +921,14 @@ void sp_mmd_recursive_parse_blockquote(mmd_engine * e, token * block) {
 	sp_mmd_parse_token_chain(e, block);
 }
 
-void sp_mmd_is_list_loose(token * list) {
+void sp_mmd_is_list_loose(mmd_engine * e, token * list) {
+	// item content is not parsed yet
+	if (!parse_defer(e, ParseTask::ListLoose, list)) {
+		is_list_loose(list);
+	}
+}
+
+static void is_list_loose(token * list) {
 	bool loose = false;
 
 	token * walker = list->child;
@@ -1002,6 +1150,11 @@ void sp_mmd_strip_line_tokens_from_block(mmd_engine * e, token * block) {
 		return;
 	}
 
+	// block can contain containers, that are not parsed yet
+	if (parse_defer(e, ParseTask::Strip, block)) {
+		return;
+	}
+
 	#ifndef NDEBUG
 	// fprintf(stderr, "Strip line tokens from %d (%lu:%lu) (child %d)\n", block->type, block->start, block->len, block->child->type);
 	// token_tree_describe(block, e->dstr->str);
@@ -1176,8 +1329,8 @@ handle_line:
 /// Create a token chain from source string
 /// stop_on_empty_line allows us to stop parsing part of the way through
 token * sp_mmd_mmd_tokenize_string(mmd_engine * e, size_t start, size_t len, bool stop_on_empty_line) {
-	// Reset metadata flag
-	e->allow_meta = ((e->extensions & toInt(Extensions::Compatibility)) != 0) ? false : true;
+	// Reset metadata flag, metadata is only allowed at the start of document
+	e->allow_meta = (start != 0 || (e->extensions & toInt(Extensions::Compatibility)) != 0) ? false : true;
 
 
 	// Create a scanner (for re2c)
@@ -1201,6 +1354,9 @@ token * sp_mmd_mmd_tokenize_string(mmd_engine * e, size_t start, size_t len, boo
 	const char * last_stop = &e->str[start];	// Remember where last token ended
 
 	do {
+		// Skip bytes, that can not start a token, scanner restarts on each of them
+		s.cur = chars::skipPlainText(s.cur, stop, &s.ptr);
+
 		// Scan for next token (type of 0 means there is nothing left);
 		type = scan(&s, stop);
 
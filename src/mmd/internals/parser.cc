@@ -771,6 +771,21 @@ void ParseFree(
   (*freeProc)((void*)pParser, sizeof(yyParser));
 }
 
+/*
+** Reset parser to the initial state, so the same parser can be used for
+** the next input without reallocation.
+*/
+void ParseReset(void *p){
+  yyParser *pParser = (yyParser*)p;
+  while( pParser->yytos>pParser->yystack ) yy_pop_parser_stack(pParser);
+#ifndef YYNOERRORRECOVERY
+  pParser->yyerrcnt = -1;
+#endif
+  pParser->yytos = pParser->yystack;
+  pParser->yystack[0].stateno = 0;
+  pParser->yystack[0].major = 0;
+}
+
 /*
 ** Return the peak depth of the stack for a parser.
 */
@@ -1285,11 +1300,11 @@ static void yy_reduce(
   yymsp[0].minor.yy0 = yylhsminor.yy0;
         break;
       case 24: /* block ::= list_bullet */
-{ yylhsminor.yy0 = sp_mmd_token_new_parent(yymsp[0].minor.yy0, BLOCK_LIST_BULLETED); sp_mmd_is_list_loose(yylhsminor.yy0); }
+{ yylhsminor.yy0 = sp_mmd_token_new_parent(yymsp[0].minor.yy0, BLOCK_LIST_BULLETED); sp_mmd_is_list_loose(engine, yylhsminor.yy0); }
   yymsp[0].minor.yy0 = yylhsminor.yy0;
         break;
       case 25: /* block ::= list_enum */
-{ yylhsminor.yy0 = sp_mmd_token_new_parent(yymsp[0].minor.yy0, BLOCK_LIST_ENUMERATED); sp_mmd_is_list_loose(yylhsminor.yy0); }
+{ yylhsminor.yy0 = sp_mmd_token_new_parent(yymsp[0].minor.yy0, BLOCK_LIST_ENUMERATED); sp_mmd_is_list_loose(engine, yylhsminor.yy0); }
   yymsp[0].minor.yy0 = yylhsminor.yy0;
         break;
       case 26: /* block ::= meta_block */
@@ -96,9 +96,12 @@ bool LayoutDocument::init(const FilePath &path, const StringView &ct) {
 
 	_filePath = path.get().str();
 
-	auto data = filesystem::readFile(path.get());
+	Engine e;
+	if (!e.initFromFile(path.get(), StapplerExtensions)) {
+		return false;
+	}
 
-	return init(data, ct);
+	return initWithEngine(e);
 }
 
 bool LayoutDocument::init(const DataReader<ByteOrder::Network> &data, const StringView &ct) {
@@ -107,6 +110,10 @@ bool LayoutDocument::init(const DataReader<ByteOrder::Network> &data, const Stri
 	}
 
 	Engine e; e.init(StringView((const char *)data.data(), data.size()), StapplerExtensions);
+	return initWithEngine(e);
+}
+
+bool LayoutDocument::initWithEngine(Engine &e) {
 	e.process([&] (const Content &c, const StringView &s, const Token &t) {
 		LayoutProcessor p; p.init(this);
 		p.process(c, s, t);
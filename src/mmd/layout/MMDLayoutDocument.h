@@ -54,6 +54,8 @@ public:
 protected:
 	friend class LayoutProcessor;
 
+	bool initWithEngine(Engine &);
+
 	void onTag(layout::Style &style, const StringView &tag, const StringView &parent, const MediaParameters &media) const;
 
 	layout::ContentPage *acquireRootPage();
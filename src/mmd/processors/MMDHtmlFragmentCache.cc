@@ -0,0 +1,131 @@
+/**
+Copyright (c) 2017 Roman Katuntsev <sbkarr@stappler.org>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+**/
+
+
+#include "SPCommon.h"
+#include "MMDHtmlFragmentCache.h"
+
+NS_MMD_BEGIN
+
+bool HtmlFragmentCache::init(size_t limit) {
+	_limit = limit;
+	return true;
+}
+
+bool HtmlFragmentCache::read(const Block &block, const Resolver &resolve, OutputBuffer &out, State &state) {
+	std::unique_lock<std::mutex> lock(_mutex);
+	auto it = _fragments.find(block.key);
+	if (it == _fragments.end()) {
+		return false;
+	}
+
+	auto &f = it->second;
+	if (f.context != block.context || StringView(f.source) != block.source) {
+		return false;
+	}
+
+	for (auto &dep : f.dependencies) {
+		if (resolve(StringView(dep.label)) != dep.digest) {
+			return false;
+		}
+	}
+
+	out.append(f.html.data(), f.html.size());
+	state = f.state;
+
+	_usage.splice(_usage.begin(), _usage, f.used);
+	++ _hits;
+	return true;
+}
+
+void HtmlFragmentCache::write(const Block &block, Dependencies &&deps, const StringView &html, const State &state) {
+	++ _misses;
+
+	size_t bytes = html.size() + block.source.size();
+	for (auto &it : deps) {
+		bytes += it.label.size();
+	}
+
+	if (bytes > _limit) {
+		return;
+	}
+
+	std::unique_lock<std::mutex> lock(_mutex);
+	auto it = _fragments.find(block.key);
+	if (it != _fragments.end()) {
+		erase(it);
+	}
+
+	while (_bytes + bytes > _limit && !_usage.empty()) {
+		erase(_fragments.find(_usage.back()));
+		++ _evicted;
+	}
+
+	_usage.emplace_front(block.key);
+
+	auto &f = _fragments[block.key];
+	f.context = block.context;
+	f.source.assign(block.source.data(), block.source.size());
+	f.dependencies = move(deps);
+	f.state = state;
+	f.html.assign(html.data(), html.size());
+	f.bytes = bytes;
+	f.used = _usage.begin();
+	_bytes += bytes;
+}
+
+void HtmlFragmentCache::erase(std::unordered_map<uint64_t, Fragment>::iterator it) {
+	_bytes -= it->second.bytes;
+	_usage.erase(it->second.used);
+	_fragments.erase(it);
+}
+
+void HtmlFragmentCache::skip() {
+	++ _skipped;
+}
+
+void HtmlFragmentCache::clear() {
+	std::unique_lock<std::mutex> lock(_mutex);
+	_fragments.clear();
+	_usage.clear();
+	_bytes = 0;
+}
+
+size_t HtmlFragmentCache::size() const {
+	std::unique_lock<std::mutex> lock(_mutex);
+	return _fragments.size();
+}
+
+auto HtmlFragmentCache::getStats() const -> Stats {
+	Stats ret;
+	ret.hits = _hits.load();
+	ret.misses = _misses.load();
+	ret.skipped = _skipped.load();
+
+	std::unique_lock<std::mutex> lock(_mutex);
+	ret.evicted = _evicted;
+	ret.entries = _fragments.size();
+	ret.bytes = _bytes;
+	return ret;
+}
+
+NS_MMD_END
@@ -0,0 +1,126 @@
+/**
+Copyright (c) 2017 Roman Katuntsev <sbkarr@stappler.org>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+**/
+
+
+#ifndef MMD_PROCESSORS_MMDHTMLFRAGMENTCACHE_H_
+#define MMD_PROCESSORS_MMDHTMLFRAGMENTCACHE_H_
+
+#include "SPRef.h"
+#include "MMDOutputBuffer.h"
+
+#include <mutex>
+#include <atomic>
+#include <list>
+#include <unordered_map>
+
+NS_MMD_BEGIN
+
+/// Rendered HTML of top-level blocks, shared between documents and renders
+///
+/// Fragment is stored with source bytes of block and render context (processor type, extensions,
+/// quotes language, header levels, processor state before block), both are compared on read.
+/// Link definitions, that block resolves on export, are recorded with fragment and resolved again
+/// on read, so fragment is reused only while references in block gives the same links. Blocks, that
+/// depend on other document state (footnotes, citations, glossary, abbreviations, variables, TOC,
+/// figures, table captions) are always exported. Cache can be used by processors on different threads.
+///
+/// When total size of cached fragments exceeds limit, least recently used fragments are dropped.
+class HtmlFragmentCache : public Ref {
+public:
+	static constexpr size_t DefaultLimit = 64 * 1024 * 1024;
+
+	struct Stats {
+		size_t hits = 0; // blocks, copied from cache
+		size_t misses = 0; // cacheable blocks, that was exported
+		size_t skipped = 0; // blocks, that depends on document state
+		size_t evicted = 0; // fragments, dropped to fit in limit
+		size_t entries = 0;
+		size_t bytes = 0;
+	};
+
+	// state of processor after block export, restored on cache hit
+	struct State {
+		int16_t padded = 0;
+		bool closePara = true;
+	};
+
+	// block to look for: key is only used for lookup, context and source are compared
+	struct Block {
+		uint64_t key;
+		uint64_t context;
+		StringView source;
+	};
+
+	// link lookup, made on block export: label and digest of found link (0, if there is no link)
+	struct Dependency {
+		std::string label;
+		uint64_t digest;
+	};
+
+	using Dependencies = std::vector<Dependency>;
+
+	// returns digest of link, that label is resolved to in current document
+	using Resolver = Function<uint64_t(const StringView &)>;
+
+	bool init(size_t limit = DefaultLimit);
+
+	// on hit, fragment is appended to output
+	bool read(const Block &, const Resolver &, OutputBuffer &, State &);
+
+	// store exported block (counted as miss) or count block, that can not be cached
+	void write(const Block &, Dependencies &&, const StringView &, const State &);
+	void skip();
+
+	void clear();
+	size_t size() const;
+
+	Stats getStats() const;
+
+protected:
+	struct Fragment {
+		uint64_t context;
+		std::string source;
+		Dependencies dependencies;
+		State state;
+		std::string html;
+		size_t bytes;
+		std::list<uint64_t>::iterator used; // position in usage list
+	};
+
+	void erase(std::unordered_map<uint64_t, Fragment>::iterator);
+
+	size_t _limit = DefaultLimit;
+	size_t _bytes = 0;
+	size_t _evicted = 0;
+
+	mutable std::mutex _mutex;
+	std::unordered_map<uint64_t, Fragment> _fragments;
+	std::list<uint64_t> _usage; // keys of fragments, most recently used first
+
+	std::atomic<size_t> _hits { 0 };
+	std::atomic<size_t> _misses { 0 };
+	std::atomic<size_t> _skipped { 0 };
+};
+
+NS_MMD_END
+
+#endif /* MMD_PROCESSORS_MMDHTMLFRAGMENTCACHE_H_ */
@@ -27,65 +27,144 @@ THE SOFTWARE.
 NS_MMD_BEGIN
 
 void HtmlOutputProcessor::run(std::ostream *stream, const StringView &str, const Extensions &ext) {
+	OutputStreamSink sink(stream);
+	run(&sink, str, ext);
+}
+
+void HtmlOutputProcessor::run(std::ostream *stream, memory::pool_t *pool, const StringView &str, const Extensions &ext) {
+	OutputStreamSink sink(stream);
+	run(&sink, pool, str, ext);
+}
+
+bool HtmlOutputProcessor::runFile(std::ostream *stream, const StringView &path, const Extensions &ext) {
+	OutputStreamSink sink(stream);
+	return runFile(&sink, path, ext);
+}
+
+bool HtmlOutputProcessor::runFile(std::ostream *stream, memory::pool_t *pool, const StringView &path, const Extensions &ext) {
+	OutputStreamSink sink(stream);
+	return runFile(&sink, pool, path, ext);
+}
+
+bool HtmlOutputProcessor::runFile(std::ostream *stream, Engine &e, const StringView &path, const Extensions &ext) {
+	OutputStreamSink sink(stream);
+	return runFile(&sink, e, path, ext);
+}
+
+void HtmlOutputProcessor::run(OutputSink *sink, const StringView &str, const Extensions &ext) {
 	Engine e; e.init(str, ext);
 
 	e.process([&] (const Content &c, const StringView &s, const Token &t) {
-		HtmlOutputProcessor p; p.init(stream);
+		HtmlOutputProcessor p; p.init(sink);
 		p.process(c, s, t);
 	});
 }
 
-void HtmlOutputProcessor::run(std::ostream *stream, memory::pool_t *pool, const StringView &str, const Extensions &ext) {
+void HtmlOutputProcessor::run(OutputSink *sink, memory::pool_t *pool, const StringView &str, const Extensions &ext) {
 	Engine e; e.init(pool, str, ext);
 
 	e.process([&] (const Content &c, const StringView &s, const Token &t) {
-		HtmlOutputProcessor p; p.init(stream);
+		HtmlOutputProcessor p; p.init(sink);
+		p.process(c, s, t);
+	});
+}
+
+bool HtmlOutputProcessor::runFile(OutputSink *sink, const StringView &path, const Extensions &ext) {
+	Engine e;
+	if (!e.initFromFile(path, ext)) {
+		return false;
+	}
+
+	e.process([&] (const Content &c, const StringView &s, const Token &t) {
+		HtmlOutputProcessor p; p.init(sink);
+		p.process(c, s, t);
+	});
+	return true;
+}
+
+bool HtmlOutputProcessor::runFile(OutputSink *sink, memory::pool_t *pool, const StringView &path, const Extensions &ext) {
+	Engine e;
+	if (!e.initFromFile(pool, path, ext)) {
+		return false;
+	}
+
+	e.process([&] (const Content &c, const StringView &s, const Token &t) {
+		HtmlOutputProcessor p; p.init(sink);
 		p.process(c, s, t);
 	});
+	return true;
+}
+
+bool HtmlOutputProcessor::runFile(OutputSink *sink, Engine &e, const StringView &path, const Extensions &ext) {
+	if (!e.initFromFile(path, ext)) {
+		return false;
+	}
+
+	e.process([&] (const Content &c, const StringView &s, const Token &t) {
+		HtmlOutputProcessor p; p.init(sink);
+		p.process(c, s, t);
+	});
+	e.clear();
+	return true;
+}
+
+void HtmlOutputProcessor::runProgressive(OutputSink *sink, const StringView &str, size_t maxBufferSize, const Extensions &ext) {
+	Engine e; e.init(str, ext);
+
+	e.process([&] (const Content &c, const StringView &s, const Token &t) {
+		HtmlOutputProcessor p; p.init(sink); p.setProgressive(true, maxBufferSize);
+		p.process(c, s, t);
+	});
+}
+
+void HtmlOutputProcessor::runProgressive(const OutputCallbackSink::Callback &cb, const StringView &str, size_t maxBufferSize, const Extensions &ext) {
+	auto callback = cb;
+	OutputCallbackSink sink(move(callback));
+	runProgressive(&sink, str, maxBufferSize, ext);
 }
 
 void HtmlOutputProcessor::pushNode(token *t, const StringView &name, InitList &&attr, VecList && vec) {
 	flushBuffer();
-	*output << "<" << name;
+	output << "<" << name;
 	if (attr.size() > 0) {
 		for (auto &it : attr) {
-			*output << " " << it.first << "=\"" << it.second << "\"";
+			output << " " << it.first << "=\"" << it.second << "\"";
 		}
 	}
 	if (!vec.empty()) {
 		for (auto &it : vec) {
-			*output << " " << it.first << "=\"" << it.second << "\"";
+			output << " " << it.first << "=\"" << it.second << "\"";
 		}
 	}
-	*output << ">";
+	output << ">";
 	tagStack.emplace_back(name, 0);
 }
 
 void HtmlOutputProcessor::pushInlineNode(token *t, const StringView &name, InitList &&attr, VecList && vec) {
 	flushBuffer();
-	*output << "<" << name;
+	output << "<" << name;
 	if (attr.size() > 0) {
 		for (auto &it : attr) {
-			*output << " " << it.first << "=\"" << it.second << "\"";
+			output << " " << it.first << "=\"" << it.second << "\"";
 		}
 	}
 	if (!vec.empty()) {
 		for (auto &it : vec) {
-			*output << " " << it.first << "=\"" << it.second << "\"";
+			output << " " << it.first << "=\"" << it.second << "\"";
 		}
 	}
-	*output << " />";
+	output << " />";
 }
 
 void HtmlOutputProcessor::popNode() {
 	flushBuffer();
-	*output << "</" << tagStack.back().first << ">";
+	output << "</" << tagStack.back().first << ">";
 	tagStack.pop_back();
 }
 
 void HtmlOutputProcessor::flushBuffer() {
 	if (buffer.size() > 0) {
-		output->write(buffer.data(), buffer.size());
+		output.append(buffer);
 		if (!tagStack.empty()) {
 			++ tagStack.back().second;
 		}
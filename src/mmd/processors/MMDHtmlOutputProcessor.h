@@ -32,6 +32,27 @@ public:
 	static void run(std::ostream *, const StringView &, const Extensions & = DefaultExtensions);
 	static void run(std::ostream *, memory::pool_t *, const StringView &, const Extensions & = DefaultExtensions);
 
+	// process file from memory mapping, returns false if file can not be read
+	static bool runFile(std::ostream *, const StringView &path, const Extensions & = DefaultExtensions);
+	static bool runFile(std::ostream *, memory::pool_t *, const StringView &path, const Extensions & = DefaultExtensions);
+
+	// process file with existing engine, reusable engine keeps its memory between files
+	static bool runFile(std::ostream *, Engine &, const StringView &path, const Extensions & = DefaultExtensions);
+
+	// same, output is passed to sink with buffering, without std::ostream overhead
+	static void run(OutputSink *, const StringView &, const Extensions & = DefaultExtensions);
+	static void run(OutputSink *, memory::pool_t *, const StringView &, const Extensions & = DefaultExtensions);
+
+	static bool runFile(OutputSink *, const StringView &path, const Extensions & = DefaultExtensions);
+	static bool runFile(OutputSink *, memory::pool_t *, const StringView &path, const Extensions & = DefaultExtensions);
+	static bool runFile(OutputSink *, Engine &, const StringView &path, const Extensions & = DefaultExtensions);
+
+	// progressive mode, output of every top-level block is passed to sink as soon as it's exported
+	static void runProgressive(OutputSink *, const StringView &, size_t maxBufferSize = OutputBuffer::DefaultChunkSize,
+			const Extensions & = DefaultExtensions);
+	static void runProgressive(const OutputCallbackSink::Callback &, const StringView &,
+			size_t maxBufferSize = OutputBuffer::DefaultChunkSize, const Extensions & = DefaultExtensions);
+
 protected:
 	virtual void pushNode(token *t, const StringView &name, InitList &&attr, VecList &&) override;
 	virtual void pushInlineNode(token *t, const StringView &name, InitList &&attr, VecList &&) override;
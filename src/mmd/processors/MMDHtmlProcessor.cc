@@ -25,6 +25,8 @@ THE SOFTWARE.
 #include "MMDEngine.h"
 #include "MMDContent.h"
 #include "MMDCore.h"
+#include "MMDChars.h"
+#include "MMDCache.h"
 #include "SPString.h"
 #include "SPHtmlParser.h"
 
@@ -33,10 +35,28 @@ NS_MMD_BEGIN
 HtmlProcessor::HtmlProcessor() { }
 
 bool HtmlProcessor::init(std::ostream *stream) {
-	output = stream;
+	streamSink = OutputStreamSink(stream);
+	return init(&streamSink);
+}
+
+bool HtmlProcessor::init(OutputSink *sink) {
+	// with segmented sink, source text is passed to sink by reference
+	const bool refs = sink && sink->isSegmented();
+	output.setSink(sink);
+	output.setReferences(refs);
+	buffer.setReferences(refs);
 	return true;
 }
 
+void HtmlProcessor::setProgressive(bool value, size_t maxBufferSize) {
+	progressive = value;
+	output.setChunkSize(maxBufferSize);
+}
+
+void HtmlProcessor::setFragmentCache(HtmlFragmentCache *cache) {
+	fragmentCache = cache;
+}
+
 void HtmlProcessor::process(const Content &c, const StringView &str, const Token &t) {
 	Processor::process(c, str, t);
 
@@ -61,6 +81,10 @@ void HtmlProcessor::processMeta(const StringView &key, const StringView &value)
 
 void HtmlProcessor::processHtml(const Content &c, const StringView &str, const Token &t) {
 	source = str;
+	if (fragmentCache) {
+		fragmentContext = getFragmentContext();
+	}
+
 	if (content->getExtensions().hasFlag(Extensions::Complete)) {
 		startCompleteHtml(c);
 	}
@@ -74,23 +98,81 @@ void HtmlProcessor::processHtml(const Content &c, const StringView &str, const T
 		endCompleteHtml();
 	}
 	flushBuffer();
+	output.flush();
 }
 
-void HtmlProcessor::printHtml(std::ostream &out, const StringView &str) {
-	StringView r(str);
-	while (!r.empty()) {
-		switch(r[0]) {
-		case '"': out << "&quot;"; break;
-		case '&': out << "&amp;"; break;
-		case '<': out << "&lt;"; break;
-		case '>': out << "&gt;"; break;
-		default: out << r[0]; break;
+uint64_t HtmlProcessor::getFragmentContext() const {
+	static constexpr uint64_t k = 0x9E3779B97F4A7C15ULL;
+
+	uint64_t ret = Cache::hash(StringView(typeid(*this).name()));
+	auto mix = [&] (uint64_t value) {
+		ret = (ret ^ value) * k;
+		ret ^= ret >> 29;
+	};
+
+	mix(toInt(content->getExtensions().flags));
+	mix(uint64_t(quotes_lang));
+	mix(base_header_level);
+	mix(spExt ? 1 : 0);
+
+	// links are not included: every block is checked only with definitions it refers to
+	return ret;
+}
+
+uint64_t HtmlProcessor::getLinkDigest(const Content::Link *link) {
+	if (!link) {
+		return 0;
+	}
+
+	uint64_t ret = 0x9E3779B97F4A7C15ULL;
+	auto mix = [&] (uint64_t value) {
+		ret = (ret ^ value) * 0x9E3779B97F4A7C15ULL;
+		ret ^= ret >> 29;
+	};
+
+	mix(link->origin);
+	mix(Cache::hash(link->label_text));
+	mix(Cache::hash(link->clean_text));
+	mix(Cache::hash(link->url));
+	mix(Cache::hash(link->title));
+	for (auto &a : link->attributes) {
+		mix(Cache::hash(a.first));
+		mix(Cache::hash(a.second));
+	}
+
+	return ret ? ret : 1;
+}
+
+Content::Link * HtmlProcessor::getLink(const StringView &label) {
+	auto ret = Processor::getLink(label);
+	if (fragmentDependencies) {
+		fragmentDependencies->emplace_back(HtmlFragmentCache::Dependency{std::string(label.data(), label.size()), getLinkDigest(ret)});
+	}
+	return ret;
+}
+
+void HtmlProcessor::printHtml(OutputBuffer &out, const StringView &str) {
+	auto p = str.data();
+	auto end = p + str.size();
+	while (p < end) {
+		// text before next special char is written with single append
+		auto next = chars::findHtmlEscape(p, end);
+		out.append(p, next - p);
+		if (next == end) {
+			break;
 		}
-		++ r;
+
+		switch (*next) {
+		case '"': out.append("&quot;", 6); break;
+		case '&': out.append("&amp;", 5); break;
+		case '<': out.append("&lt;", 4); break;
+		case '>': out.append("&gt;", 4); break;
+		}
+		p = next + 1;
 	}
 }
 
-void HtmlProcessor::printLocalizedChar(std::ostream &out, uint16_t type) {
+void HtmlProcessor::printLocalizedChar(OutputBuffer &out, uint16_t type) {
 	switch (type) {
 		case DASH_N: out << "&#8211;"; break;
 		case DASH_M: out << "&#8212;"; break;
@@ -216,7 +298,7 @@ void HtmlProcessor::endCompleteHtml() {
 	buffer << "\n</html>\n";
 }
 
-void HtmlProcessor::exportLink(std::ostream &out, token * text, Content::Link * link) {
+void HtmlProcessor::exportLink(OutputBuffer &out, token * text, Content::Link * link) {
 	auto & a = link->attributes;
 	VecList attr; attr.reserve(256 / sizeof(VecList::value_type));
 
@@ -264,7 +346,10 @@ void HtmlProcessor::exportLink(std::ostream &out, token * text, Content::Link *
 	popNode();
 }
 
-void HtmlProcessor::exportImage(std::ostream &out, token * text, Content::Link * link, bool is_figure) {
+void HtmlProcessor::exportImage(OutputBuffer &out, token * text, Content::Link * link, bool is_figure) {
+	// figure ids are numbered through document
+	fragmentCacheable = false;
+
 	auto & a = link->attributes;
 	VecList attr; attr.reserve(256 / sizeof(VecList::value_type));
 
@@ -374,7 +459,7 @@ void HtmlProcessor::exportImage(std::ostream &out, token * text, Content::Link *
 	++ figureId;
 }
 
-void HtmlProcessor::pushHtmlEntity(std::ostream &out, token *t) {
+void HtmlProcessor::pushHtmlEntity(OutputBuffer &out, token *t) {
 	StringView r(&source[t->start], t->len);
 
 	if (r.is('<')) {
@@ -384,7 +469,7 @@ void HtmlProcessor::pushHtmlEntity(std::ostream &out, token *t) {
 	}
 }
 
-void HtmlProcessor::pushHtmlEntityText(std::ostream &out, StringView r, token *t) {
+void HtmlProcessor::pushHtmlEntityText(OutputBuffer &out, StringView r, token *t) {
 	while (!r.empty()) {
 		if (!r.is('<')) {
 			break;
@@ -439,7 +524,11 @@ void HtmlProcessor::pushHtmlEntityText(std::ostream &out, StringView r, token *t
 				pushNode(nullptr, name, { }, move(attrs));
 			}
 
-			out << r.readUntil<StringView::Chars<'<'>>();
+			// raw text up to next tag
+			auto next = (const char *)memchr(r.data(), '<', r.size());
+			auto len = next ? size_t(next - r.data()) : r.size();
+			out.append(r.data(), len);
+			r += len;
 		}
 	}
 
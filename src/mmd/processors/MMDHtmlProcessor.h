@@ -24,6 +24,7 @@ THE SOFTWARE.
 #define MMD_PROCESSORS_MMDHTMLPROCESSOR_H_
 
 #include "MMDProcessor.h"
+#include "MMDHtmlFragmentCache.h"
 
 NS_MMD_BEGIN
 
@@ -36,85 +37,104 @@ public:
 	virtual ~HtmlProcessor() { }
 
 	virtual bool init(std::ostream *);
+	virtual bool init(OutputSink *);
 	virtual void process(const Content &, const StringView &, const Token &);
 
+	// Progressive mode: output is passed to sink after every top-level block and when buffered data
+	// reaches maxBufferSize; lists of footnotes, glossary and citations are written after the last block
+	void setProgressive(bool, size_t maxBufferSize = OutputBuffer::DefaultChunkSize);
+	bool isProgressive() const { return progressive; }
+
+	// Rendered top-level blocks are taken from cache, when block and its context are not changed.
+	// Cache is used only with sink, and should be valid until processing is finished
+	void setFragmentCache(HtmlFragmentCache *);
+	HtmlFragmentCache *getFragmentCache() const { return fragmentCache; }
+
 protected:
 	virtual void processMeta(const StringView &, const StringView &);
 	virtual void processHtml(const Content &, const StringView &, const Token &);
 
-	void pad(std::ostream &, uint16_t num);
-	void printHtml(std::ostream &, const StringView &);
-	void printLocalizedChar(std::ostream &, uint16_t type);
+	uint64_t getFragmentContext() const;
+	static uint64_t getLinkDigest(const Content::Link *);
+
+	virtual Content::Link * getLink(const StringView &) override;
+
+	void pad(OutputBuffer &, uint16_t num);
+	void printHtml(OutputBuffer &, const StringView &);
+	void printLocalizedChar(OutputBuffer &, uint16_t type);
 
 	bool shouldWriteMeta(const StringView &);
 
 	void startCompleteHtml(const Content &c);
 	void endCompleteHtml();
 
-	void exportToken(std::ostream &, token *t);
-	void exportTokenTree(std::ostream &, token *t);
+	void exportToken(OutputBuffer &, token *t);
+	void exportTokenTree(OutputBuffer &, token *t);
+	void exportBlocks(OutputBuffer &, token *t);
+	void exportCachedBlock(OutputBuffer &, token *t);
+	void resolveBlock(token *t); // apply deferred shifts, see Engine::setLazyBlocks
 
-	void exportTokenRaw(std::ostream &, token *t);
-	void exportTokenTreeRaw(std::ostream &, token *t);
+	void exportTokenRaw(OutputBuffer &, token *t);
+	void exportTokenTreeRaw(OutputBuffer &, token *t);
 
 	void makeTokenHash(const Function<void(const StringView &)> &, token *t);
 	void makeTokenTreeHash(const Function<void(const StringView &)> &, token *t);
 
-	void exportTokenMath(std::ostream &, token *t);
-	void exportTokenTreeMath(std::ostream &, token *t);
-
-	void exportFootnoteList(std::ostream &);
-	void exportGlossaryList(std::ostream &);
-	void exportCitationList(std::ostream &);
-
-	void exportBlockquote(std::ostream &, token *t);
-	void exportDefinition(std::ostream &, token *t);
-	void exportDefList(std::ostream &, token *t);
-	void exportDefTerm(std::ostream &, token *t);
-	void exportFencedCodeBlock(std::ostream &,token *t);
-	void exportIndentedCodeBlock(std::ostream &, token *t);
-	void exportHeader(std::ostream &, token *t);
-	void exportHr(std::ostream &);
-	void exportHtml(std::ostream &, token *t);
-	void exportListBulleted(std::ostream &, token *t);
-	void exportListEnumerated(std::ostream &, token *t);
-	void exportListItem(std::ostream &, token *t, bool tight);
-	void exportDefinitionBlock(std::ostream &, token *t);
-	void exportHeaderText(std::ostream &, token *t, uint8_t level);
-	void exportTable(std::ostream &, token *t);
-	void exportTableHeader(std::ostream &, token *t);
-	void exportTableSection(std::ostream &, token *t);
-	void exportTableCell(std::ostream &, token *t);
-	void exportTableRow(std::ostream &, token *t);
-	void exportToc(std::ostream &, token *t);
-	void exportTocEntry(std::ostream &, size_t &counter, uint16_t level);
-
-	void exportBacktick(std::ostream &, token *t);
-	void exportPairBacktick(std::ostream &, token *t);
-	void exportPairAngle(std::ostream &, token *t);
-	void exportPairBracketImage(std::ostream &, token *t);
-	void exportPairBracketAbbreviation(std::ostream &, token *t);
-	void exportPairBracketCitation(std::ostream &, token *t);
-	void exportPairBracketFootnote(std::ostream &, token *t);
-	void exportPairBracketGlossary(std::ostream &, token *t);
-	void exportPairBracketVariable(std::ostream &, token *t);
-
-	void exportCriticAdd(std::ostream &, token *t);
-	void exportCriticDel(std::ostream &, token *t);
-	void exportCriticCom(std::ostream &, token *t);
-	void exportCriticHi(std::ostream &, token *t);
-	void exportCriticPairSubDel(std::ostream &, token *t);
-	void exportCriticPairSubAdd(std::ostream &, token *t);
-
-	void exportMath(std::ostream &, token *t);
-	void exportSubscript(std::ostream &, token *t);
-	void exportSuperscript(std::ostream &, token *t);
-	void exportLineBreak(std::ostream &, token *t);
-
-	void exportLink(std::ostream &, token * text, Content::Link * link);
-	void exportImage(std::ostream &, token * text, Content::Link * link, bool is_figure);
-
-	virtual void pushHtmlEntity(std::ostream &, token *t);
+	void exportTokenMath(OutputBuffer &, token *t);
+	void exportTokenTreeMath(OutputBuffer &, token *t);
+
+	void exportFootnoteList(OutputBuffer &);
+	void exportGlossaryList(OutputBuffer &);
+	void exportCitationList(OutputBuffer &);
+
+	void exportBlockquote(OutputBuffer &, token *t);
+	void exportDefinition(OutputBuffer &, token *t);
+	void exportDefList(OutputBuffer &, token *t);
+	void exportDefTerm(OutputBuffer &, token *t);
+	void exportFencedCodeBlock(OutputBuffer &,token *t);
+	void exportIndentedCodeBlock(OutputBuffer &, token *t);
+	void exportHeader(OutputBuffer &, token *t);
+	void exportHr(OutputBuffer &);
+	void exportHtml(OutputBuffer &, token *t);
+	void exportListBulleted(OutputBuffer &, token *t);
+	void exportListEnumerated(OutputBuffer &, token *t);
+	void exportListItem(OutputBuffer &, token *t, bool tight);
+	void exportDefinitionBlock(OutputBuffer &, token *t);
+	void exportHeaderText(OutputBuffer &, token *t, uint8_t level);
+	void exportTable(OutputBuffer &, token *t);
+	void exportTableHeader(OutputBuffer &, token *t);
+	void exportTableSection(OutputBuffer &, token *t);
+	void exportTableCell(OutputBuffer &, token *t);
+	void exportTableRow(OutputBuffer &, token *t);
+	void exportToc(OutputBuffer &, token *t);
+	void exportTocEntry(OutputBuffer &, size_t &counter, uint16_t level);
+
+	void exportBacktick(OutputBuffer &, token *t);
+	void exportPairBacktick(OutputBuffer &, token *t);
+	void exportPairAngle(OutputBuffer &, token *t);
+	void exportPairBracketImage(OutputBuffer &, token *t);
+	void exportPairBracketAbbreviation(OutputBuffer &, token *t);
+	void exportPairBracketCitation(OutputBuffer &, token *t);
+	void exportPairBracketFootnote(OutputBuffer &, token *t);
+	void exportPairBracketGlossary(OutputBuffer &, token *t);
+	void exportPairBracketVariable(OutputBuffer &, token *t);
+
+	void exportCriticAdd(OutputBuffer &, token *t);
+	void exportCriticDel(OutputBuffer &, token *t);
+	void exportCriticCom(OutputBuffer &, token *t);
+	void exportCriticHi(OutputBuffer &, token *t);
+	void exportCriticPairSubDel(OutputBuffer &, token *t);
+	void exportCriticPairSubAdd(OutputBuffer &, token *t);
+
+	void exportMath(OutputBuffer &, token *t);
+	void exportSubscript(OutputBuffer &, token *t);
+	void exportSuperscript(OutputBuffer &, token *t);
+	void exportLineBreak(OutputBuffer &, token *t);
+
+	void exportLink(OutputBuffer &, token * text, Content::Link * link);
+	void exportImage(OutputBuffer &, token * text, Content::Link * link, bool is_figure);
+
+	virtual void pushHtmlEntity(OutputBuffer &, token *t);
 
 	virtual void pushNode(token *t, const StringView &name, InitList &&attr = InitList(), VecList && = VecList()) = 0;
 	virtual void pushInlineNode(token *t, const StringView &name, InitList &&attr = InitList(), VecList && = VecList()) = 0;
@@ -122,12 +142,18 @@ protected:
 	virtual void flushBuffer() = 0;
 
 protected:
-	virtual void pushHtmlEntityText(std::ostream &out, StringView r, token *t = nullptr);
+	virtual void pushHtmlEntityText(OutputBuffer &out, StringView r, token *t = nullptr);
 
 	bool spExt = false;
+	bool progressive = false;
+	bool fragmentCacheable = false;
+	HtmlFragmentCache *fragmentCache = nullptr;
+	HtmlFragmentCache::Dependencies *fragmentDependencies = nullptr; // link lookups of exported block
+	uint64_t fragmentContext = 0;
 	uint8_t html_header_level = maxOf<uint8_t>();
-	std::ostream *output = nullptr;
-	StringStream buffer;
+	OutputStreamSink streamSink; // sink for init with std::ostream
+	OutputBuffer output; // nodes and flushed text, passed to sink
+	OutputBuffer buffer; // text for current node
 	uint32_t figureId = 0;
 };
 
@@ -51,7 +51,7 @@ NS_MMD_BEGIN
 
 using Traits = string::ToStringTraits<memory::PoolInterface>;
 
-void HtmlProcessor::exportBlockquote(std::ostream &out, token *t) {
+void HtmlProcessor::exportBlockquote(OutputBuffer &out, token *t) {
 	pad(out, 2);
 	pushNode(t, "blockquote");
 	if (!spExt) { out << "\n"; }
@@ -62,7 +62,7 @@ void HtmlProcessor::exportBlockquote(std::ostream &out, token *t) {
 	padded = 0;
 }
 
-void HtmlProcessor::exportDefinition(std::ostream &out, token *t) {
+void HtmlProcessor::exportDefinition(OutputBuffer &out, token *t) {
 	pad(out, 2);
 	pushNode(t, "dd");
 
@@ -80,7 +80,7 @@ void HtmlProcessor::exportDefinition(std::ostream &out, token *t) {
 	list_is_tight = temp_short;
 }
 
-void HtmlProcessor::exportDefList(std::ostream &out, token *t) {
+void HtmlProcessor::exportDefList(OutputBuffer &out, token *t) {
 	pad(out, 2);
 
 	// Group consecutive definition lists into a single list.
@@ -102,7 +102,7 @@ void HtmlProcessor::exportDefList(std::ostream &out, token *t) {
 	padded = 1;
 }
 
-void HtmlProcessor::exportDefTerm(std::ostream &out, token *t) {
+void HtmlProcessor::exportDefTerm(OutputBuffer &out, token *t) {
 	pad(out, 2);
 	pushNode(t, "dt");
 	exportTokenTree(out, t->child);
@@ -111,7 +111,7 @@ void HtmlProcessor::exportDefTerm(std::ostream &out, token *t) {
 	padded = 2;
 }
 
-void HtmlProcessor::exportFencedCodeBlock(std::ostream &out, token *t) {
+void HtmlProcessor::exportFencedCodeBlock(OutputBuffer &out, token *t) {
 	pad(out, 2);
 
 	token * temp_token = nullptr;
@@ -154,7 +154,7 @@ void HtmlProcessor::exportFencedCodeBlock(std::ostream &out, token *t) {
 	padded = 0;
 }
 
-void HtmlProcessor::exportIndentedCodeBlock(std::ostream &out, token *t) {
+void HtmlProcessor::exportIndentedCodeBlock(OutputBuffer &out, token *t) {
 	pad(out, 2);
 	pushNode(t, "pre"); pushNode(nullptr, "code");
 
@@ -216,7 +216,7 @@ static Pair<Content::String, Content::String> HtmlProcessor_decodeHeaderLabel(co
 	}
 }
 
-void HtmlProcessor::exportHeader(std::ostream &out, token *t) {
+void HtmlProcessor::exportHeader(OutputBuffer &out, token *t) {
 	pad(out, 2);
 	auto h_idx = t->type - BLOCK_H1  + base_header_level;
 
@@ -238,19 +238,19 @@ void HtmlProcessor::exportHeader(std::ostream &out, token *t) {
 	padded = 0;
 }
 
-void HtmlProcessor::exportHr(std::ostream &out) {
+void HtmlProcessor::exportHr(OutputBuffer &out) {
 	pad(out, 2);
 	pushInlineNode(nullptr, "hr");
 	padded = 0;
 }
 
-void HtmlProcessor::exportHtml(std::ostream &out, token *t) {
+void HtmlProcessor::exportHtml(OutputBuffer &out, token *t) {
 	pad(out, 2);
 	pushHtmlEntity(out, t);
 	padded = 1;
 }
 
-void HtmlProcessor::exportListBulleted(std::ostream &out, token *t) {
+void HtmlProcessor::exportListBulleted(OutputBuffer &out, token *t) {
 	auto temp_short = list_is_tight;
 
 	switch (t->type) {
@@ -322,7 +322,7 @@ static token * HtmlProcessor_findBullet(token *t) {
 	return nullptr;
 }
 
-void HtmlProcessor::exportListEnumerated(std::ostream &out, token *t) {
+void HtmlProcessor::exportListEnumerated(OutputBuffer &out, token *t) {
 	auto temp_short = list_is_tight;
 
 	switch (t->type) {
@@ -358,7 +358,7 @@ void HtmlProcessor::exportListEnumerated(std::ostream &out, token *t) {
 	list_is_tight = temp_short;
 }
 
-void HtmlProcessor::exportListItem(std::ostream &out, token *t, bool tight) {
+void HtmlProcessor::exportListItem(OutputBuffer &out, token *t, bool tight) {
 	pad(out, 1);
 	pushNode(t, "li");
 	if (tight) {
@@ -386,7 +386,7 @@ void HtmlProcessor::exportListItem(std::ostream &out, token *t, bool tight) {
 	padded = 0;
 }
 
-void HtmlProcessor::exportDefinitionBlock(std::ostream &out, token *t) {
+void HtmlProcessor::exportDefinitionBlock(OutputBuffer &out, token *t) {
 	pad(out, 2);
 
 	bool open_para = !list_is_tight;
@@ -475,7 +475,7 @@ void HtmlProcessor::exportDefinitionBlock(std::ostream &out, token *t) {
 	padded = 0;
 }
 
-void HtmlProcessor::exportHeaderText(std::ostream &out, token *t, uint8_t level) {
+void HtmlProcessor::exportHeaderText(OutputBuffer &out, token *t, uint8_t level) {
 	pad(out, 2);
 	auto temp_short = level;
 
@@ -497,7 +497,7 @@ void HtmlProcessor::exportHeaderText(std::ostream &out, token *t, uint8_t level)
 	padded = 0;
 }
 
-void HtmlProcessor::exportTable(std::ostream &out, token *t) {
+void HtmlProcessor::exportTable(OutputBuffer &out, token *t) {
 	pad(out, 2);
 
 	pushNode(t, "table");
@@ -507,6 +507,9 @@ void HtmlProcessor::exportTable(std::ostream &out, token *t) {
 
 	// Are we followed by a caption?
 	if (table_has_caption(t)) {
+		// caption is taken from next block
+		fragmentCacheable = false;
+
 		auto temp_token = t->next->child;
 		if (temp_token->next && temp_token->next->type == PAIR_BRACKET) {
 			temp_token = temp_token->next;
@@ -552,7 +555,7 @@ void HtmlProcessor::exportTable(std::ostream &out, token *t) {
 	skip_token = temp_short;
 }
 
-void HtmlProcessor::exportTableHeader(std::ostream &out, token *t) {
+void HtmlProcessor::exportTableHeader(OutputBuffer &out, token *t) {
 	pad(out, 2);
 	pushNode(t, "thead");
 	if (!spExt) { out << "\n"; }
@@ -564,7 +567,7 @@ void HtmlProcessor::exportTableHeader(std::ostream &out, token *t) {
 	padded = 1;
 }
 
-void HtmlProcessor::exportTableSection(std::ostream &out, token *t) {
+void HtmlProcessor::exportTableSection(OutputBuffer &out, token *t) {
 	pad(out, 2);
 	pushNode(t, "tbody");
 	if (!spExt) { out << "\n"; }
@@ -594,7 +597,7 @@ static StringView getTableAlignmentStyle(uint8_t a) {
 	return StringView();
 }
 
-void HtmlProcessor::exportTableCell(std::ostream &out, token *t) {
+void HtmlProcessor::exportTableCell(OutputBuffer &out, token *t) {
 	out << "\t";
 	if (t->next && t->next->type == TABLE_DIVIDER && t->next->len > 1) {
 		String colspan = Traits::toString(t->next->len);
@@ -636,7 +639,7 @@ void HtmlProcessor::exportTableCell(std::ostream &out, token *t) {
 	}
 }
 
-void HtmlProcessor::exportTableRow(std::ostream &out, token *t) {
+void HtmlProcessor::exportTableRow(OutputBuffer &out, token *t) {
 	pushNode(t, "tr");
 	if (!spExt) { out << "\n"; }
 	table_cell_count = 0;
@@ -645,7 +648,10 @@ void HtmlProcessor::exportTableRow(std::ostream &out, token *t) {
 	if (!spExt) { out << "\n"; }
 }
 
-void HtmlProcessor::exportToc(std::ostream &out, token *t) {
+void HtmlProcessor::exportToc(OutputBuffer &out, token *t) {
+	// output depends on document state, so block can not be cached
+	fragmentCacheable = false;
+
 	if (!spExt) {
 		pad(out, 2);
 		pushNode(t, "div", { pair("class", "TOC") });
@@ -657,7 +663,7 @@ void HtmlProcessor::exportToc(std::ostream &out, token *t) {
 	}
 }
 
-void HtmlProcessor::exportTocEntry(std::ostream &out, size_t &counter, uint16_t level) {
+void HtmlProcessor::exportTocEntry(OutputBuffer &out, size_t &counter, uint16_t level) {
 	token * entry, * next;
 	short entry_level, next_level;
 
@@ -707,7 +713,7 @@ void HtmlProcessor::exportTocEntry(std::ostream &out, size_t &counter, uint16_t
 	if (!spExt) { out << "\n"; }
 }
 
-void HtmlProcessor::exportBacktick(std::ostream &out, token *t) {
+void HtmlProcessor::exportBacktick(OutputBuffer &out, token *t) {
 	if (t->mate == NULL) {
 		out << printToken(source, t);
 	} else if (t->mate->type == QUOTE_RIGHT_ALT)
@@ -722,7 +728,7 @@ void HtmlProcessor::exportBacktick(std::ostream &out, token *t) {
 	}
 }
 
-void HtmlProcessor::exportPairBacktick(std::ostream &out, token *t) {
+void HtmlProcessor::exportPairBacktick(OutputBuffer &out, token *t) {
 	// Strip leading whitespace
 	switch (t->child->next->type) {
 		case TEXT_NL:
@@ -777,7 +783,7 @@ void HtmlProcessor::exportPairBacktick(std::ostream &out, token *t) {
 	popNode();
 }
 
-void HtmlProcessor::exportPairAngle(std::ostream &out, token *t) {
+void HtmlProcessor::exportPairAngle(OutputBuffer &out, token *t) {
 	auto temp_char = url_accept(source.data(), t->start + 1, t->len - 2, NULL, true);
 
 	if (!temp_char.empty()) {
@@ -802,7 +808,7 @@ void HtmlProcessor::exportPairAngle(std::ostream &out, token *t) {
 	}
 }
 
-void HtmlProcessor::exportPairBracketImage(std::ostream &out, token *t) {
+void HtmlProcessor::exportPairBracketImage(OutputBuffer &out, token *t) {
 	int16_t temp_short = 0;
 	Content::Link *temp_link = parseBrackets(t, &temp_short);
 
@@ -822,7 +828,10 @@ void HtmlProcessor::exportPairBracketImage(std::ostream &out, token *t) {
 	exportTokenTree(out, t->child);
 }
 
-void HtmlProcessor::exportPairBracketAbbreviation(std::ostream &out, token *t) {
+void HtmlProcessor::exportPairBracketAbbreviation(OutputBuffer &out, token *t) {
+	// output depends on document state, so block can not be cached
+	fragmentCacheable = false;
+
 	// Which might also be an "auto-tagged" abbreviation
 	if (content->getExtensions().hasFlag(Extensions::Notes)) {
 		// Note-based syntax enabled
@@ -903,7 +912,10 @@ void HtmlProcessor::exportPairBracketAbbreviation(std::ostream &out, token *t) {
 	}
 }
 
-void HtmlProcessor::exportPairBracketCitation(std::ostream &out, token *t) {
+void HtmlProcessor::exportPairBracketCitation(OutputBuffer &out, token *t) {
+	// output depends on document state, so block can not be cached
+	fragmentCacheable = false;
+
 	auto temp_bool = true;		// Track whether this is regular vs 'not cited'
 	auto temp_token = t;			// Remember whether we need to skip ahead
 
@@ -988,7 +1000,10 @@ void HtmlProcessor::exportPairBracketCitation(std::ostream &out, token *t) {
 	}
 }
 
-void HtmlProcessor::exportPairBracketFootnote(std::ostream &out, token *t) {
+void HtmlProcessor::exportPairBracketFootnote(OutputBuffer &out, token *t) {
+	// output depends on document state, so block can not be cached
+	fragmentCacheable = false;
+
 	if (content->getExtensions().hasFlag(Extensions::Notes)) {
 		// Note-based syntax enabled
 
@@ -1030,7 +1045,10 @@ void HtmlProcessor::exportPairBracketFootnote(std::ostream &out, token *t) {
 	}
 }
 
-void HtmlProcessor::exportPairBracketGlossary(std::ostream &out, token *t) {
+void HtmlProcessor::exportPairBracketGlossary(OutputBuffer &out, token *t) {
+	// output depends on document state, so block can not be cached
+	fragmentCacheable = false;
+
 	// Which might also be an "auto-tagged" glossary
 	if (content->getExtensions().hasFlag(Extensions::Notes)) {
 		// Note-based syntax enabled
@@ -1067,7 +1085,10 @@ void HtmlProcessor::exportPairBracketGlossary(std::ostream &out, token *t) {
 	}
 }
 
-void HtmlProcessor::exportPairBracketVariable(std::ostream &out, token *t) {
+void HtmlProcessor::exportPairBracketVariable(OutputBuffer &out, token *t) {
+	// output depends on document state, so block can not be cached
+	fragmentCacheable = false;
+
 	auto temp_char = text_inside_pair(source, t);
 	if (temp_char.is('%')) {
 		++ temp_char;
@@ -1101,7 +1122,7 @@ void HtmlProcessor::exportPairBracketVariable(std::ostream &out, token *t) {
 	}
 }
 
-void HtmlProcessor::exportCriticAdd(std::ostream &out, token *t) {
+void HtmlProcessor::exportCriticAdd(OutputBuffer &out, token *t) {
 	// Ignore if we're rejecting
 	if (content->getExtensions().hasFlag(Extensions::CriticReject)) {
 		return;
@@ -1123,7 +1144,7 @@ void HtmlProcessor::exportCriticAdd(std::ostream &out, token *t) {
 	}
 }
 
-void HtmlProcessor::exportCriticDel(std::ostream &out, token *t) {
+void HtmlProcessor::exportCriticDel(OutputBuffer &out, token *t) {
 	// Ignore if we're accepting
 	if (content->getExtensions().hasFlag(Extensions::CriticAccept)) {
 		return;
@@ -1145,7 +1166,7 @@ void HtmlProcessor::exportCriticDel(std::ostream &out, token *t) {
 	}
 }
 
-void HtmlProcessor::exportCriticCom(std::ostream &out, token *t) {
+void HtmlProcessor::exportCriticCom(OutputBuffer &out, token *t) {
 	// Ignore if we're rejecting or accepting
 	if (content->getExtensions().hasFlag(Extensions::CriticReject) ||
 			content->getExtensions().hasFlag(Extensions::CriticAccept)) {
@@ -1164,7 +1185,7 @@ void HtmlProcessor::exportCriticCom(std::ostream &out, token *t) {
 	}
 }
 
-void HtmlProcessor::exportCriticHi(std::ostream &out, token *t) {
+void HtmlProcessor::exportCriticHi(OutputBuffer &out, token *t) {
 	// Ignore if we're rejecting or accepting
 	if (content->getExtensions().hasFlag(Extensions::CriticReject) ||
 			content->getExtensions().hasFlag(Extensions::CriticAccept)) {
@@ -1182,7 +1203,7 @@ void HtmlProcessor::exportCriticHi(std::ostream &out, token *t) {
 	}
 }
 
-void HtmlProcessor::exportCriticPairSubDel(std::ostream &out, token *t) {
+void HtmlProcessor::exportCriticPairSubDel(OutputBuffer &out, token *t) {
 	if (content->getExtensions().hasFlag(Extensions::Critic) &&
 	        (t->next) && (t->next->type == PAIR_CRITIC_SUB_ADD)) {
 		t->child->type = TEXT_EMPTY;
@@ -1202,7 +1223,7 @@ void HtmlProcessor::exportCriticPairSubDel(std::ostream &out, token *t) {
 	}
 }
 
-void HtmlProcessor::exportCriticPairSubAdd(std::ostream &out, token *t) {
+void HtmlProcessor::exportCriticPairSubAdd(OutputBuffer &out, token *t) {
 	if (content->getExtensions().hasFlag(Extensions::Critic) &&
 	        (t->prev) && (t->prev->type == PAIR_CRITIC_SUB_DEL)) {
 		t->child->type = TEXT_EMPTY;
@@ -1222,13 +1243,13 @@ void HtmlProcessor::exportCriticPairSubAdd(std::ostream &out, token *t) {
 	}
 }
 
-void HtmlProcessor::exportMath(std::ostream &out, token *t) {
+void HtmlProcessor::exportMath(OutputBuffer &out, token *t) {
 	pushNode(t, "span", { pair("class", "math") });
 	exportTokenTreeMath(out, t->child);
 	popNode();
 }
 
-void HtmlProcessor::exportSubscript(std::ostream &out, token *t) {
+void HtmlProcessor::exportSubscript(OutputBuffer &out, token *t) {
 	if (t->mate) {
 		((t->start < t->mate->start) ? pushNode(nullptr, "sub") : popNode());
 	} else if (t->len != 1) {
@@ -1240,7 +1261,7 @@ void HtmlProcessor::exportSubscript(std::ostream &out, token *t) {
 	}
 }
 
-void HtmlProcessor::exportSuperscript(std::ostream &out, token *t) {
+void HtmlProcessor::exportSuperscript(OutputBuffer &out, token *t) {
 	if (t->mate) {
 		((t->start < t->mate->start) ? pushNode(nullptr, "sup") : popNode());
 	} else if (t->len != 1) {
@@ -1252,7 +1273,7 @@ void HtmlProcessor::exportSuperscript(std::ostream &out, token *t) {
 	}
 }
 
-void HtmlProcessor::exportLineBreak(std::ostream &out, token *t) {
+void HtmlProcessor::exportLineBreak(OutputBuffer &out, token *t) {
 	if (t->next) {
 		pushInlineNode(t, "br");
 		if (!spExt) { out << "\n"; }
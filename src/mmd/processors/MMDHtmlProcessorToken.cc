@@ -44,6 +44,7 @@
 #include "MMDEngine.h"
 #include "MMDContent.h"
 #include "MMDChars.h"
+#include "MMDCache.h"
 #include "MMDCore.h"
 #include "SPString.h"
 
@@ -55,7 +56,30 @@ static inline StringView printToken(const StringView & source, token * t) {
 	return StringView(&(source[t->start]), t->len);
 }
 
-void HtmlProcessor::pad(std::ostream &out, uint16_t num) {
+// passes output to target sink and keeps copy of it for fragment cache
+class HtmlProcessor_FragmentSink : public OutputSink {
+public:
+	HtmlProcessor_FragmentSink(OutputSink *sink) : target(sink) { }
+
+	virtual bool write(const char *d, size_t size) override {
+		data.append(d, size);
+		return target->write(d, size);
+	}
+
+	virtual bool write(const OutputSegment *segments, size_t count) override {
+		for (size_t i = 0; i < count; ++ i) {
+			data.append(segments[i].data, segments[i].size);
+		}
+		return target->write(segments, count);
+	}
+
+	virtual bool isSegmented() const override { return target->isSegmented(); }
+
+	OutputSink *target;
+	std::string data;
+};
+
+void HtmlProcessor::pad(OutputBuffer &out, uint16_t num) {
 	if (!spExt) {
 		while (num > padded) {
 			out << '\n';
@@ -64,7 +88,7 @@ void HtmlProcessor::pad(std::ostream &out, uint16_t num) {
 	}
 }
 
-void HtmlProcessor::exportToken(std::ostream &out, token * t) {
+void HtmlProcessor::exportToken(OutputBuffer &out, token * t) {
 	if (t == NULL) {
 		return;
 	}
@@ -297,7 +321,11 @@ void HtmlProcessor::exportToken(std::ostream &out, token * t) {
 			break;
 
 		case DOC_START_TOKEN:
-			exportTokenTree(out, t->child);
+			if ((progressive || fragmentCache) && &out == &buffer) {
+				exportBlocks(out, t->child);
+			} else {
+				exportTokenTree(out, t->child);
+			}
 			break;
 
 		case ELLIPSIS:
@@ -662,7 +690,7 @@ void HtmlProcessor::exportToken(std::ostream &out, token * t) {
 		case TEXT_PERIOD:
 		case TEXT_PLAIN:
 		case TOC:
-			out << printToken(source, t);
+			out.appendRef(printToken(source, t));
 			break;
 
 		case UL:
@@ -677,7 +705,7 @@ void HtmlProcessor::exportToken(std::ostream &out, token * t) {
 }
 
 
-void HtmlProcessor::exportTokenTree(std::ostream &out, token *t) {
+void HtmlProcessor::exportTokenTree(OutputBuffer &out, token *t) {
 	// Prevent stack overflow with "dangerous" input causing extreme recursion
 	if (recurse_depth == kMaxExportRecursiveDepth) {
 		return;
@@ -695,7 +723,90 @@ void HtmlProcessor::exportTokenTree(std::ostream &out, token *t) {
 	recurse_depth--;
 }
 
-void HtmlProcessor::exportTokenRaw(std::ostream &out, token *t) {
+void HtmlProcessor::exportBlocks(OutputBuffer &out, token *t) {
+	recurse_depth++;
+	while (t != NULL) {
+		if (skip_token) {
+			skip_token--;
+		} else if (fragmentCache && output.getSink()) {
+			exportCachedBlock(out, t);
+		} else {
+			resolveBlock(t);
+			exportToken(out, t);
+		}
+
+		// block is complete, so it can be passed to sink
+		flushBuffer();
+		if (progressive) {
+			output.flush();
+		}
+		t = t->next;
+	}
+	recurse_depth--;
+}
+
+void HtmlProcessor::exportCachedBlock(OutputBuffer &out, token *t) {
+	// block source ends where next block starts, so it includes all nested tokens
+	size_t end = t->start + t->len;
+	if (t->next) {
+		end = std::max(end, size_t(t->next->start));
+	}
+	auto src = StringView(source.data() + t->start, std::min(end, source.size()) - t->start);
+
+	// state of processor before block, that affects output; table takes caption from the next block,
+	// tables with caption are not cached, so cached table can not be used, when caption is added
+	const bool caption = (t->type == BLOCK_TABLE) && table_has_caption(t);
+	const uint64_t state = uint64_t(t->type) | (uint64_t(uint16_t(padded)) << 16)
+			| (uint64_t(close_para) << 32) | (uint64_t(list_is_tight) << 33) | (uint64_t(caption) << 34);
+	const uint64_t context = fragmentContext + 0x9E3779B97F4A7C15ULL * (state + 1);
+	const HtmlFragmentCache::Block block{Cache::hash(src) ^ context, context, src};
+
+	flushBuffer();
+
+	HtmlFragmentCache::State exitState;
+	if (fragmentCache->read(block, [&] (const StringView &label) {
+		return getLinkDigest(content->getLink(label));
+	}, output, exitState)) {
+		padded = exitState.padded;
+		close_para = exitState.closePara;
+		return;
+	}
+
+	resolveBlock(t);
+
+	// block output is passed to sink through capture, so it can be stored in cache
+	auto sink = output.getSink();
+	HtmlProcessor_FragmentSink capture(sink);
+	output.setSink(&capture);
+
+	HtmlFragmentCache::Dependencies deps;
+	fragmentDependencies = &deps;
+	fragmentCacheable = true;
+	exportToken(out, t);
+	flushBuffer();
+	fragmentDependencies = nullptr;
+
+	output.setSink(sink);
+
+	if (fragmentCacheable && skip_token == 0) {
+		exitState.padded = padded;
+		exitState.closePara = close_para;
+		fragmentCache->write(block, move(deps), StringView(capture.data), exitState);
+	} else {
+		fragmentCache->skip();
+	}
+	fragmentCacheable = false;
+}
+
+// table takes caption from the next block
+void HtmlProcessor::resolveBlock(token *t) {
+	content->resolveShift(t);
+	if (t->type == BLOCK_TABLE && t->next) {
+		content->resolveShift(t->next);
+	}
+}
+
+void HtmlProcessor::exportTokenRaw(OutputBuffer &out, token *t) {
 	if (t == nullptr) {
 		return;
 	}
@@ -808,7 +919,7 @@ void HtmlProcessor::exportTokenRaw(std::ostream &out, token *t) {
 	}
 }
 
-void HtmlProcessor::exportTokenTreeRaw(std::ostream &out, token *t) {
+void HtmlProcessor::exportTokenTreeRaw(OutputBuffer &out, token *t) {
 	while (t != NULL) {
 		if (skip_token) {
 			skip_token--;
@@ -855,7 +966,7 @@ void HtmlProcessor::makeTokenTreeHash(const Function<void(const StringView &)> &
 	}
 }
 
-void HtmlProcessor::exportTokenMath(std::ostream &out, token *t) {
+void HtmlProcessor::exportTokenMath(OutputBuffer &out, token *t) {
 	if (t == NULL) {
 		return;
 	}
@@ -927,7 +1038,7 @@ void HtmlProcessor::exportTokenMath(std::ostream &out, token *t) {
 	}
 }
 
-void HtmlProcessor::exportTokenTreeMath(std::ostream &out, token *t) {
+void HtmlProcessor::exportTokenTreeMath(OutputBuffer &out, token *t) {
 	while (t != NULL) {
 		if (skip_token) {
 			skip_token--;
@@ -939,7 +1050,7 @@ void HtmlProcessor::exportTokenTreeMath(std::ostream &out, token *t) {
 	}
 }
 
-void HtmlProcessor::exportFootnoteList(std::ostream &out) {
+void HtmlProcessor::exportFootnoteList(OutputBuffer &out) {
 	if (!used_footnotes.empty()) {
 		token * content;
 
@@ -1001,7 +1112,7 @@ void HtmlProcessor::exportFootnoteList(std::ostream &out) {
 	}
 }
 
-void HtmlProcessor::exportGlossaryList(std::ostream &out) {
+void HtmlProcessor::exportGlossaryList(OutputBuffer &out) {
 	if (!used_glossaries.empty()) {
 		token * content;
 
@@ -1050,7 +1161,15 @@ void HtmlProcessor::exportGlossaryList(std::ostream &out) {
 
 			content = note->content;
 			glossary_being_printed = i + 1;
-			exportTokenTree(out, content);
+			if (!note->source.empty()) {
+				// definition from shared search targets
+				auto docSource = source;
+				source = note->source;
+				exportTokenTree(out, content);
+				source = docSource;
+			} else {
+				exportTokenTree(out, content);
+			}
 			pad(out, 1);
 			popNode();
 			padded = 0;
@@ -1066,7 +1185,7 @@ void HtmlProcessor::exportGlossaryList(std::ostream &out) {
 	}
 }
 
-void HtmlProcessor::exportCitationList(std::ostream &out) {
+void HtmlProcessor::exportCitationList(OutputBuffer &out) {
 	if (!used_citations.empty()) {
 		token * content;
 
@@ -0,0 +1,346 @@
+/**
+Copyright (c) 2017 Roman Katuntsev <sbkarr@stappler.org>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+**/
+
+#include "SPCommon.h"
+#include "MMDOutputBuffer.h"
+
+#include <unistd.h>
+#include <limits.h>
+#include <sys/uio.h>
+
+NS_MMD_BEGIN
+
+bool OutputSink::write(const OutputSegment *segments, size_t count) {
+	bool ret = true;
+	for (size_t i = 0; i < count; ++ i) {
+		if (!write(segments[i].data, segments[i].size)) {
+			ret = false;
+		}
+	}
+	return ret;
+}
+
+bool OutputStreamSink::write(const char *data, size_t size) {
+	if (!_stream) {
+		return false;
+	}
+
+	_stream->write(data, size);
+	return _stream->good();
+}
+
+bool OutputFdSink::write(const char *data, size_t size) {
+	while (size > 0) {
+		auto ret = ::write(_fd, data, size);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+
+		data += ret;
+		size -= size_t(ret);
+	}
+	return true;
+}
+
+bool OutputFdSink::write(const OutputSegment *segments, size_t count) {
+	struct iovec iov[64];
+	while (count > 0) {
+		size_t n = 0;
+		for (; n < count && n < sizeof(iov) / sizeof(struct iovec) && n < IOV_MAX; ++ n) {
+			iov[n].iov_base = (void *)segments[n].data;
+			iov[n].iov_len = segments[n].size;
+		}
+
+		auto ret = ::writev(_fd, iov, int(n));
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+
+		// skip written segments, partial segment is written with plain write
+		size_t written = size_t(ret);
+		size_t i = 0;
+		for (; i < n && written >= iov[i].iov_len; ++ i) {
+			written -= iov[i].iov_len;
+		}
+
+		if (i < n && !write(segments[i].data + written, segments[i].size - written)) {
+			return false;
+		} else if (i < n) {
+			++ i;
+		}
+
+		segments += i;
+		count -= i;
+	}
+	return true;
+}
+
+bool OutputBytesSink::write(const char *data, size_t size) {
+	if (!_bytes) {
+		return false;
+	}
+
+	_bytes->insert(_bytes->end(), (const uint8_t *)data, (const uint8_t *)data + size);
+	return true;
+}
+
+bool OutputCallbackSink::write(const char *data, size_t size) {
+	return _callback ? _callback(StringView(data, size)) : false;
+}
+
+OutputSegmentsSink::OutputSegmentsSink(memory::pool_t *pool)
+: _pool(pool ? pool : memory::pool::acquire()) { }
+
+bool OutputSegmentsSink::write(const char *data, size_t size) {
+	auto buf = (char *)memory::pool::palloc(_pool, size);
+	memcpy(buf, data, size);
+	_segments.emplace_back(OutputSegment{buf, size, true});
+	return true;
+}
+
+bool OutputSegmentsSink::write(const OutputSegment *segments, size_t count) {
+	for (size_t i = 0; i < count; ++ i) {
+		if (segments[i].ref) {
+			_segments.emplace_back(segments[i]);
+		} else {
+			write(segments[i].data, segments[i].size);
+		}
+	}
+	return true;
+}
+
+size_t OutputSegmentsSink::size() const {
+	size_t ret = 0;
+	for (auto &it : _segments) {
+		ret += it.size;
+	}
+	return ret;
+}
+
+void OutputSegmentsSink::clear() {
+	_segments.clear();
+}
+
+OutputBuffer::OutputBuffer(OutputSink *sink, size_t chunkSize)
+: _pool(memory::pool::acquire()), _sink(sink), _chunkSize(chunkSize) { }
+
+void OutputBuffer::setSink(OutputSink *sink) {
+	flush();
+	_sink = sink;
+	_failed = false;
+}
+
+void OutputBuffer::append(const OutputBuffer &other) {
+	for (auto c = other._front; c; c = c->next) {
+		if (c->ref) {
+			appendRef(c->ref, c->size);
+		} else {
+			append(c->data(), c->size);
+		}
+	}
+}
+
+StringView OutputBuffer::weak() {
+	if (!_front) {
+		return StringView();
+	}
+
+	if (_front->size == _size) {
+		return StringView(_front->data(), _size);
+	}
+
+	// merge data into new chunk, old chunks are kept for reuse
+	auto size = _size;
+	auto c = allocChunk(std::max(size, _chunkSize));
+	for (auto it = _front; it; it = it->next) {
+		memcpy(c->buf() + c->size, it->data(), it->size);
+		c->size += it->size;
+	}
+
+	clear();
+	c->next = _front;
+	_front = _back = c;
+	_size = size;
+	return StringView(c->data(), c->size);
+}
+
+memory::PoolInterface::StringType OutputBuffer::str() {
+	auto r = weak();
+	return memory::PoolInterface::StringType(r.data(), r.size());
+}
+
+void OutputBuffer::clear() {
+	// references are moved out of chunk list
+	Chunk **prev = &_front;
+	while (auto c = *prev) {
+		if (c->ref) {
+			*prev = c->next;
+			c->next = _refs;
+			_refs = c;
+		} else {
+			c->size = 0;
+			prev = &c->next;
+		}
+	}
+	_back = _front;
+	_size = 0;
+}
+
+bool OutputBuffer::flush() {
+	if (_sink) {
+		writeChunks();
+	}
+
+	auto ret = !_failed;
+	_failed = false;
+	return ret;
+}
+
+auto OutputBuffer::allocChunk(size_t capacity) -> Chunk * {
+	auto c = (Chunk *)memory::pool::palloc(_pool, sizeof(Chunk) + capacity);
+	c->next = nullptr;
+	c->size = 0;
+	c->capacity = capacity;
+	c->ref = nullptr;
+	return c;
+}
+
+char *OutputBuffer::reserveChunk(size_t size) {
+	if (_sink && _size > 0) {
+		// with sink data is written instead of allocating next chunk
+		writeChunks();
+		if (_back && _back->capacity >= size) {
+			return _back->buf();
+		}
+	}
+
+	auto next = _back ? _back->next : _front;
+	if (next && next->capacity >= size) {
+		_back = next;
+		return _back->buf();
+	}
+
+	auto c = allocChunk(std::max(size, _chunkSize));
+	if (!_back) {
+		c->next = _front;
+		_front = c;
+	} else {
+		c->next = _back->next;
+		_back->next = c;
+	}
+	_back = c;
+	return _back->buf();
+}
+
+void OutputBuffer::appendChunk(const char *data, size_t size) {
+	if (_sink && size >= _chunkSize) {
+		// large blocks are passed to sink directly
+		writeChunks();
+		if (!_sink->write(data, size)) {
+			_failed = true;
+		}
+		return;
+	}
+
+	memcpy(reserveChunk(size), data, size);
+	commit(size);
+}
+
+void OutputBuffer::appendRefChunk(const char *data, size_t size) {
+	Chunk *c = nullptr;
+	if (_refs) {
+		c = _refs;
+		_refs = c->next;
+	} else {
+		c = (Chunk *)memory::pool::palloc(_pool, sizeof(Chunk));
+	}
+
+	// reference is always full, so appending is never tried on it
+	c->size = size;
+	c->capacity = size;
+	c->ref = data;
+
+	// reference is inserted after current chunk, next data starts new chunk
+	if (!_back) {
+		c->next = _front;
+		_front = c;
+	} else {
+		c->next = _back->next;
+		_back->next = c;
+	}
+	_back = c;
+	_size += size;
+}
+
+void OutputBuffer::writeChunks() {
+	if (!_references) {
+		for (auto c = _front; c; c = c->next) {
+			if (c->size > 0 && !_sink->write(c->data(), c->size)) {
+				_failed = true;
+			}
+		}
+	} else {
+		OutputSegment segments[64];
+		size_t count = 0;
+		for (auto c = _front; c; c = c->next) {
+			if (c->size > 0) {
+				segments[count ++] = OutputSegment{c->data(), c->size, c->ref != nullptr};
+			}
+			if (count == sizeof(segments) / sizeof(OutputSegment) || (!c->next && count > 0)) {
+				if (!_sink->write(segments, count)) {
+					_failed = true;
+				}
+				count = 0;
+			}
+		}
+	}
+	clear();
+}
+
+void OutputBuffer::appendInteger(int64_t value) {
+	if (value < 0) {
+		append('-');
+		appendUnsigned(uint64_t(0) - uint64_t(value));
+	} else {
+		appendUnsigned(uint64_t(value));
+	}
+}
+
+void OutputBuffer::appendUnsigned(uint64_t value) {
+	char buf[20];
+	auto end = buf + sizeof(buf);
+	auto p = end;
+	do {
+		*(-- p) = char('0' + value % 10);
+		value /= 10;
+	} while (value);
+
+	append(p, end - p);
+}
+
+NS_MMD_END
@@ -0,0 +1,254 @@
+/**
+Copyright (c) 2017 Roman Katuntsev <sbkarr@stappler.org>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+**/
+
+#ifndef MMD_PROCESSORS_MMDOUTPUTBUFFER_H_
+#define MMD_PROCESSORS_MMDOUTPUTBUFFER_H_
+
+#include "MMDCommon.h"
+
+NS_MMD_BEGIN
+
+/// Part of output: copied data or reference to data, that outlives the buffer (source or literal)
+struct OutputSegment {
+	const char *data;
+	size_t size;
+	bool ref; // if false, data is in buffer's chunk, and will be overwritten after write
+};
+
+/// Destination for processor's output
+class OutputSink {
+public:
+	virtual ~OutputSink() { }
+
+	// returns false, if data was not written completely
+	virtual bool write(const char *, size_t) = 0;
+
+	// gathered write, called with all buffered segments in order
+	virtual bool write(const OutputSegment *, size_t count);
+
+	// if true, buffer keeps references to source data instead of copying it (see OutputBuffer::appendRef)
+	virtual bool isSegmented() const { return false; }
+};
+
+class OutputStreamSink : public OutputSink {
+public:
+	OutputStreamSink(std::ostream *stream = nullptr) : _stream(stream) { }
+
+	virtual bool write(const char *, size_t) override;
+
+protected:
+	std::ostream *_stream;
+};
+
+/// Writes segments with writev
+class OutputFdSink : public OutputSink {
+public:
+	OutputFdSink(int fd = -1) : _fd(fd) { }
+
+	virtual bool write(const char *, size_t) override;
+	virtual bool write(const OutputSegment *, size_t count) override;
+	virtual bool isSegmented() const override { return true; }
+
+protected:
+	int _fd;
+};
+
+class OutputBytesSink : public OutputSink {
+public:
+	OutputBytesSink(Bytes *bytes = nullptr) : _bytes(bytes) { }
+
+	virtual bool write(const char *, size_t) override;
+
+protected:
+	Bytes *_bytes;
+};
+
+/// Passes output to callback, references are passed without copying
+class OutputCallbackSink : public OutputSink {
+public:
+	using Callback = Function<bool(const StringView &)>;
+
+	OutputCallbackSink(Callback && cb = nullptr) : _callback(move(cb)) { }
+
+	virtual bool write(const char *, size_t) override;
+	virtual bool isSegmented() const override { return true; }
+
+protected:
+	Callback _callback;
+};
+
+/// Collects segments for socket layers and other gathered writers. References are kept as is,
+/// other data is copied into sink's pool. References point into document's source, so segments should
+/// be consumed within Engine::process callback, while engine is not cleared.
+class OutputSegmentsSink : public OutputSink {
+public:
+	OutputSegmentsSink(memory::pool_t *pool = nullptr);
+
+	virtual bool write(const char *, size_t) override;
+	virtual bool write(const OutputSegment *, size_t count) override;
+	virtual bool isSegmented() const override { return true; }
+
+	const Vector<OutputSegment> &getSegments() const { return _segments; }
+	size_t size() const;
+
+	void clear();
+
+protected:
+	memory::pool_t *_pool = nullptr;
+	Vector<OutputSegment> _segments;
+};
+
+/// Append-only output, collected in chunks from current memory pool. Chunks are kept for reuse on clear.
+/// With sink, data is passed to sink on flush or when current chunk is full, so memory usage is limited
+/// with one chunk; without sink data is kept until clear.
+///
+/// With references enabled, large blocks of source are stored as references between chunks and passed
+/// to sink as separate segments, so they are never copied into output.
+class OutputBuffer {
+public:
+	static constexpr size_t DefaultChunkSize = 16_KiB;
+
+	// smaller references are copied, it's cheaper than separate segment
+	static constexpr size_t MinReferenceSize = 128;
+
+	OutputBuffer(OutputSink * = nullptr, size_t chunkSize = DefaultChunkSize);
+
+	OutputBuffer(const OutputBuffer &) = delete;
+	OutputBuffer & operator=(const OutputBuffer &) = delete;
+
+	void setSink(OutputSink *);
+	OutputSink *getSink() const { return _sink; }
+
+	// with sink, it's max size of data, collected before write
+	void setChunkSize(size_t size) { _chunkSize = size; }
+	size_t getChunkSize() const { return _chunkSize; }
+
+	void setReferences(bool value) { _references = value; }
+	bool hasReferences() const { return _references; }
+
+	// contiguous space for at least `size` bytes, commit actual number of written bytes after writing
+	char *reserve(size_t size) {
+		if (_back && _back->capacity - _back->size >= size) {
+			return _back->buf() + _back->size;
+		}
+		return reserveChunk(size);
+	}
+
+	void commit(size_t size) {
+		_back->size += size;
+		_size += size;
+	}
+
+	void append(const char *data, size_t size) {
+		if (_back && _back->capacity - _back->size >= size) {
+			memcpy(_back->buf() + _back->size, data, size);
+			_back->size += size;
+			_size += size;
+		} else if (size > 0) {
+			appendChunk(data, size);
+		}
+	}
+
+	void append(const StringView &str) { append(str.data(), str.size()); }
+	void append(const OutputBuffer &);
+
+	// data should be valid until buffer is flushed or cleared, copied if references are disabled
+	void appendRef(const char *data, size_t size) {
+		if (_references && size >= MinReferenceSize) {
+			appendRefChunk(data, size);
+		} else {
+			append(data, size);
+		}
+	}
+
+	void appendRef(const StringView &str) { appendRef(str.data(), str.size()); }
+
+	void append(char c) {
+		if (_back && _back->size < _back->capacity) {
+			_back->buf()[_back->size ++] = c;
+			++ _size;
+		} else {
+			appendChunk(&c, 1);
+		}
+	}
+
+	OutputBuffer & operator<<(const StringView &str) { append(str.data(), str.size()); return *this; }
+	OutputBuffer & operator<<(const char *str) { append(str, strlen(str)); return *this; }
+	OutputBuffer & operator<<(char c) { append(c); return *this; }
+
+	template <typename T>
+	auto operator<<(T value) -> typename std::enable_if<std::is_integral<T>::value
+			&& !std::is_same<T, char>::value && !std::is_same<T, bool>::value, OutputBuffer &>::type {
+		if (std::is_signed<T>::value) {
+			appendInteger(int64_t(value));
+		} else {
+			appendUnsigned(uint64_t(value));
+		}
+		return *this;
+	}
+
+	size_t size() const { return _size; }
+	bool empty() const { return _size == 0; }
+
+	// contiguous view of buffered data, chunks are merged if required
+	StringView weak();
+	memory::PoolInterface::StringType str();
+
+	void clear();
+
+	// pass buffered data to sink, returns false if sink failed to write some data since last check
+	bool flush();
+
+protected:
+	struct Chunk {
+		Chunk *next;
+		size_t size;
+		size_t capacity;
+		const char *ref; // external data for references
+
+		char *buf() { return (char *)(this + 1); } // storage for data, not used for references
+		const char *data() const { return ref ? ref : (const char *)(this + 1); }
+	};
+
+	Chunk *allocChunk(size_t);
+	char *reserveChunk(size_t);
+	void appendChunk(const char *, size_t);
+	void appendRefChunk(const char *, size_t);
+	void writeChunks();
+
+	void appendInteger(int64_t);
+	void appendUnsigned(uint64_t);
+
+	memory::pool_t *_pool = nullptr;
+	OutputSink *_sink = nullptr;
+	size_t _chunkSize = DefaultChunkSize;
+	size_t _size = 0;
+	Chunk *_front = nullptr;
+	Chunk *_back = nullptr; // current chunk, all next chunks are empty
+	Chunk *_refs = nullptr; // unused reference chunks
+	bool _references = false;
+	bool _failed = false;
+};
+
+NS_MMD_END
+
+#endif /* MMD_PROCESSORS_MMDOUTPUTBUFFER_H_ */
@@ -124,7 +124,7 @@ void Processor::processMeta(const StringView &key, const StringView &value) {
 	}
 }
 
-void Processor::printTokenRaw(std::ostream & out, token * t) {
+void Processor::printTokenRaw(OutputBuffer & out, token * t) {
 	if (t) {
 		switch (t->type) {
 			case EMPH_START:
@@ -140,13 +140,13 @@ void Processor::printTokenRaw(std::ostream & out, token * t) {
 				break;
 
 			default:
-				out << StringView(&source[t->start], t->len);
+				out.appendRef(StringView(&source[t->start], t->len));
 				break;
 		}
 	}
 }
 
-void Processor::printTokenTreeRaw(std::ostream & out, token * t) {
+void Processor::printTokenTreeRaw(OutputBuffer & out, token * t) {
 	while (t) {
 		printTokenRaw(out, t);
 		t = t->next;
@@ -204,6 +204,10 @@ void Processor::readTableColumnAlignments(token * table) {
 	table_column_count = counter;
 }
 
+Content::Link * Processor::getLink(const StringView &label) {
+	return content->getLink(label);
+}
+
 Content::Link * Processor::parseBrackets(token * bracket, int16_t * skip_token) {
 	Content::Link * temp_link = nullptr;
 	StringView temp_char;
@@ -266,7 +270,7 @@ Content::Link * Processor::parseBrackets(token * bracket, int16_t * skip_token)
 		temp_short = 0;
 	}
 
-	temp_link = content->getLink(temp_char);
+	temp_link = getLink(temp_char);
 	if (temp_link) {
 		// Don't output brackets
 		if (bracket->child) {
@@ -317,8 +321,8 @@ Content::Footnote *Processor::parseAbbrBracket(token * t) {
 			// Adjust the properties
 			temp->label_text = temp->clean_text;
 			if (temp->content && temp->content.getToken()->child) {
-				temp->clean_text = clean_string_from_range(source, temp->content.getToken()->child->start,
-						t->start + t->len - t->child->mate->len - temp->content.getToken()->child->start, false);
+				auto start = temp->content.getToken()->child->start;
+				temp->clean_text = Content::cleanView(StringView(&source[start], t->start + t->len - t->child->mate->len - start), false);
 			}
 
 			// Store as used
@@ -43,6 +43,7 @@
 #define MMD_PROCESSORS_MMDPROCESSOR_H_
 
 #include "MMDContent.h"
+#include "MMDOutputBuffer.h"
 
 NS_MMD_BEGIN
 
@@ -71,10 +72,14 @@ protected:
 	virtual void processMetaDict(const Dict<Content::String> &);
 	virtual void processMeta(const StringView &, const StringView &);
 
-	void printTokenRaw(std::ostream & out, token * t);
-	void printTokenTreeRaw(std::ostream & out, token * t);
+	void printTokenRaw(OutputBuffer & out, token * t);
+	void printTokenTreeRaw(OutputBuffer & out, token * t);
 
 	void readTableColumnAlignments(token * table);
+
+	// reference lookup, processors, that reuse output, track link definitions used by blocks with it
+	virtual Content::Link * getLink(const StringView &);
+
 	Content::Link * parseBrackets(token * bracket, int16_t * skip_token);
 	Content::Footnote *parseAbbrBracket(token * t);
 	Content::Footnote *parseCitationBracket(token * t);
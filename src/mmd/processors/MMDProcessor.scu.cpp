@@ -24,8 +24,10 @@ THE SOFTWARE.
 **/
 
 #include "SPCommon.h"
+#include "MMDHtmlFragmentCache.cc"
 #include "MMDHtmlOutputProcessor.cc"
 #include "MMDHtmlProcessor.cc"
 #include "MMDHtmlProcessorBlocks.cc"
 #include "MMDHtmlProcessorToken.cc"
+#include "MMDOutputBuffer.cc"
 #include "MMDProcessor.cc"